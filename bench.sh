@@ -0,0 +1,57 @@
+#!/bin/bash
+# Metadata microbenchmark on a loop device, run through `make bench`.
+# Every workload of util/bench.tomofs runs in turn against one mount,
+# with the page, inode and dentry caches dropped in between.
+#
+# FILES, THREADS and IO_SIZE are passed to bench.tomofs; BLOCK_SIZE to
+# mkfs.tomofs. IMAGE_SIZE, IMAGE and MNT set up the loop device.
+
+set -e
+
+FILES=${FILES:-10000}
+THREADS=${THREADS:-4}
+IO_SIZE=${IO_SIZE:-4096}
+BLOCK_SIZE=${BLOCK_SIZE:-4096}
+IMAGE_SIZE=${IMAGE_SIZE:-4G}
+IMAGE=${IMAGE:-/tmp/tomofs-bench.img}
+MNT=${MNT:-/mnt/tomofs-bench}
+WORKLOADS="mkdir create write stat lookup readdir read"
+
+LOOP=
+LOADED=
+
+cleanup() {
+	if mountpoint -q "$MNT"; then
+		sudo umount "$MNT"
+	fi
+	if [ -n "$LOOP" ]; then
+		sudo losetup -d "$LOOP"
+	fi
+	if [ -n "$LOADED" ]; then
+		sudo rmmod tomofs
+	fi
+	rm -f "$IMAGE"
+}
+trap cleanup EXIT
+
+rm -f "$IMAGE"
+truncate -s "$IMAGE_SIZE" "$IMAGE"
+LOOP=$(sudo losetup -f --show "$IMAGE")
+
+sudo modprobe jbd2
+if ! lsmod | grep -q '^tomofs '; then
+	sudo insmod ./tomofs.ko
+	LOADED=1
+fi
+
+sudo ./util/mkfs.tomofs -b "$BLOCK_SIZE" "$LOOP" > /dev/null
+sudo mkdir -p "$MNT"
+sudo mount -t tomofs "$LOOP" "$MNT"
+
+echo "$FILES files, $THREADS threads, $IO_SIZE byte io, $BLOCK_SIZE byte blocks"
+for w in $WORKLOADS; do
+	sync
+	echo 3 | sudo tee /proc/sys/vm/drop_caches > /dev/null
+	sudo ./util/bench.tomofs -n "$FILES" -t "$THREADS" -s "$IO_SIZE" \
+	    "$MNT" "$w"
+done
@@ -0,0 +1,70 @@
+#!/bin/bash
+# Regression checks on a loop device, run through `make check`.
+# Each check runs against a fresh `-o compress` mount, with the page,
+# inode and dentry caches dropped so that data is read back from disk.
+#
+# BLOCK_SIZE is passed to mkfs.tomofs. IMAGE_SIZE, IMAGE and MNT set up
+# the loop device.
+
+set -e
+
+BLOCK_SIZE=${BLOCK_SIZE:-4096}
+IMAGE_SIZE=${IMAGE_SIZE:-256M}
+IMAGE=${IMAGE:-/tmp/tomofs-check.img}
+MNT=${MNT:-/mnt/tomofs-check}
+
+LOOP=
+LOADED=
+
+cleanup() {
+	if mountpoint -q "$MNT"; then
+		sudo umount "$MNT"
+	fi
+	if [ -n "$LOOP" ]; then
+		sudo losetup -d "$LOOP"
+	fi
+	if [ -n "$LOADED" ]; then
+		sudo rmmod tomofs
+	fi
+	rm -f "$IMAGE"
+}
+trap cleanup EXIT
+
+drop_caches() {
+	sync
+	echo 3 | sudo tee /proc/sys/vm/drop_caches > /dev/null
+}
+
+# A page-aligned truncate inside a cluster must not bring back the old
+# data past the new EOF once the file grows again
+check_truncate_extend() {
+	local f="$MNT/truncate"
+
+	sudo dd if=/dev/urandom of="$f" bs=16384 count=1 status=none
+	drop_caches
+	sudo truncate -s 8192 "$f"
+	drop_caches
+	sudo truncate -s 16384 "$f"
+	drop_caches
+	sudo tail -c +8193 "$f" | cmp -n 8192 - /dev/zero
+}
+
+rm -f "$IMAGE"
+truncate -s "$IMAGE_SIZE" "$IMAGE"
+LOOP=$(sudo losetup -f --show "$IMAGE")
+
+sudo modprobe jbd2
+if ! lsmod | grep -q '^tomofs '; then
+	sudo insmod ./tomofs.ko
+	LOADED=1
+fi
+
+sudo mkdir -p "$MNT"
+for c in truncate_extend; do
+	sudo ./util/mkfs.tomofs -b "$BLOCK_SIZE" "$LOOP" > /dev/null
+	sudo mount -t tomofs -o compress "$LOOP" "$MNT"
+	echo -n "$c: "
+	check_$c
+	echo ok
+	sudo umount "$MNT"
+done
@@ -7,11 +7,18 @@
 #define TOMOFS_SB_BLK_NO 0
 #define TOMOFS_SB_MAGIC 0xdeadbeef
 #define TOMOFS_ROOTDIR_INODE_NO 1
-#define TOMOFS_BLK_SIZE (1 << 12) /* (== 4KiB; PAGE_SIZE on x86_64) */
-#define TOMOFS_MAX_FILENAME_LEN 64
+/*
+ * The block size is chosen by mkfs and recorded in the super block.
+ * Capacities below that depend on it take the block size @bs.
+ */
+#define TOMOFS_BLK_SIZE (1 << 12) /* default (== 4KiB; PAGE_SIZE on x86_64) */
+#define TOMOFS_MIN_BLK_BITS 10
+#define TOMOFS_MAX_BLK_BITS 16
+#define TOMOFS_MAX_FILENAME_LEN 255
 
-/* TODO: Limit this if we only allow direct blocks */
-static const loff_t TOMOFS_MAXBYTES = TOMOFS_BLK_SIZE;
+/* File blocks are addressed with 32 bits */
+#define TOMOFS_MAX_FILE_BLKS 0xffffffffULL
+#define TOMOFS_MAXBYTES(bs) ((loff_t)TOMOFS_MAX_FILE_BLKS * (bs))
 
 enum tomofs_obj_type {
 	TOMOFS_INODE,
@@ -20,74 +27,1031 @@ enum tomofs_obj_type {
 
 /*
  * @head: ADDRESS
- * @count: number of free blocks from ADDRESS
- * TODO: Change this.
+ * @count: number of blocks from ADDRESS
  */
 struct block_extent {
 	uintptr_t head;
 	loff_t count;
 };
 
+/*
+ * @block_map: ADDRESS of the free space bitmap, one bit per block
+ * @block_cnt: number of blocks on the device
+ */
 struct block_dev {
 	uintptr_t block_map;
 	uint64_t block_cnt;
 };
 
+/* Blocks tracked by one block of the free space bitmap */
+#define TOMOFS_BITMAP_BITS(bs) ((bs) * 8)
+
+/* Changed when extents grew clen, so older trees are refused */
+#define TOMOFS_EXTENT_MAGIC 0xe7e8
+
+/*
+ * Extent tree node header.
+ * The root node lives in the inode, other nodes take up a whole block.
+ * @entries: number of entries following the header
+ * @max: capacity of the node
+ * @depth: 0 for leaves, otherwise height of the subtree
+ */
+struct tomofs_extent_header {
+	uint16_t magic;
+	uint16_t entries;
+	uint16_t max;
+	uint16_t depth;
+};
+
+/*
+ * Leaf entry.
+ * @lblk: first file block mapped
+ * @ext: on-disk blocks backing file blocks [lblk, lblk + ext.count)
+ * @clen: 0, or the length in bytes of the compressed cluster at @lblk
+ *   stored in @ext, see TOMOFS_CLUSTER_SIZE
+ */
+struct tomofs_extent {
+	uint64_t lblk;
+	struct block_extent ext;
+	uint64_t clen;
+};
+
+/*
+ * Compressed files are stored in clusters of TOMOFS_CLUSTER_SIZE bytes,
+ * each LZ4 compressed into as few blocks as it fits in and mapped by an
+ * extent of its own. A cluster that doesn't save a block is stored as is,
+ * with a clen of TOMOFS_CLUSTER_SIZE.
+ */
+#define TOMOFS_CLUSTER_SHIFT 14
+#define TOMOFS_CLUSTER_SIZE (1 << TOMOFS_CLUSTER_SHIFT)
+#define TOMOFS_CLUSTER_BLKS(bs) (TOMOFS_CLUSTER_SIZE / (bs))
+
+/* File blocks mapped by @ex */
+static inline uint64_t tomofs_extent_len(struct tomofs_extent *ex,
+    unsigned long bs)
+{
+	return ex->clen ? TOMOFS_CLUSTER_BLKS(bs) : (uint64_t)ex->ext.count;
+}
+
+/*
+ * Index entry.
+ * @lblk: first file block mapped by the subtree
+ * @child: ADDRESS of the child node
+ */
+struct tomofs_extent_idx {
+	uint64_t lblk;
+	uintptr_t child;
+};
+
+#define TOMOFS_INODE_EXTENTS 4
+#define TOMOFS_INODE_EXTENT_IDX \
+    (TOMOFS_INODE_EXTENTS * sizeof(struct tomofs_extent) / \
+    sizeof(struct tomofs_extent_idx))
+
+#define TOMOFS_BLK_EXTENTS(bs) \
+    (((bs) - sizeof(struct tomofs_extent_header)) / \
+    sizeof(struct tomofs_extent))
+#define TOMOFS_BLK_EXTENT_IDX(bs) \
+    (((bs) - sizeof(struct tomofs_extent_header)) / \
+    sizeof(struct tomofs_extent_idx))
+
+struct tomofs_extent_root {
+	struct tomofs_extent_header hdr;
+	union {
+		struct tomofs_extent extents[TOMOFS_INODE_EXTENTS];
+		struct tomofs_extent_idx idx[TOMOFS_INODE_EXTENT_IDX];
+	};
+};
+
+/* Inode flags */
+#define TOMOFS_INODE_USED 0x1
+/* File contents are in inline_data instead of the extent tree */
+#define TOMOFS_INODE_INLINE 0x2
+/* Some extents may be shared with other files, see the refcount map */
+#define TOMOFS_INODE_SHARED 0x4
+/* File data is stored in compressed clusters */
+#define TOMOFS_INODE_COMPRESSED 0x8
+
+#define TOMOFS_INODE_SIZE 256
+/* Whatever the other fields leave of TOMOFS_INODE_SIZE */
+#define TOMOFS_INLINE_DATA 176
+
 struct tomofs_inode {
 	int flags;
 	mode_t mode;
 	unsigned long i_ino;
-	uintptr_t inode_block_ptr;
 	struct timespec i_atime;
 	struct timespec i_mtime;
 	struct timespec i_ctime;
+	/* For directories, the size in bytes of their blocks */
+	uint64_t file_size;
+	uint64_t child_count;
 	union {
-		uint64_t file_size;
-		uint64_t child_count;
+		struct tomofs_extent_root extents;
+		char inline_data[TOMOFS_INLINE_DATA];
 	};
 };
 
+#define TOMOFS_INODES_PER_BLK(bs) ((bs) / TOMOFS_INODE_SIZE)
+
 /*
- * Max number of inodes supported.
- * Limited to the number of struct tomofs_inodes that fit in a 8KiB block.
- * since we only use 1 block to store inodes.
- * TODO: Dynamic inode allocation
+ * Inode tables
+ * Every allocation group tracks its inodes with a one block inode bitmap,
+ * so a group holds up to TOMOFS_AG_INODES inodes. Inode number N is index
+ * N % TOMOFS_AG_INODES of group N / TOMOFS_AG_INODES. Index 0 of every
+ * group is reserved.
+ * The table itself is allocated on demand in chunks of
+ * TOMOFS_INODE_CHUNK_BLKS contiguous blocks. A one block chunk map holds
+ * the ADDRESS of each chunk, or 0 if it has not been allocated yet. With
+ * 1KiB blocks the chunk map, not the bitmap, limits a group's inodes.
  */
-#define TOMOFS_MAXINODES (TOMOFS_BLK_SIZE / sizeof(struct tomofs_inode))
+#define TOMOFS_INODE_CHUNK_BLKS 8
+#define TOMOFS_INODE_CHUNK_INODES(bs) \
+    (TOMOFS_INODE_CHUNK_BLKS * TOMOFS_INODES_PER_BLK(bs))
+#define TOMOFS_INODE_CHUNKS(bs) ((bs) / sizeof(uintptr_t))
+#define TOMOFS_AG_INODES(bs) \
+    (TOMOFS_BITMAP_BITS(bs) < \
+    TOMOFS_INODE_CHUNKS(bs) * TOMOFS_INODE_CHUNK_INODES(bs) ? \
+    TOMOFS_BITMAP_BITS(bs) : \
+    TOMOFS_INODE_CHUNKS(bs) * TOMOFS_INODE_CHUNK_INODES(bs))
 
-struct tomofs_directory_record {
-	char filename[64];
-	unsigned long i_ino;
+/*
+ * Directories
+ * A directory is a B+tree of its own blocks keyed by tomofs_name_hash().
+ * Block 0 is the root. Index nodes hold struct tomofs_dx_entry, one per
+ * child block. Leaves hold a slot array sorted by hash right after the
+ * header, and the variable-length records the slots point to packed
+ * against the end of the block. Records with the same hash always share
+ * a leaf.
+ */
+#define TOMOFS_DX_MAGIC 0xd1d2
+
+/*
+ * Directory block header
+ * @entries: number of slots or index entries following the header
+ * @max: capacity of an index node, 0 in leaves
+ * @depth: 0 for leaves, otherwise height of the subtree
+ * @heap: offset of the lowest record in a leaf, 0 if empty so that it fits
+ * 16 bits with 64KiB blocks
+ */
+struct tomofs_dx_header {
+	uint16_t magic;
+	uint16_t entries;
+	uint16_t max;
+	uint16_t depth;
+	uint16_t heap;
+	uint16_t pad[3];
 };
 
-#define TOMOFS_DIR_MAXINODES \
-    (TOMOFS_BLK_SIZE / sizeof(struct tomofs_directory_record))
+/*
+ * Index entry.
+ * @hash: lowest hash in the subtree
+ * @lblk: directory block of the child
+ */
+struct tomofs_dx_entry {
+	uint32_t hash;
+	uint32_t lblk;
+};
 
+/*
+ * Leaf slot.
+ * @hash: hash of the record's name
+ * @off: offset of the record in the block
+ * @len: size of the record, see TOMOFS_DIRENT_LEN()
+ */
+struct tomofs_dx_slot {
+	uint32_t hash;
+	uint16_t off;
+	uint16_t len;
+};
+
+/*
+ * Directory record
+ * @i_ino: inode number
+ * @name_len: length of @name, which is not NUL terminated
+ * @file_type: DT_* type of the inode, for readdir
+ */
+struct tomofs_dirent {
+	uint64_t i_ino;
+	uint8_t name_len;
+	uint8_t file_type;
+	char name[];
+};
+
+/* Records are padded to keep i_ino aligned */
+#define TOMOFS_DIRENT_LEN(name_len) \
+    ((offsetof(struct tomofs_dirent, name) + (name_len) + 7) & ~(size_t)7)
+
+/* DT_* values are the S_IFMT bits of the mode */
+static inline uint8_t tomofs_mode_to_dtype(uint32_t mode)
+{
+	return (mode >> 12) & 15;
+}
+
+#define TOMOFS_DX_ENTRIES(bs) \
+    (((bs) - sizeof(struct tomofs_dx_header)) / \
+    sizeof(struct tomofs_dx_entry))
+
+/* FNV-1a, shared with the userspace tools so it must never change */
+static inline uint32_t tomofs_name_hash(const char *name, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+/*
+ * Allocation groups
+ * Group N covers blocks [N * TOMOFS_AG_BLOCKS, (N + 1) * TOMOFS_AG_BLOCKS)
+ * and is tracked by block N of the free space bitmap. Every group has its
+ * own inode table and is allocated from independently.
+ * Groups other than group 0 start with their inode bitmap and chunk map.
+ * These TOMOFS_AG_HDR_BLKS blocks are always in use and are left out of
+ * the free space bitmap, so all the metadata of a new group is zeros.
+ */
+#define TOMOFS_AG_BLOCKS(bs) TOMOFS_BITMAP_BITS(bs)
+#define TOMOFS_AG_HDR_BLKS 2
+
+/*
+ * Shared blocks
+ * Blocks cloned into several files are counted in a refcount map holding
+ * a 16 bit count for every block of the group, TOMOFS_REFCOUNT_BLKS
+ * contiguous blocks. A count is the number of owners beyond the first,
+ * so the map is zeros wherever blocks are not shared, and a group gets
+ * one only once a clone shares its blocks.
+ */
+#define TOMOFS_REFCOUNT_BLKS 16
+#define TOMOFS_REFCOUNTS_PER_BLK(bs) ((bs) / sizeof(uint16_t))
+#define TOMOFS_REFCOUNT_MAX 0xffff
+
+/*
+ * @inode_bitmap: ADDRESS of the group's inode bitmap
+ * @inode_chunks: ADDRESS of the group's inode table chunk map
+ * @inode_count: number of inodes in use in the group
+ * @refcount_map: ADDRESS of the group's refcount map, 0 if it has none
+ */
+struct tomofs_ag_desc {
+	uintptr_t inode_bitmap;
+	uintptr_t inode_chunks;
+	uint64_t inode_count;
+	uintptr_t refcount_map;
+};
+
+#define TOMOFS_AG_DESC_PER_BLK(bs) \
+    ((bs) / sizeof(struct tomofs_ag_desc))
+
+/*
+ * Metadata journal, a jbd2 journal in a fixed region of group 0.
+ * mkfs sizes it from the device, up to TOMOFS_JOURNAL_MAX_BYTES unless
+ * that is less than the 1024 blocks jbd2 requires.
+ */
+#define TOMOFS_JOURNAL_BLKS 1024
+#define TOMOFS_JOURNAL_MAX_BYTES (64 << 20)
+
+/*
+ * The super block is at the start of block 0, which mount first reads
+ * with the smallest block size.
+ * @blocksize_bits: log2 of the block size
+ * @inode_count: inodes in use, summed over all groups at sync time
+ * @ag_table: ADDRESS of the allocation group descriptors
+ * @ag_count: number of allocation groups
+ * @journal: journal region
+ * @free_blocks: free blocks, also only updated at sync time. The bitmap
+ *   is what mount goes by.
+ */
 struct tomofs_super_block {
 	int magic;
+	uint32_t blocksize_bits;
 	struct block_dev dev;
 	uint64_t inode_count;
-	uintptr_t inodes;
+	uintptr_t ag_table;
+	uint64_t ag_count;
+	struct block_extent journal;
+	uint64_t free_blocks;
+};
+
+#ifdef __KERNEL__
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/jbd2.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/workqueue.h>
+
+/*
+ * In-memory free space index, built from the bitmap at mount time.
+ * @by_offset: free extents sorted by start block, for coalescing
+ * @by_size: free extents sorted by length, for best-fit allocation
+ * @trimmed: minimum length of the last FITRIM of the whole group, 0 once
+ *   blocks have been freed since
+ */
+struct tomofs_free_space {
+	struct mutex lock;
+	struct rb_root by_offset;
+	struct rb_root by_size;
+	uint64_t free_blocks;
+	uint64_t trimmed;
+};
+
+/*
+ * In-memory allocation group
+ * @free: free space of the group, under its own lock
+ * @inode_lock: serializes inode allocation in the group
+ * @inode_bitmap: inode bitmap block, pinned while mounted
+ * @inode_chunks: inode table chunk map block, pinned while mounted
+ * @inode_hint: where to start looking for a free inode
+ * @desc: in-memory copy of the on-disk descriptor
+ */
+struct tomofs_ag {
+	struct tomofs_free_space free;
+	struct mutex inode_lock;
+	struct buffer_head *inode_bitmap;
+	struct buffer_head *inode_chunks;
+	uint64_t inode_hint;
+	struct tomofs_ag_desc desc;
+};
+
+/*
+ * Operations counted in the per-superblock statistics, see src/stats.c.
+ * Latencies go into TOMOFS_LAT_BUCKETS log2 buckets of nanoseconds.
+ */
+enum tomofs_stat_op {
+	TOMOFS_OP_LOOKUP,
+	TOMOFS_OP_CREATE,
+	TOMOFS_OP_MKDIR,
+	TOMOFS_OP_READDIR,
+	TOMOFS_OP_SETATTR,
+	TOMOFS_OP_FSYNC,
+	TOMOFS_OP_READ_INODE,
+	TOMOFS_OP_SAVE_INODE,
+	TOMOFS_OP_SYNC_SB,
+	TOMOFS_OP_ALLOC_INO,
+	TOMOFS_OP_ALLOC_BLOCKS,
+	TOMOFS_OP_FREE_BLOCKS,
+	TOMOFS_NR_OPS,
+};
+
+#define TOMOFS_LAT_BUCKETS 32
+
+struct tomofs_op_stats {
+	u64 count;
+	u64 errors;
+	u64 ns;
+	u64 hist[TOMOFS_LAT_BUCKETS];
 };
 
+/* One per CPU, summed when read */
+struct tomofs_stats {
+	struct tomofs_op_stats ops[TOMOFS_NR_OPS];
+};
+
+/* Mount options */
+#define TOMOFS_MOUNT_DISCARD (1 << 0)
+/* New files are compressed */
+#define TOMOFS_MOUNT_COMPRESS (1 << 1)
+
+/*
+ * @sb: VFS super block
+ * @mount_opts: TOMOFS_MOUNT_* flags
+ * @ags: allocation groups, tsb.ag_count of them
+ * @ag_rotor: spreads new directories over the groups
+ * @journal: metadata journal
+ * @freed_lock: protects the freed block lists of running transactions
+ *   and @discard_list
+ * @discard_list: committed freed extents waiting to be discarded
+ * @discard_work: discards @discard_list, then releases it
+ * @free_blocks: free blocks in all groups
+ * @delalloc_blocks: blocks promised to dirty pages but not yet allocated
+ * @free_inodes: inodes left in all groups
+ * @reserve_lock: serializes reservations once space runs low
+ * @refcount_maps: groups with a refcount map, which a truncate may touch
+ * @cws_lock: protects @cws_idle and @cws_count
+ * @cws_idle: compression workspaces not in use
+ * @cws_count: compression workspaces allocated
+ * @cws_wait: waiters for an idle workspace
+ * @stats: per-CPU operation counts and latencies, NULL until mounted
+ * @debugfs: debugfs directory of the mount
+ */
+struct tomofs_sb_info {
+	struct tomofs_super_block tsb;
+	struct super_block *sb;
+	unsigned long mount_opts;
+	struct tomofs_ag *ags;
+	atomic_t ag_rotor;
+	journal_t *journal;
+	spinlock_t freed_lock;
+	struct list_head discard_list;
+	struct work_struct discard_work;
+	struct percpu_counter free_blocks;
+	struct percpu_counter delalloc_blocks;
+	struct percpu_counter free_inodes;
+	spinlock_t reserve_lock;
+	atomic_t refcount_maps;
+	spinlock_t cws_lock;
+	struct list_head cws_idle;
+	int cws_count;
+	wait_queue_head_t cws_wait;
+	struct tomofs_stats __percpu *stats;
+	struct dentry *debugfs;
+};
+
+static inline struct tomofs_sb_info *TOMOFS_SB(struct super_block *sb)
+{
+	return (struct tomofs_sb_info *)sb->s_fs_info;
+}
+
+/*
+ * In-memory inode, allocated by tomofs_alloc_inode()
+ * @t_inode: copy of the on-disk inode
+ * @sem: covers @t_inode and its extent tree. Writers are extent tree
+ * updates, readers are lookups and saves of the inode to the table.
+ * Directory contents are covered by the VFS i_rwsem.
+ * @delalloc: dirty file blocks that have no disk block yet
+ * @bloom: filter of the name hashes of a large directory, built by the
+ * first lookup that misses. NULL until then.
+ */
+struct tomofs_inode_info {
+	struct tomofs_inode t_inode;
+	struct rw_semaphore sem;
+	atomic_t delalloc;
+	struct tomofs_dx_bloom *bloom;
+	struct inode vfs_inode;
+};
+
+static inline struct tomofs_inode_info *TOMOFS_I(struct inode *inode)
+{
+	return container_of(inode, struct tomofs_inode_info, vfs_inode);
+}
+
+static inline struct tomofs_inode *TOMOFS_T(struct inode *inode)
+{
+	return &TOMOFS_I(inode)->t_inode;
+}
+
+/* Only changes under i_rwsem with the inode's sem held for writing */
+static inline bool tomofs_has_inline(struct tomofs_inode *t_inode)
+{
+	return t_inode->flags & TOMOFS_INODE_INLINE;
+}
+
+/* Set by clone on both files and never cleared */
+static inline bool tomofs_is_shared(struct tomofs_inode *t_inode)
+{
+	return t_inode->flags & TOMOFS_INODE_SHARED;
+}
+
+/* Set when a file is created on a -o compress mount and never cleared */
+static inline bool tomofs_is_compressed(struct tomofs_inode *t_inode)
+{
+	return t_inode->flags & TOMOFS_INODE_COMPRESSED;
+}
+
+static inline struct rw_semaphore *tomofs_inode_sem(
+    struct tomofs_inode *t_inode)
+{
+	return &container_of(t_inode, struct tomofs_inode_info, t_inode)->sem;
+}
+
+/* No allocation group preference, start from the current CPU's group */
+#define TOMOFS_AG_ANY ((uint64_t)-1)
+
+/* Allocation group of block @blk */
+static inline uint64_t tomofs_blk_ag(struct super_block *sb, uint64_t blk)
+{
+	return blk / TOMOFS_AG_BLOCKS(sb->s_blocksize);
+}
+
+static inline uint64_t tomofs_ino_ag(struct super_block *sb, uint64_t ino)
+{
+	return ino / TOMOFS_AG_INODES(sb->s_blocksize);
+}
+
+/* Slot of inode @ino in the table block returned by tomofs_inode_bread() */
+static inline uint64_t tomofs_ino_slot(struct super_block *sb, uint64_t ino)
+{
+	return (ino % TOMOFS_AG_INODES(sb->s_blocksize)) %
+	    TOMOFS_INODES_PER_BLK(sb->s_blocksize);
+}
+
+/*
+  * Load allocation groups
+  * @sb: super block
+  *
+  * Reads the group descriptors and scans each group's bitmap block into
+  * its in-memory free extent index. Sets up the free block and inode
+  * counters.
+  */
+int tomofs_load_ags(struct super_block *sb);
+
+/*
+  * Destroy allocation groups
+  * @sb: super block
+  *
+  * Frees the in-memory group state. The bitmap is left as is.
+  */
+void tomofs_destroy_ags(struct super_block *sb);
+
+/*
+  * Save allocation group descriptor
+  * @sb: super block
+  * @agno: group whose in-memory descriptor is copied to disk
+  *
+  * Called with the group's inode_lock held.
+  */
+int tomofs_save_ag_desc(struct super_block *sb, uint64_t agno);
+
+/*
+  * Release blocks
+  * @sb: super block
+  * @start: first block
+  * @count: number of blocks, all in one allocation group
+  *
+  * Hands blocks whose bitmap bits were already cleared back to the
+  * in-memory free space index.
+  */
+void tomofs_release_blocks(struct super_block *sb, uint64_t start,
+    uint64_t count);
+
+/*
+  * Discard free space
+  * @sb: super block
+  * @range: byte range to trim, extents shorter than range->minlen are
+  *   skipped. range->len is set to the number of bytes discarded.
+  *
+  * Backs FITRIM. Each free extent is taken out of its group's index
+  * while it is discarded, and the group is only locked to pick the next
+  * one, so allocation and frees in the group carry on meanwhile.
+  */
+int tomofs_trim_fs(struct super_block *sb, struct fstrim_range *range);
+
+/*
+ * Journal credits, the number of metadata blocks an operation may dirty.
+ * An extent insert may split every level of the tree, and each new node
+ * costs a bitmap block. A create allocates an inode, possibly a new inode
+ * chunk, and inserts into a directory, which may add directory blocks.
+ */
+#define TOMOFS_INODE_CREDITS 2
+#define TOMOFS_EXTENT_CREDITS 24
+#define TOMOFS_WRITE_CREDITS (TOMOFS_EXTENT_CREDITS + 2)
+#define TOMOFS_CREATE_CREDITS \
+    (TOMOFS_INODE_CHUNK_BLKS + 4 * TOMOFS_EXTENT_CREDITS + 16)
+/*
+ * Copying a shared block on write splits its extent in up to three. A
+ * clone step shares blocks covered by one refcount map block, and may
+ * have to create the map first.
+ */
+#define TOMOFS_COW_CREDITS (2 * TOMOFS_EXTENT_CREDITS + 4)
+#define TOMOFS_CLONE_CREDITS \
+    (TOMOFS_WRITE_CREDITS + TOMOFS_REFCOUNT_BLKS + 4)
+/* Extents a truncate frees per handle, see tomofs_truncate_credits() */
+#define TOMOFS_TRUNCATE_BATCH 16
+
+/*
+  * Load journal
+  * @sb: super block
+  *
+  * Replays the journal if the filesystem was not unmounted cleanly. Must
+  * run before any other metadata is read.
+  */
+int tomofs_journal_load(struct super_block *sb);
+
+/*
+  * Destroy journal
+  * @sb: super block
+  *
+  * Commits the running transaction and checkpoints everything in place.
+  */
+void tomofs_journal_destroy(struct super_block *sb);
+
+/*
+  * Start a transaction handle
+  * @sb: super block
+  * @nblocks: credits, see TOMOFS_*_CREDITS
+  *
+  * Nests inside a handle the task already holds.
+  */
+handle_t *tomofs_journal_start(struct super_block *sb, int nblocks);
+
+int tomofs_journal_stop(handle_t *handle);
+
+/*
+  * Credits for truncating a file
+  * @sb: super block
+  *
+  * The path down the extent tree and the inode, plus a batch of
+  * TOMOFS_TRUNCATE_BATCH extents. Each extent may free blocks in two
+  * groups, costing their bitmap blocks and the refcount maps shared
+  * blocks may be counted in. Capped at the journal's transaction size.
+  */
+int tomofs_truncate_credits(struct super_block *sb);
+
+/*
+  * Extents a truncate can free in the running handle
+  * @sb: super block
+  *
+  * Returns 0 if the handle needs more credits first.
+  */
+unsigned int tomofs_truncate_batch(struct super_block *sb);
+
+/*
+  * Make sure the running handle has @nblocks credits
+  * @nblocks: credits needed
+  *
+  * Extends the handle, or restarts it if the transaction is too full,
+  * which commits what the handle did so far. Metadata must be consistent
+  * by then.
+  */
+int tomofs_journal_ensure_credits(int nblocks);
+
+/*
+  * Commit the running transaction
+  * @sb: super block
+  * @wait: wait until everything done so far is on disk
+  */
+int tomofs_journal_commit(struct super_block *sb, int wait);
+
+/*
+  * Journal access to metadata buffers
+  *
+  * Call get_write_access before changing a buffer that was read from
+  * disk, get_create_access on a freshly allocated block (with the buffer
+  * locked), and dirty once the change is made. forget is called instead
+  * of bforget on a freed metadata block so that replay won't bring it
+  * back. All of them act on the task's running handle, and fall back to
+  * plain buffer cache writes when there is none.
+  */
+int tomofs_journal_get_write_access(struct buffer_head *bh);
+int tomofs_journal_get_create_access(struct buffer_head *bh);
+int tomofs_journal_dirty(struct buffer_head *bh);
+void tomofs_journal_forget(struct buffer_head *bh);
+
+/*
+  * Defer freeing blocks
+  * @sb: super block
+  * @start: first block
+  * @count: number of blocks, all in one allocation group
+  *
+  * Queues the blocks for tomofs_release_blocks() once the running
+  * transaction commits, or for discard first if mounted with -o discard.
+  * Returns false if there is no running handle and the caller should
+  * release them right away.
+  */
+bool tomofs_journal_defer_free(struct super_block *sb, uint64_t start,
+    uint64_t count);
+
+/*
+  * Load inode table
+  * @sb: super block
+  * @agno: group whose inode bitmap and chunk map are read in
+  */
+int tomofs_load_itable(struct super_block *sb, uint64_t agno);
+
+/*
+  * Release inode table
+  * @sb: super block
+  * @agno: group whose inode bitmap and chunk map are released
+  */
+void tomofs_destroy_itable(struct super_block *sb, uint64_t agno);
+
+/*
+  * Read inode table block
+  * @sb: super block
+  * @ino: inode number
+  *
+  * Returns the table block holding @ino, see tomofs_ino_slot(), or NULL if
+  * @ino lies in a chunk that was never allocated. Caller must brelse.
+  */
+struct buffer_head *tomofs_inode_bread(struct super_block *sb, uint64_t ino);
+
+/*
+  * Allocate inode number
+  * @sb: super block
+  * @agno: preferred allocation group
+  * @ino: allocated inode number
+  *
+  * Marks @ino used in its group's inode bitmap, growing the inode table if
+  * its chunk is not allocated yet.
+  */
+int tomofs_alloc_ino(struct super_block *sb, uint64_t agno, uint64_t *ino);
+
+/*
+  * Free inode number
+  * @sb: super block
+  * @ino: inode number from tomofs_alloc_ino()
+  *
+  * Clears @ino's table slot and its bit in the inode bitmap. Must run
+  * inside a handle. Failures are only logged, leaking the inode.
+  */
+void tomofs_free_ino(struct super_block *sb, uint64_t ino);
+
 /*
   * Get empty block
   * @sb: super block
+  * @agno: preferred allocation group, or TOMOFS_AG_ANY
   * @block_cnt: number of contiguous blocks
   * @found: block_extent to return found block into
   *
-  * Does not support recovering freed blocks.
+  * Picks the smallest free extent that fits, trying @agno first and then
+  * any other group that is not busy. The bitmap change is journaled in
+  * the running handle.
   */
-struct block_extent *get_empty_block(struct super_block *sb,
+struct block_extent *get_empty_block(struct super_block *sb, uint64_t agno,
     uint64_t cnt, struct block_extent *found);
 
 /*
-  * Get empty block
+  * Put empty block
+  * @sb: super block
+  * @e: block_extent previously returned by get_empty_block()
+  *
+  * Clears @e in the bitmap and returns it to the free space index, merging
+  * it with its neighbours, once the running transaction has committed.
+  * Blocks of @e that are shared with another file only lose an owner.
+  */
+void put_empty_block(struct super_block *sb, struct block_extent *e);
+
+/*
+  * Share blocks
+  * @sb: super block
+  * @start: first block
+  * @count: number of blocks
+  *
+  * Adds an owner to the blocks from @start, creating the group's refcount
+  * map if it has none. Stops at the end of a map block and returns the
+  * number of blocks shared, or -EMLINK if one has too many owners.
+  */
+int tomofs_share_blocks(struct super_block *sb, uint64_t start,
+    uint64_t count);
+
+/*
+  * Is a block shared
+  * @sb: super block
+  * @blk: block
+  *
+  * Returns 1 if @blk has more than one owner, 0 if it has one.
+  */
+int tomofs_block_shared(struct super_block *sb, uint64_t blk);
+
+/*
+  * Drop an owner of shared blocks
+  * @sb: super block
+  * @ag: group of @start, with its free space lock held
+  * @start: first block
+  * @count: number of blocks
+  * @shared: set if the run returned is shared
+  *
+  * Returns the length of the run from @start whose blocks are either all
+  * shared or all owned once. Shared ones lose an owner, the others are
+  * for the caller to free.
+  */
+uint64_t tomofs_refcount_put(struct super_block *sb, struct tomofs_ag *ag,
+    uint64_t start, uint64_t count, bool *shared);
+
+/*
+ * Blocks kept out of reach of delayed allocation, for the extent tree and
+ * directory blocks that writeback and namespace operations may still need
+ */
+#define TOMOFS_DELALLOC_SLACK 256
+
+/* Most file blocks allocated at once, for delayed or direct writes */
+#define TOMOFS_ALLOC_MAX_BLKS 2048
+
+/*
+  * Reserve blocks
+  * @sb: super block
+  * @count: number of blocks
+  *
+  * Promises @count blocks to dirty pages whose disk blocks are only
+  * allocated at writeback. Returns -ENOSPC if they might not be there.
+  */
+int tomofs_reserve_blocks(struct super_block *sb, uint64_t count);
+
+/*
+  * Release reserved blocks
+  * @sb: super block
+  * @count: number of blocks
+  *
+  * Called once reserved blocks were allocated or their pages were dropped.
+  */
+void tomofs_release_reserved(struct super_block *sb, uint64_t count);
+
+/*
+  * Zero block
   * @sb: super block
   * @e: block_extent zero fill
   *
-  * TODO: Document
+  * Zero fills every block in @e as new metadata in the running handle.
   */
 int zero_block(struct super_block *sb, struct block_extent *e);
 
+/*
+  * Initialize an empty extent tree in @t_inode
+  */
+void tomofs_extent_init(struct tomofs_inode *t_inode);
+
+/*
+  * Map file block to disk
+  * @sb: super block
+  * @t_inode: inode to map
+  * @lblk: file block
+  * @addr: ADDRESS backing @lblk
+  * @count: number of contiguous blocks mapped from @lblk
+  *
+  * Returns -ENOENT if @lblk is a hole, -EIO if it is in a compressed
+  * cluster.
+  */
+int tomofs_extent_map(struct super_block *sb, struct tomofs_inode *t_inode,
+    uint64_t lblk, uintptr_t *addr, uint64_t *count);
+
+/*
+  * Find the extent mapping a file block
+  * @sb: super block
+  * @t_inode: inode to look in
+  * @lblk: file block
+  * @ex: copy of the leaf entry mapping @lblk
+  *
+  * Returns -ENOENT if @lblk is a hole.
+  */
+int tomofs_extent_lookup(struct super_block *sb, struct tomofs_inode *t_inode,
+    uint64_t lblk, struct tomofs_extent *ex);
+
+/*
+  * Map file blocks [lblk, lblk + e->count) onto @e
+  *
+  * Caller must save @t_inode afterwards.
+  */
+int tomofs_extent_insert(struct super_block *sb, struct tomofs_inode *t_inode,
+    uint64_t lblk, struct block_extent *e);
+
+/*
+  * Move file blocks [new->lblk, new->lblk + len) onto @new
+  *
+  * The blocks must all be mapped by one extent, or not at all. The disk
+  * blocks they were mapped to are returned in @old for the caller to put,
+  * none if they were a hole. A compressed cluster can only be moved as a
+  * whole. Caller must save @t_inode afterwards.
+  */
+int tomofs_extent_remap(struct super_block *sb, struct tomofs_inode *t_inode,
+    struct tomofs_extent *new, uint64_t len, struct block_extent *old);
+
+/*
+  * Find the next mapped file block
+  * @sb: super block
+  * @t_inode: inode to look in
+  * @lblk: file block to start from
+  * @next: first mapped file block at or after @lblk
+  *
+  * Returns -ENOENT if nothing is mapped from @lblk onwards.
+  */
+int tomofs_extent_next(struct super_block *sb, struct tomofs_inode *t_inode,
+    uint64_t lblk, uint64_t *next);
+
+/*
+  * Unmap and free every file block from @lblk onwards
+  * @max: most extents to free, see tomofs_truncate_batch()
+  *
+  * Frees extents from the end of the file. Returns -EAGAIN if @max was
+  * reached before everything from @lblk was freed; the tree is consistent
+  * and the caller can save @t_inode and call again in a new handle.
+  * Caller must save @t_inode afterwards.
+  */
+int tomofs_extent_truncate(struct super_block *sb,
+    struct tomofs_inode *t_inode, uint64_t lblk, unsigned int max);
+
+/*
+  * Save an inode
+  * @sb: super block
+  * @t_inode: inode to copy into its table slot
+  *
+  * Must run inside a handle.
+  */
+int tomofs_save_inode(struct super_block *sb, struct tomofs_inode *t_inode);
+
+/* Page cache operations of compressed files */
+extern const struct address_space_operations tomofs_compress_aops;
+
+/*
+  * Set up compression
+  * @sb: super block being mounted
+  *
+  * Allocates the first compression workspace on a -o compress mount,
+  * others are allocated by writeback as needed.
+  */
+int tomofs_compress_init(struct super_block *sb);
+
+/*
+  * Free the compression workspaces
+  * @sb: super block being unmounted
+  */
+void tomofs_compress_destroy(struct super_block *sb);
+
+/*
+  * Finish shrinking a compressed file
+  * @inode: file, already cut down to @size
+  * @size: new size
+  *
+  * The cluster holding the new EOF is kept, so its last page before @size
+  * is dirtied for writeback to rewrite the cluster with zeros past @size.
+  */
+int tomofs_compress_truncate(struct inode *inode, loff_t size);
+
+/*
+  * Initialize directory
+  * @sb: super block
+  * @t_dir: new directory, with an empty extent tree
+  *
+  * Allocates block 0 as an empty leaf. Caller must save @t_dir afterwards.
+  */
+int tomofs_dir_init(struct super_block *sb, struct tomofs_inode *t_dir);
+
+/*
+  * Look up a name in a directory
+  * @sb: super block
+  * @t_dir: directory
+  * @name: name, not NUL terminated
+  * @len: length of @name
+  * @ino: inode number found
+  *
+  * Returns -ENOENT if there is no such name. Misses in directories of
+  * more than one block are answered from a bloom filter of name hashes
+  * when possible. Called with the directory's i_rwsem held at least shared.
+  */
+int tomofs_dir_lookup(struct super_block *sb, struct tomofs_inode *t_dir,
+    const char *name, unsigned int len, uint64_t *ino);
+
+/*
+  * Add a name to a directory
+  * @sb: super block
+  * @t_dir: directory
+  * @name: name, not NUL terminated
+  * @len: length of @name
+  * @ino: inode number the name refers to
+  * @mode: mode of @ino, for its type
+  *
+  * Called with the directory's i_rwsem held. Caller must save @t_dir
+  * afterwards.
+  */
+int tomofs_dir_add(struct super_block *sb, struct tomofs_inode *t_dir,
+    const char *name, unsigned int len, uint64_t ino, umode_t mode);
+
+/*
+  * Read a directory
+  * @sb: super block
+  * @t_dir: directory
+  * @ctx: readdir context, ctx->pos encodes the hash to resume from
+  */
+int tomofs_dir_iterate(struct super_block *sb, struct tomofs_inode *t_dir,
+    struct dir_context *ctx);
+
+/*
+  * Free the in-memory lookup state of a directory
+  * @t_dir: directory being destroyed
+  */
+void tomofs_dir_release(struct tomofs_inode *t_dir);
+
+/*
+  * Create and remove the module's debugfs directory
+  */
+void tomofs_debugfs_init(void);
+void tomofs_debugfs_exit(void);
+
+/*
+  * Set up statistics
+  * @sb: super block being mounted
+  *
+  * Allocates the per-CPU counters and adds the mount's debugfs files.
+  */
+int tomofs_stats_init(struct super_block *sb);
+
+/*
+  * Tear down statistics
+  * @sb: super block being unmounted
+  */
+void tomofs_stats_destroy(struct super_block *sb);
+
+/*
+  * Account an operation
+  * @sb: super block
+  * @op: operation
+  * @start: tomofs_stats_start() when @op began
+  * @err: result of @op, errors are counted separately
+  */
+void tomofs_stats_account(struct super_block *sb, enum tomofs_stat_op op,
+    u64 start, int err);
+
+static inline u64 tomofs_stats_start(void)
+{
+	return ktime_get_ns();
+}
+
+#endif /* __KERNEL__ */
+
 #endif /* #define _TFS_H_ */
@@ -0,0 +1,310 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tomofs
+
+#if !defined(_TOMOFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TOMOFS_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/fs.h>
+
+/*
+ * Tracepoints, under events/tomofs in tracefs. They cost a branch when
+ * disabled. Created in src/stats.c; counts and latencies of the same
+ * operations are summed in debugfs, see tomofs_stats_account().
+ */
+
+TRACE_EVENT(tomofs_lookup,
+	TP_PROTO(struct inode *dir, const char *name, uint64_t ino, int ret),
+	TP_ARGS(dir, name, ino, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint64_t, dir)
+		__field(uint64_t, ino)
+		__field(int, ret)
+		__string(name, name)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ino = ino;
+		__entry->ret = ret;
+		__assign_str(name, name);
+	),
+	TP_printk("dev %d:%d dir %llu name %s ino %llu ret %d",
+	    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+	    __get_str(name), __entry->ino, __entry->ret)
+);
+
+TRACE_EVENT(tomofs_create,
+	TP_PROTO(struct inode *dir, const char *name, umode_t mode,
+	    uint64_t ino, int ret),
+	TP_ARGS(dir, name, mode, ino, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint64_t, dir)
+		__field(uint64_t, ino)
+		__field(umode_t, mode)
+		__field(int, ret)
+		__string(name, name)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ino = ino;
+		__entry->mode = mode;
+		__entry->ret = ret;
+		__assign_str(name, name);
+	),
+	TP_printk("dev %d:%d dir %llu name %s mode 0%o ino %llu ret %d",
+	    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+	    __get_str(name), __entry->mode, __entry->ino, __entry->ret)
+);
+
+TRACE_EVENT(tomofs_readdir,
+	TP_PROTO(struct inode *dir, loff_t pos, int ret),
+	TP_ARGS(dir, pos, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint64_t, dir)
+		__field(loff_t, pos)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->pos = pos;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d:%d dir %llu pos 0x%llx ret %d",
+	    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+	    __entry->pos, __entry->ret)
+);
+
+TRACE_EVENT(tomofs_setattr,
+	TP_PROTO(struct inode *inode, unsigned int valid, loff_t size, int ret),
+	TP_ARGS(inode, valid, size, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint64_t, ino)
+		__field(unsigned int, valid)
+		__field(loff_t, size)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->valid = valid;
+		__entry->size = size;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d:%d ino %llu valid 0x%x size %lld ret %d",
+	    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+	    __entry->valid, __entry->size, __entry->ret)
+);
+
+TRACE_EVENT(tomofs_fsync,
+	TP_PROTO(struct inode *inode, int datasync, int ret),
+	TP_ARGS(inode, datasync, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint64_t, ino)
+		__field(int, datasync)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->datasync = datasync;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d:%d ino %llu datasync %d ret %d",
+	    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+	    __entry->datasync, __entry->ret)
+);
+
+/* Inode table reads and writes */
+DECLARE_EVENT_CLASS(tomofs_inode_io,
+	TP_PROTO(struct super_block *sb, uint64_t ino, int ret),
+	TP_ARGS(sb, ino, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint64_t, ino)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d:%d ino %llu ret %d",
+	    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+	    __entry->ret)
+);
+
+DEFINE_EVENT(tomofs_inode_io, tomofs_read_inode,
+	TP_PROTO(struct super_block *sb, uint64_t ino, int ret),
+	TP_ARGS(sb, ino, ret)
+);
+
+DEFINE_EVENT(tomofs_inode_io, tomofs_save_inode,
+	TP_PROTO(struct super_block *sb, uint64_t ino, int ret),
+	TP_ARGS(sb, ino, ret)
+);
+
+TRACE_EVENT(tomofs_sync_sb,
+	TP_PROTO(struct super_block *sb, uint64_t inode_count, int wait,
+	    int ret),
+	TP_ARGS(sb, inode_count, wait, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint64_t, inode_count)
+		__field(int, wait)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->inode_count = inode_count;
+		__entry->wait = wait;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d:%d inode_count %llu wait %d ret %d",
+	    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->inode_count,
+	    __entry->wait, __entry->ret)
+);
+
+TRACE_EVENT(tomofs_alloc_ino,
+	TP_PROTO(struct super_block *sb, uint64_t agno, uint64_t ino, int ret),
+	TP_ARGS(sb, agno, ino, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint64_t, agno)
+		__field(uint64_t, ino)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->agno = agno;
+		__entry->ino = ino;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d:%d agno %llu ino %llu ret %d",
+	    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->agno,
+	    __entry->ino, __entry->ret)
+);
+
+TRACE_EVENT(tomofs_itable_grow,
+	TP_PROTO(struct super_block *sb, uint64_t agno, uint64_t chunk,
+	    uintptr_t addr),
+	TP_ARGS(sb, agno, chunk, addr),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint64_t, agno)
+		__field(uint64_t, chunk)
+		__field(uintptr_t, addr)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->agno = agno;
+		__entry->chunk = chunk;
+		__entry->addr = addr;
+	),
+	TP_printk("dev %d:%d agno %llu chunk %llu addr 0x%lx",
+	    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->agno,
+	    __entry->chunk, __entry->addr)
+);
+
+/* @e is NULL if the allocation failed */
+TRACE_EVENT(tomofs_alloc_blocks,
+	TP_PROTO(struct super_block *sb, uint64_t agno, uint64_t count,
+	    struct block_extent *e),
+	TP_ARGS(sb, agno, count, e),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint64_t, agno)
+		__field(uint64_t, count)
+		__field(uintptr_t, addr)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->agno = agno;
+		__entry->count = count;
+		__entry->addr = e ? e->head : 0;
+	),
+	TP_printk("dev %d:%d agno %llu count %llu addr 0x%lx",
+	    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->agno,
+	    __entry->count, __entry->addr)
+);
+
+TRACE_EVENT(tomofs_free_blocks,
+	TP_PROTO(struct super_block *sb, struct block_extent *e),
+	TP_ARGS(sb, e),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uintptr_t, addr)
+		__field(uint64_t, count)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->addr = e->head;
+		__entry->count = e->count;
+	),
+	TP_printk("dev %d:%d addr 0x%lx count %llu",
+	    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->addr,
+	    __entry->count)
+);
+
+TRACE_EVENT(tomofs_dir_add,
+	TP_PROTO(struct super_block *sb, uint64_t dir, const char *name,
+	    int len, uint64_t ino, uint32_t hash),
+	TP_ARGS(sb, dir, name, len, ino, hash),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint64_t, dir)
+		__field(uint64_t, ino)
+		__field(uint32_t, hash)
+		__dynamic_array(char, name, len + 1)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->dir = dir;
+		__entry->ino = ino;
+		__entry->hash = hash;
+		memcpy(__get_str(name), name, len);
+		__get_str(name)[len] = '\0';
+	),
+	TP_printk("dev %d:%d dir %llu name %s ino %llu hash 0x%x",
+	    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+	    __get_str(name), __entry->ino, __entry->hash)
+);
+
+/* Writeback of a compressed cluster, @clen bytes after compression */
+TRACE_EVENT(tomofs_write_cluster,
+	TP_PROTO(struct inode *inode, uint64_t cluster, int clen, int ret),
+	TP_ARGS(inode, cluster, clen, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint64_t, ino)
+		__field(uint64_t, cluster)
+		__field(int, clen)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->cluster = cluster;
+		__entry->clen = clen;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d:%d ino %llu cluster %llu clen %d ret %d",
+	    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+	    __entry->cluster, __entry->clen, __entry->ret)
+);
+
+#endif /* _TOMOFS_TRACE_H */
+
+/* Out of the kernel tree, found through the -I for include/ */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE tomofs_trace
+#include <trace/define_trace.h>
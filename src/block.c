@@ -1,51 +1,772 @@
 #include <linux/fs.h>
 #include <linux/types.h>
 #include <linux/buffer_head.h>
+#include <linux/bitops.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/blkdev.h>
+#include <linux/sched/signal.h>
 
 #include "tfs.h"
+#include "tomofs_trace.h"
 /*
  * block.c: TFS block layer
- * TODO: Support recovering freed blocks.
+ *
+ * Free space is recorded on disk as a bitmap with one bit per block. The
+ * device is split into allocation groups of one bitmap block each, and
+ * every group is allocated from under its own lock. At mount time each
+ * group's bitmap is scanned into free extents, each indexed twice: by
+ * start block so that freed blocks can be merged with their neighbours,
+ * and by length so that allocation is a best-fit tree walk.
  */
 
-struct block_extent *get_empty_block(struct super_block *sb,
-    uint64_t cnt, struct block_extent *found)
+struct tomofs_free_extent {
+	struct rb_node by_offset;
+	struct rb_node by_size;
+	uint64_t start;
+	uint64_t count;
+};
+
+static void tomofs_fe_insert_offset(struct tomofs_free_space *fs,
+    struct tomofs_free_extent *fe)
+{
+	struct rb_node **p = &fs->by_offset.rb_node;
+	struct rb_node *parent = NULL;
+	struct tomofs_free_extent *cur;
+
+	while (*p) {
+		parent = *p;
+		cur = rb_entry(parent, struct tomofs_free_extent, by_offset);
+		if (fe->start < cur->start) {
+			p = &parent->rb_left;
+		} else {
+			p = &parent->rb_right;
+		}
+	}
+	rb_link_node(&fe->by_offset, parent, p);
+	rb_insert_color(&fe->by_offset, &fs->by_offset);
+}
+
+/* Ordered by length, ties broken by start block */
+static void tomofs_fe_insert_size(struct tomofs_free_space *fs,
+    struct tomofs_free_extent *fe)
+{
+	struct rb_node **p = &fs->by_size.rb_node;
+	struct rb_node *parent = NULL;
+	struct tomofs_free_extent *cur;
+
+	while (*p) {
+		parent = *p;
+		cur = rb_entry(parent, struct tomofs_free_extent, by_size);
+		if (fe->count < cur->count ||
+		    (fe->count == cur->count && fe->start < cur->start)) {
+			p = &parent->rb_left;
+		} else {
+			p = &parent->rb_right;
+		}
+	}
+	rb_link_node(&fe->by_size, parent, p);
+	rb_insert_color(&fe->by_size, &fs->by_size);
+}
+
+static int tomofs_fe_add(struct tomofs_free_space *fs, uint64_t start,
+    uint64_t count)
 {
-	struct tomofs_super_block *tsb =
-	    (struct tomofs_super_block *)sb->s_fs_info;
+	struct tomofs_free_extent *fe;
+
+	fe = kmalloc(sizeof(struct tomofs_free_extent), GFP_NOFS);
+	if (!fe) {
+		return -ENOMEM;
+	}
+	fe->start = start;
+	fe->count = count;
+	tomofs_fe_insert_offset(fs, fe);
+	tomofs_fe_insert_size(fs, fe);
+	fs->free_blocks += count;
+	return 0;
+}
+
+/* Smallest free extent holding at least @cnt blocks */
+static struct tomofs_free_extent *tomofs_fe_best_fit(
+    struct tomofs_free_space *fs, uint64_t cnt)
+{
+	struct rb_node *node = fs->by_size.rb_node;
+	struct tomofs_free_extent *cur;
+	struct tomofs_free_extent *best = NULL;
+
+	while (node) {
+		cur = rb_entry(node, struct tomofs_free_extent, by_size);
+		if (cur->count >= cnt) {
+			best = cur;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+	return best;
+}
+
+/*
+ * Set or clear @count bits of the on-disk bitmap from block @start.
+ * The range must lie within one allocation group.
+ */
+static int tomofs_bitmap_update(struct super_block *sb, uint64_t start,
+    uint64_t count, bool used)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	sector_t map_blk = sbi->tsb.dev.block_map >> sb->s_blocksize_bits;
+	uint64_t ag_blocks = TOMOFS_AG_BLOCKS(sb->s_blocksize);
 	struct buffer_head *bh;
-	struct block_extent *block_map;
-	bh = __bread(sb->s_bdev, tsb->dev.block_map >> sb->s_blocksize_bits,
-	    TOMOFS_BLK_SIZE);
-	block_map = (struct block_extent *)bh->b_data;
-	if (block_map[0].count < cnt) {
-		return NULL;
+	unsigned int bit = start % ag_blocks;
+
+	int ret;
+
+	bh = sb_bread(sb, map_blk + start / ag_blocks);
+	if (!bh) {
+		return -EIO;
+	}
+	ret = tomofs_journal_get_write_access(bh);
+	if (ret) {
+		goto release;
+	}
+	if (used) {
+		bitmap_set((unsigned long *)bh->b_data, bit, count);
 	} else {
-		found->head = block_map[0].head;
-		printk(KERN_DEBUG "tomofs block allocator: next block: 0x%x\n", found->head);
-		found->count = cnt;
-		block_map[0].head += TOMOFS_BLK_SIZE * cnt;
-		block_map[0].count -= cnt;
-		mark_buffer_dirty(bh);
-		sync_dirty_buffer(bh);
+		bitmap_clear((unsigned long *)bh->b_data, bit, count);
+	}
+	ret = tomofs_journal_dirty(bh);
+	if (ret) {
+		/* Keep the buffer matching what the caller will believe */
+		if (used) {
+			bitmap_clear((unsigned long *)bh->b_data, bit, count);
+		} else {
+			bitmap_set((unsigned long *)bh->b_data, bit, count);
+		}
+	}
+release:
+	brelse(bh);
+	return ret;
+}
+
+static void tomofs_free_space_destroy(struct tomofs_free_space *fs)
+{
+	struct tomofs_free_extent *fe;
+	struct rb_node *node;
+
+	while ((node = rb_first(&fs->by_offset))) {
+		fe = rb_entry(node, struct tomofs_free_extent, by_offset);
+		rb_erase(&fe->by_offset, &fs->by_offset);
+		kfree(fe);
+	}
+	fs->by_size = RB_ROOT;
+	fs->free_blocks = 0;
+}
+
+/* Scan bitmap block @agno into the group's free extent index */
+static int tomofs_load_free_space(struct super_block *sb, uint64_t agno)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	struct tomofs_free_space *fs = &sbi->ags[agno].free;
+	sector_t map_blk = sbi->tsb.dev.block_map >> sb->s_blocksize_bits;
+	uint64_t base = agno * TOMOFS_AG_BLOCKS(sb->s_blocksize);
+	struct buffer_head *bh;
+	unsigned long *map;
+	unsigned int bits;
+	unsigned int bit;
+	unsigned int end;
+	int ret = 0;
+
+	mutex_init(&fs->lock);
+	fs->by_offset = RB_ROOT;
+	fs->by_size = RB_ROOT;
+	fs->free_blocks = 0;
+
+	bh = sb_bread(sb, map_blk + agno);
+	if (!bh) {
+		return -EIO;
+	}
+	map = (unsigned long *)bh->b_data;
+	bits = min_t(uint64_t, sbi->tsb.dev.block_cnt - base,
+	    TOMOFS_AG_BLOCKS(sb->s_blocksize));
+	/* The header of other groups is not in their bitmap */
+	bit = find_next_zero_bit(map, bits, agno ? TOMOFS_AG_HDR_BLKS : 0);
+	while (bit < bits) {
+		end = find_next_bit(map, bits, bit);
+		ret = tomofs_fe_add(fs, base + bit, end - bit);
+		if (ret) {
+			break;
+		}
+		bit = find_next_zero_bit(map, bits, end);
+	}
+	brelse(bh);
+
+	if (ret) {
+		tomofs_free_space_destroy(fs);
+	}
+	return ret;
+}
+
+/*
+ * The free block, reservation and free inode totals are per-CPU counters,
+ * so allocation and statfs never share a cache line. A cheap read may be
+ * off by this much.
+ */
+#define TOMOFS_COUNTER_SLOP ((s64)percpu_counter_batch * nr_cpu_ids)
+
+static int tomofs_counters_init(struct tomofs_sb_info *sbi)
+{
+	int ret;
+
+	ret = percpu_counter_init(&sbi->free_blocks, 0, GFP_KERNEL);
+	if (ret) {
+		return ret;
+	}
+	ret = percpu_counter_init(&sbi->delalloc_blocks, 0, GFP_KERNEL);
+	if (ret) {
+		goto out_free_blocks;
+	}
+	ret = percpu_counter_init(&sbi->free_inodes, 0, GFP_KERNEL);
+	if (ret) {
+		goto out_delalloc;
+	}
+	return 0;
+
+out_delalloc:
+	percpu_counter_destroy(&sbi->delalloc_blocks);
+out_free_blocks:
+	percpu_counter_destroy(&sbi->free_blocks);
+	return ret;
+}
+
+static void tomofs_counters_destroy(struct tomofs_sb_info *sbi)
+{
+	percpu_counter_destroy(&sbi->free_inodes);
+	percpu_counter_destroy(&sbi->delalloc_blocks);
+	percpu_counter_destroy(&sbi->free_blocks);
+}
+
+int tomofs_load_ags(struct super_block *sb)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	sector_t table_blk = sbi->tsb.ag_table >> sb->s_blocksize_bits;
+	uint64_t per_blk = TOMOFS_AG_DESC_PER_BLK(sb->s_blocksize);
+	struct tomofs_ag_desc *descs;
+	struct buffer_head *bh = NULL;
+	uint64_t ag_inodes = TOMOFS_AG_INODES(sb->s_blocksize);
+	uint64_t free_blocks = 0;
+	uint64_t free_inodes = 0;
+	uint64_t agno;
+	int ret = 0;
+
+	sbi->ags = kcalloc(sbi->tsb.ag_count, sizeof(struct tomofs_ag),
+	    GFP_KERNEL);
+	if (!sbi->ags) {
+		return -ENOMEM;
+	}
+	atomic_set(&sbi->ag_rotor, 0);
+	atomic_set(&sbi->refcount_maps, 0);
+	spin_lock_init(&sbi->reserve_lock);
+	ret = tomofs_counters_init(sbi);
+	if (ret) {
+		kfree(sbi->ags);
+		sbi->ags = NULL;
+		return ret;
 	}
 
+	for (agno = 0; agno < sbi->tsb.ag_count; agno++) {
+		if (agno % per_blk == 0) {
+			brelse(bh);
+			bh = sb_bread(sb, table_blk + agno / per_blk);
+			if (!bh) {
+				ret = -EIO;
+				break;
+			}
+		}
+		descs = (struct tomofs_ag_desc *)bh->b_data;
+		sbi->ags[agno].desc = descs[agno % per_blk];
+		mutex_init(&sbi->ags[agno].inode_lock);
+
+		ret = tomofs_load_free_space(sb, agno);
+		if (ret) {
+			break;
+		}
+		ret = tomofs_load_itable(sb, agno);
+		if (ret) {
+			tomofs_free_space_destroy(&sbi->ags[agno].free);
+			break;
+		}
+		free_blocks += sbi->ags[agno].free.free_blocks;
+		if (sbi->ags[agno].desc.refcount_map) {
+			atomic_inc(&sbi->refcount_maps);
+		}
+		/* index 0 of every group is reserved */
+		free_inodes += ag_inodes - 1 - sbi->ags[agno].desc.inode_count;
+	}
+	brelse(bh);
+
+	if (ret) {
+		while (agno-- > 0) {
+			tomofs_destroy_itable(sb, agno);
+			tomofs_free_space_destroy(&sbi->ags[agno].free);
+		}
+		tomofs_counters_destroy(sbi);
+		kfree(sbi->ags);
+		sbi->ags = NULL;
+		return ret;
+	}
+
+	percpu_counter_set(&sbi->free_blocks, free_blocks);
+	percpu_counter_set(&sbi->free_inodes, free_inodes);
+	return 0;
+}
+
+void tomofs_destroy_ags(struct super_block *sb)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	uint64_t agno;
+
+	if (!sbi->ags) {
+		return;
+	}
+	for (agno = 0; agno < sbi->tsb.ag_count; agno++) {
+		tomofs_destroy_itable(sb, agno);
+		tomofs_free_space_destroy(&sbi->ags[agno].free);
+	}
+	tomofs_counters_destroy(sbi);
+	kfree(sbi->ags);
+	sbi->ags = NULL;
+}
+
+int tomofs_save_ag_desc(struct super_block *sb, uint64_t agno)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	sector_t table_blk = sbi->tsb.ag_table >> sb->s_blocksize_bits;
+	uint64_t per_blk = TOMOFS_AG_DESC_PER_BLK(sb->s_blocksize);
+	struct tomofs_ag_desc *descs;
+	struct buffer_head *bh;
+	int ret;
+
+	bh = sb_bread(sb, table_blk + agno / per_blk);
+	if (!bh) {
+		return -EIO;
+	}
+	ret = tomofs_journal_get_write_access(bh);
+	if (!ret) {
+		descs = (struct tomofs_ag_desc *)bh->b_data;
+		descs[agno % per_blk] = sbi->ags[agno].desc;
+		ret = tomofs_journal_dirty(bh);
+	}
 	brelse(bh);
+	return ret;
+}
+
+/* Best-fit allocation from one group. Called with its lock held */
+static bool tomofs_ag_alloc(struct super_block *sb, struct tomofs_ag *ag,
+    uint64_t cnt, struct block_extent *found)
+{
+	struct tomofs_free_space *fs = &ag->free;
+	struct tomofs_free_extent *fe;
+	uint64_t start;
+
+	fe = tomofs_fe_best_fit(fs, cnt);
+	if (!fe) {
+		return false;
+	}
+
+	start = fe->start;
+	/* Before the index changes, so a failure leaves nothing to undo */
+	if (tomofs_bitmap_update(sb, start, cnt, true)) {
+		printk(KERN_ERR "tomofs block allocator: bitmap update failed\n");
+		return false;
+	}
+	rb_erase(&fe->by_size, &fs->by_size);
+	if (fe->count == cnt) {
+		rb_erase(&fe->by_offset, &fs->by_offset);
+		kfree(fe);
+	} else {
+		/* Still sorted by offset, only the length changes */
+		fe->start += cnt;
+		fe->count -= cnt;
+		tomofs_fe_insert_size(fs, fe);
+	}
+	fs->free_blocks -= cnt;
+	percpu_counter_sub(&TOMOFS_SB(sb)->free_blocks, cnt);
+
+	found->head = start << sb->s_blocksize_bits;
+	found->count = cnt;
+	return true;
+}
+
+struct block_extent *get_empty_block(struct super_block *sb, uint64_t agno,
+    uint64_t cnt, struct block_extent *found)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	uint64_t ag_count = sbi->tsb.ag_count;
+	struct tomofs_ag *ag;
+	struct block_extent *ret = NULL;
+	u64 start = tomofs_stats_start();
+	uint64_t i;
+	int pass;
+	bool ok;
+
+	if (agno >= ag_count) {
+		agno = raw_smp_processor_id() % ag_count;
+	}
+
+	/*
+	 * First pass: wait for the preferred group but skip other groups
+	 * that are busy. Second pass: wait for every group.
+	 */
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < ag_count; i++) {
+			ag = &sbi->ags[(agno + i) % ag_count];
+			if (READ_ONCE(ag->free.free_blocks) < cnt) {
+				continue;
+			}
+			if (pass == 0 && i != 0) {
+				if (!mutex_trylock(&ag->free.lock)) {
+					continue;
+				}
+			} else {
+				mutex_lock(&ag->free.lock);
+			}
+			ok = tomofs_ag_alloc(sb, ag, cnt, found);
+			mutex_unlock(&ag->free.lock);
+			if (ok) {
+				ret = found;
+				goto out;
+			}
+		}
+	}
+
+out:
+	trace_tomofs_alloc_blocks(sb, agno, cnt, ret);
+	tomofs_stats_account(sb, TOMOFS_OP_ALLOC_BLOCKS, start,
+	    ret ? 0 : -ENOSPC);
+	return ret;
+}
+
+/*
+ * Merge a free range into the index. Called with its lock held. @fe is an
+ * unlinked extent to reuse for the range, or NULL to allocate one if it
+ * doesn't merge with a neighbour.
+ */
+static void tomofs_fs_insert(struct tomofs_free_space *fs, uint64_t start,
+    uint64_t count, struct tomofs_free_extent *fe)
+{
+	struct tomofs_free_extent *prev = NULL;
+	struct tomofs_free_extent *next = NULL;
+	struct tomofs_free_extent *cur;
+	struct rb_node *node;
+
+	/* Putting back a range FITRIM discarded doesn't free anything */
+	if (!fe) {
+		fs->trimmed = 0;
+	}
+	/* Find the free extents on either side */
+	node = fs->by_offset.rb_node;
+	while (node) {
+		cur = rb_entry(node, struct tomofs_free_extent, by_offset);
+		if (cur->start < start) {
+			prev = cur;
+			node = node->rb_right;
+		} else {
+			next = cur;
+			node = node->rb_left;
+		}
+	}
+
+	if (prev && prev->start + prev->count == start) {
+		rb_erase(&prev->by_size, &fs->by_size);
+		prev->count += count;
+		if (next && start + count == next->start) {
+			prev->count += next->count;
+			rb_erase(&next->by_offset, &fs->by_offset);
+			rb_erase(&next->by_size, &fs->by_size);
+			kfree(next);
+		}
+		tomofs_fe_insert_size(fs, prev);
+		fs->free_blocks += count;
+		kfree(fe);
+	} else if (next && start + count == next->start) {
+		rb_erase(&next->by_size, &fs->by_size);
+		next->start = start;
+		next->count += count;
+		tomofs_fe_insert_size(fs, next);
+		fs->free_blocks += count;
+		kfree(fe);
+	} else if (fe) {
+		fe->start = start;
+		fe->count = count;
+		tomofs_fe_insert_offset(fs, fe);
+		tomofs_fe_insert_size(fs, fe);
+		fs->free_blocks += count;
+	} else if (tomofs_fe_add(fs, start, count)) {
+		/* The bitmap is authoritative, the space returns on remount */
+		printk(KERN_ERR "tomofs block allocator: dropping free extent\n");
+	}
+}
+
+void tomofs_release_blocks(struct super_block *sb, uint64_t start,
+    uint64_t count)
+{
+	struct tomofs_free_space *fs =
+	    &TOMOFS_SB(sb)->ags[tomofs_blk_ag(sb, start)].free;
+
+	mutex_lock(&fs->lock);
+	tomofs_fs_insert(fs, start, count, NULL);
+	mutex_unlock(&fs->lock);
+	percpu_counter_add(&TOMOFS_SB(sb)->free_blocks, count);
+}
+
+/* First free extent ending after block @blk. Called with the lock held */
+static struct tomofs_free_extent *tomofs_fe_after(
+    struct tomofs_free_space *fs, uint64_t blk)
+{
+	struct rb_node *node = fs->by_offset.rb_node;
+	struct tomofs_free_extent *cur;
+	struct tomofs_free_extent *found = NULL;
+
+	while (node) {
+		cur = rb_entry(node, struct tomofs_free_extent, by_offset);
+		if (cur->start + cur->count > blk) {
+			found = cur;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
 	return found;
 }
 
+/*
+ * Discard the free extents of group @agno within [@start, @end). Each
+ * extent is taken out of the index while it is discarded, so the lock is
+ * only held to find the next one.
+ */
+static int tomofs_trim_ag(struct super_block *sb, uint64_t agno,
+    uint64_t start, uint64_t end, uint64_t minlen, uint64_t *trimmed)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	struct tomofs_free_space *fs = &sbi->ags[agno].free;
+	uint64_t ag_blocks = TOMOFS_AG_BLOCKS(sb->s_blocksize);
+	uint64_t ag_start = agno * ag_blocks;
+	uint64_t ag_end = min(ag_start + ag_blocks, sbi->tsb.dev.block_cnt);
+	bool whole = start <= ag_start && end >= ag_end;
+	struct tomofs_free_extent *fe;
+	struct rb_node *node;
+	uint64_t cur = start;
+	uint64_t s;
+	uint64_t e;
+	int ret = 0;
+
+	mutex_lock(&fs->lock);
+	/* Nothing was freed since the group was last trimmed as a whole */
+	if (whole && fs->trimmed && minlen >= fs->trimmed) {
+		mutex_unlock(&fs->lock);
+		return 0;
+	}
+	/* Frees from now on reset it, as does failing */
+	if (whole) {
+		fs->trimmed = minlen;
+	}
+
+	while (cur < end) {
+		/* Extents are merged on insert, each one is as long as it gets */
+		fe = tomofs_fe_after(fs, cur);
+		while (fe && fe->start < end) {
+			s = max(fe->start, cur);
+			e = min(fe->start + fe->count, end);
+			if (e - s >= minlen) {
+				break;
+			}
+			node = rb_next(&fe->by_offset);
+			fe = node ? rb_entry(node, struct tomofs_free_extent,
+			    by_offset) : NULL;
+		}
+		if (!fe || fe->start >= end) {
+			break;
+		}
+
+		/* Busy: allocation can't see it, statfs still counts it free */
+		rb_erase(&fe->by_offset, &fs->by_offset);
+		rb_erase(&fe->by_size, &fs->by_size);
+		fs->free_blocks -= fe->count;
+		mutex_unlock(&fs->lock);
+
+		ret = sb_issue_discard(sb, s, e - s, GFP_NOFS, 0);
+		if (!ret) {
+			*trimmed += e - s;
+			if (fatal_signal_pending(current)) {
+				ret = -ERESTARTSYS;
+			}
+		}
+
+		mutex_lock(&fs->lock);
+		tomofs_fs_insert(fs, fe->start, fe->count, fe);
+		if (ret) {
+			break;
+		}
+		cur = e;
+	}
+	if (ret && whole) {
+		fs->trimmed = 0;
+	}
+	mutex_unlock(&fs->lock);
+	return ret;
+}
+
+int tomofs_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	uint64_t ag_blocks = TOMOFS_AG_BLOCKS(sb->s_blocksize);
+	uint64_t start = range->start >> sb->s_blocksize_bits;
+	uint64_t len = range->len >> sb->s_blocksize_bits;
+	uint64_t minlen = range->minlen >> sb->s_blocksize_bits;
+	uint64_t trimmed = 0;
+	uint64_t end;
+	uint64_t agno;
+	int ret = 0;
+
+	if (start >= sbi->tsb.dev.block_cnt) {
+		return -EINVAL;
+	}
+	end = start + min(len, sbi->tsb.dev.block_cnt - start);
+	minlen = max_t(uint64_t, minlen, 1);
+
+	for (agno = start / ag_blocks; agno * ag_blocks < end; agno++) {
+		ret = tomofs_trim_ag(sb, agno, start, end, minlen, &trimmed);
+		if (ret) {
+			break;
+		}
+	}
+	range->len = trimmed << sb->s_blocksize_bits;
+	return ret;
+}
+
+/*
+ * Clear the range in the bitmap now, but keep it away from the allocator
+ * until the transaction freeing it has committed. Shared blocks only
+ * lose an owner.
+ */
+static void tomofs_ag_free(struct super_block *sb, uint64_t start,
+    uint64_t count)
+{
+	struct tomofs_ag *ag = &TOMOFS_SB(sb)->ags[tomofs_blk_ag(sb, start)];
+	struct tomofs_free_space *fs = &ag->free;
+	bool shared;
+	uint64_t n;
+
+	mutex_lock(&fs->lock);
+	while (count > 0) {
+		n = tomofs_refcount_put(sb, ag, start, count, &shared);
+		if (!shared) {
+			if (tomofs_bitmap_update(sb, start, n, false)) {
+				/* Still in use on disk, so never hand them out */
+				printk(KERN_ERR "tomofs block allocator: bitmap "
+				    "update failed, leaking %llu blocks at %llu\n",
+				    n, start);
+			} else if (!tomofs_journal_defer_free(sb, start, n)) {
+				tomofs_fs_insert(fs, start, n, NULL);
+				percpu_counter_add(&TOMOFS_SB(sb)->free_blocks,
+				    n);
+			}
+		}
+		start += n;
+		count -= n;
+	}
+	mutex_unlock(&fs->lock);
+}
+
+void put_empty_block(struct super_block *sb, struct block_extent *e)
+{
+	uint64_t ag_blocks = TOMOFS_AG_BLOCKS(sb->s_blocksize);
+	uint64_t start = e->head >> sb->s_blocksize_bits;
+	uint64_t count = e->count;
+	u64 start_ns = tomofs_stats_start();
+	uint64_t n;
+
+	trace_tomofs_free_blocks(sb, e);
+	while (count > 0) {
+		n = min_t(uint64_t, count, ag_blocks - start % ag_blocks);
+		tomofs_ag_free(sb, start, n);
+		start += n;
+		count -= n;
+	}
+	tomofs_stats_account(sb, TOMOFS_OP_FREE_BLOCKS, start_ns, 0);
+}
+
+/*
+ * Room left for reservations. @exact sums the per-CPU counters, otherwise
+ * the result may be off by TOMOFS_COUNTER_SLOP either way.
+ */
+static s64 tomofs_avail_blocks(struct tomofs_sb_info *sbi, bool exact)
+{
+	if (exact) {
+		return percpu_counter_sum_positive(&sbi->free_blocks) -
+		    percpu_counter_sum_positive(&sbi->delalloc_blocks) -
+		    TOMOFS_DELALLOC_SLACK;
+	}
+	return percpu_counter_read_positive(&sbi->free_blocks) -
+	    percpu_counter_read_positive(&sbi->delalloc_blocks) -
+	    TOMOFS_DELALLOC_SLACK;
+}
+
+int tomofs_reserve_blocks(struct super_block *sb, uint64_t count)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	int ret = 0;
+
+	/* Blocks still waiting for a commit to be freed don't count */
+	if (tomofs_avail_blocks(sbi, false) >=
+	    (s64)(count + 2 * TOMOFS_COUNTER_SLOP)) {
+		percpu_counter_add(&sbi->delalloc_blocks, count);
+		return 0;
+	}
+
+	/* Low on space, check the exact counts one reservation at a time */
+	spin_lock(&sbi->reserve_lock);
+	if (tomofs_avail_blocks(sbi, true) < (s64)count) {
+		ret = -ENOSPC;
+	} else {
+		percpu_counter_add(&sbi->delalloc_blocks, count);
+	}
+	spin_unlock(&sbi->reserve_lock);
+	return ret;
+}
+
+void tomofs_release_reserved(struct super_block *sb, uint64_t count)
+{
+	percpu_counter_sub(&TOMOFS_SB(sb)->delalloc_blocks, count);
+}
+
 int zero_block(struct super_block *sb, struct block_extent *e)
 {
-	struct tomofs_super_block *tsb =
-	    (struct tomofs_super_block *)sb->s_fs_info;
 	struct buffer_head *bh;
-	char *buf;
-	bh = __bread(sb->s_bdev, tsb->dev.block_map >> sb->s_blocksize_bits,
-	    TOMOFS_BLK_SIZE);
-	buf = (char *)bh->b_data;
-	memset(buf, 0, TOMOFS_BLK_SIZE);
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
+	sector_t blk = e->head >> sb->s_blocksize_bits;
+	loff_t i;
+	int ret;
+
+	for (i = 0; i < e->count; i++) {
+		bh = sb_getblk(sb, blk + i);
+		if (!bh) {
+			return -EIO;
+		}
+		lock_buffer(bh);
+		ret = tomofs_journal_get_create_access(bh);
+		if (ret) {
+			unlock_buffer(bh);
+			brelse(bh);
+			return ret;
+		}
+		memset(bh->b_data, 0, sb->s_blocksize);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		ret = tomofs_journal_dirty(bh);
+		brelse(bh);
+		if (ret) {
+			return ret;
+		}
+	}
 	return 0;
 }
@@ -0,0 +1,681 @@
+#include <linux/fs.h>
+#include <linux/types.h>
+#include <linux/buffer_head.h>
+#include <linux/pagemap.h>
+#include <linux/writeback.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/lz4.h>
+
+#include "tfs.h"
+#include "tomofs_trace.h"
+/*
+ * compress.c: TFS compressed files
+ *
+ * Files created on a -o compress mount keep their data in clusters of
+ * TOMOFS_CLUSTER_SIZE bytes, LZ4 compressed at writeback into new blocks
+ * that replace the cluster's old ones. Their pages have no buffer heads.
+ * readpage decompresses the whole cluster into every page of it that
+ * isn't cached yet, and writepage locks all pages of the cluster, in index
+ * order, to compress them together. Compressed blocks are read and written
+ * through the block device's buffer cache. A cluster's new blocks are
+ * written before the handle that maps them can commit, and its old blocks
+ * are only freed by that handle.
+ *
+ * A page dirtied by write_begin holds a reservation of the blocks it would
+ * take uncompressed, flagged with PagePrivate, until writeback allocates.
+ */
+
+#define TOMOFS_CLUSTER_PAGES (TOMOFS_CLUSTER_SIZE >> PAGE_SHIFT)
+
+/*
+ * Buffers for one cluster
+ * @wrkmem: LZ4 compression state
+ * @data: the cluster uncompressed
+ * @cdata: the cluster compressed
+ */
+struct tomofs_cws {
+	struct list_head list;
+	void *wrkmem;
+	char *data;
+	char *cdata;
+};
+
+static void tomofs_cws_free(struct tomofs_cws *ws)
+{
+	kvfree(ws->wrkmem);
+	kvfree(ws->data);
+	kvfree(ws->cdata);
+	kfree(ws);
+}
+
+static struct tomofs_cws *tomofs_cws_alloc(gfp_t gfp)
+{
+	struct tomofs_cws *ws;
+
+	ws = kzalloc(sizeof(struct tomofs_cws), gfp);
+	if (!ws) {
+		return NULL;
+	}
+	ws->wrkmem = kvmalloc(LZ4_MEM_COMPRESS, gfp);
+	ws->data = kvmalloc(TOMOFS_CLUSTER_SIZE, gfp);
+	ws->cdata = kvmalloc(TOMOFS_CLUSTER_SIZE, gfp);
+	if (!ws->wrkmem || !ws->data || !ws->cdata) {
+		tomofs_cws_free(ws);
+		return NULL;
+	}
+	return ws;
+}
+
+/*
+ * Take an idle workspace, allocating up to one per CPU. Waits for one to
+ * be put back if none can be allocated.
+ */
+static struct tomofs_cws *tomofs_cws_get(struct super_block *sb)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	struct tomofs_cws *ws;
+
+	for (;;) {
+		spin_lock(&sbi->cws_lock);
+		if (!list_empty(&sbi->cws_idle)) {
+			ws = list_first_entry(&sbi->cws_idle, struct tomofs_cws,
+			    list);
+			list_del(&ws->list);
+			spin_unlock(&sbi->cws_lock);
+			return ws;
+		}
+		if (sbi->cws_count >= num_online_cpus()) {
+			spin_unlock(&sbi->cws_lock);
+			goto wait;
+		}
+		sbi->cws_count++;
+		spin_unlock(&sbi->cws_lock);
+
+		/* Writeback may be what is meant to free memory */
+		ws = tomofs_cws_alloc(GFP_NOFS | __GFP_NOWARN);
+		if (ws) {
+			return ws;
+		}
+		spin_lock(&sbi->cws_lock);
+		if (--sbi->cws_count == 0) {
+			spin_unlock(&sbi->cws_lock);
+			return ERR_PTR(-ENOMEM);
+		}
+		spin_unlock(&sbi->cws_lock);
+wait:
+		wait_event(sbi->cws_wait, !list_empty_careful(&sbi->cws_idle));
+	}
+}
+
+static void tomofs_cws_put(struct super_block *sb, struct tomofs_cws *ws)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+
+	spin_lock(&sbi->cws_lock);
+	list_add(&ws->list, &sbi->cws_idle);
+	spin_unlock(&sbi->cws_lock);
+	wake_up(&sbi->cws_wait);
+}
+
+int tomofs_compress_init(struct super_block *sb)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	struct tomofs_cws *ws;
+
+	spin_lock_init(&sbi->cws_lock);
+	INIT_LIST_HEAD(&sbi->cws_idle);
+	init_waitqueue_head(&sbi->cws_wait);
+	sbi->cws_count = 0;
+	if (!(sbi->mount_opts & TOMOFS_MOUNT_COMPRESS)) {
+		return 0;
+	}
+
+	/* Writeback can always wait for this one */
+	ws = tomofs_cws_alloc(GFP_KERNEL);
+	if (!ws) {
+		return -ENOMEM;
+	}
+	list_add(&ws->list, &sbi->cws_idle);
+	sbi->cws_count = 1;
+	return 0;
+}
+
+void tomofs_compress_destroy(struct super_block *sb)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	struct tomofs_cws *ws;
+	struct tomofs_cws *tmp;
+
+	list_for_each_entry_safe(ws, tmp, &sbi->cws_idle, list) {
+		list_del(&ws->list);
+		tomofs_cws_free(ws);
+	}
+	sbi->cws_count = 0;
+}
+
+/* Read cluster @cluster of @inode into ws->data. Holes read as zeros */
+static int tomofs_cluster_read(struct inode *inode, uint64_t cluster,
+    struct tomofs_cws *ws)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned int bits = sb->s_blocksize_bits;
+	struct buffer_head *bhs[TOMOFS_CLUSTER_SIZE >> TOMOFS_MIN_BLK_BITS];
+	struct tomofs_extent ex;
+	char *dst;
+	size_t off;
+	int nr = 0;
+	int ret;
+	int i;
+
+	ret = tomofs_extent_lookup(sb, TOMOFS_T(inode),
+	    cluster * TOMOFS_CLUSTER_BLKS(sb->s_blocksize), &ex);
+	if (ret == -ENOENT) {
+		memset(ws->data, 0, TOMOFS_CLUSTER_SIZE);
+		return 0;
+	}
+	if (ret) {
+		return ret;
+	}
+	if (!ex.clen || ex.clen > TOMOFS_CLUSTER_SIZE ||
+	    ex.ext.count != DIV_ROUND_UP(ex.clen, sb->s_blocksize)) {
+		printk(KERN_ERR "tomofs: bad extent for cluster %llu of inode "
+		    "%lu\n", cluster, inode->i_ino);
+		return -EIO;
+	}
+
+	for (nr = 0; nr < ex.ext.count; nr++) {
+		bhs[nr] = sb_getblk(sb, (ex.ext.head >> bits) + nr);
+		if (!bhs[nr]) {
+			ret = -ENOMEM;
+			goto release;
+		}
+	}
+	ll_rw_block(REQ_OP_READ, 0, nr, bhs);
+
+	/* Stored as is when compressing it didn't save a block */
+	dst = ex.clen == TOMOFS_CLUSTER_SIZE ? ws->data : ws->cdata;
+	for (i = 0; i < nr; i++) {
+		wait_on_buffer(bhs[i]);
+		if (!buffer_uptodate(bhs[i])) {
+			ret = -EIO;
+			goto release;
+		}
+		off = (size_t)i << bits;
+		memcpy(dst + off, bhs[i]->b_data,
+		    min_t(size_t, sb->s_blocksize, ex.clen - off));
+	}
+	if (dst == ws->cdata && LZ4_decompress_safe(ws->cdata, ws->data,
+	    ex.clen, TOMOFS_CLUSTER_SIZE) != TOMOFS_CLUSTER_SIZE) {
+		printk(KERN_ERR "tomofs: corrupt cluster %llu of inode %lu\n",
+		    cluster, inode->i_ino);
+		ret = -EIO;
+	}
+
+release:
+	for (i = 0; i < nr; i++) {
+		brelse(bhs[i]);
+	}
+	return ret;
+}
+
+/* Copy page @i of the cluster in @ws into @page */
+static void tomofs_cluster_to_page(struct tomofs_cws *ws, unsigned int i,
+    struct page *page)
+{
+	void *kaddr;
+
+	kaddr = kmap_atomic(page);
+	memcpy(kaddr, ws->data + ((size_t)i << PAGE_SHIFT), PAGE_SIZE);
+	kunmap_atomic(kaddr);
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+}
+
+/*
+ * Fill @page, locked, from its cluster, along with the other pages of the
+ * cluster before EOF that aren't cached. Those are skipped if their lock
+ * is taken, readahead may be about to read them.
+ */
+static int tomofs_cluster_fill(struct inode *inode, struct page *page)
+{
+	pgoff_t first = page->index & ~(pgoff_t)(TOMOFS_CLUSTER_PAGES - 1);
+	pgoff_t end = DIV_ROUND_UP(i_size_read(inode), PAGE_SIZE);
+	struct tomofs_cws *ws;
+	struct page *p;
+	pgoff_t idx;
+	int ret;
+
+	ws = tomofs_cws_get(inode->i_sb);
+	if (IS_ERR(ws)) {
+		return PTR_ERR(ws);
+	}
+	ret = tomofs_cluster_read(inode, page->index / TOMOFS_CLUSTER_PAGES,
+	    ws);
+	if (ret) {
+		goto out;
+	}
+	tomofs_cluster_to_page(ws, page->index - first, page);
+
+	for (idx = first; idx < first + TOMOFS_CLUSTER_PAGES && idx < end;
+	    idx++) {
+		if (idx == page->index) {
+			continue;
+		}
+		p = grab_cache_page_nowait(inode->i_mapping, idx);
+		if (!p) {
+			continue;
+		}
+		if (!PageUptodate(p)) {
+			tomofs_cluster_to_page(ws, idx - first, p);
+		}
+		unlock_page(p);
+		put_page(p);
+	}
+
+out:
+	tomofs_cws_put(inode->i_sb, ws);
+	return ret;
+}
+
+static int tomofs_compress_readpage(struct file *file, struct page *page)
+{
+	int ret;
+
+	ret = tomofs_cluster_fill(page->mapping->host, page);
+	if (ret) {
+		SetPageError(page);
+	}
+	unlock_page(page);
+	return ret;
+}
+
+/* Give back the reservation write_begin took for @page, if any */
+static void tomofs_put_reserved(struct super_block *sb, struct page *page)
+{
+	if (!PagePrivate(page)) {
+		return;
+	}
+	tomofs_release_reserved(sb, PAGE_SIZE >> sb->s_blocksize_bits);
+	set_page_private(page, 0);
+	ClearPagePrivate(page);
+	put_page(page);
+}
+
+/*
+ * Write @clen bytes from @src to the blocks of @e and wait for them, so
+ * that the handle pointing the file at them can't commit first.
+ */
+static int tomofs_cluster_write(struct super_block *sb,
+    struct block_extent *e, const char *src, size_t clen)
+{
+	struct buffer_head *bhs[TOMOFS_CLUSTER_SIZE / 512];
+	unsigned int bits = sb->s_blocksize_bits;
+	struct buffer_head *bh;
+	size_t off;
+	size_t n;
+	int ret = 0;
+	int nr;
+	int i;
+
+	/* Freed metadata blocks may still be dirty in the cache */
+	clean_bdev_aliases(sb->s_bdev, e->head >> bits, e->count);
+	for (nr = 0; nr < e->count; nr++) {
+		bh = sb_getblk(sb, (e->head >> bits) + nr);
+		if (!bh) {
+			ret = -ENOMEM;
+			break;
+		}
+		off = (size_t)nr << bits;
+		n = min_t(size_t, sb->s_blocksize, clen - off);
+		lock_buffer(bh);
+		memcpy(bh->b_data, src + off, n);
+		memset(bh->b_data + n, 0, sb->s_blocksize - n);
+		set_buffer_uptodate(bh);
+		/* Takes a reference that the completion drops */
+		get_bh(bh);
+		bh->b_end_io = end_buffer_write_sync;
+		submit_bh(REQ_OP_WRITE, 0, bh);
+		bhs[nr] = bh;
+	}
+	for (i = 0; i < nr; i++) {
+		wait_on_buffer(bhs[i]);
+		if (!buffer_uptodate(bhs[i])) {
+			ret = -EIO;
+		}
+		brelse(bhs[i]);
+	}
+	return ret;
+}
+
+/*
+ * Compress ws->data as cluster @cluster of @inode into new blocks, which
+ * replace the cluster's old ones in one handle once they are written.
+ */
+static int tomofs_cluster_remap(struct inode *inode, uint64_t cluster,
+    struct tomofs_cws *ws)
+{
+	struct super_block *sb = inode->i_sb;
+	struct tomofs_inode *t_inode = TOMOFS_T(inode);
+	struct tomofs_extent new;
+	struct block_extent old;
+	const char *src;
+	handle_t *handle;
+	int clen;
+	int ret;
+
+	/* Only worth it if it saves a block */
+	clen = LZ4_compress_default(ws->data, ws->cdata, TOMOFS_CLUSTER_SIZE,
+	    TOMOFS_CLUSTER_SIZE - sb->s_blocksize, ws->wrkmem);
+	if (clen > 0) {
+		src = ws->cdata;
+	} else {
+		clen = TOMOFS_CLUSTER_SIZE;
+		src = ws->data;
+	}
+	new.lblk = cluster * TOMOFS_CLUSTER_BLKS(sb->s_blocksize);
+	new.clen = clen;
+
+	handle = tomofs_journal_start(sb, TOMOFS_COW_CREDITS);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+	if (!get_empty_block(sb, tomofs_ino_ag(sb, inode->i_ino),
+	    DIV_ROUND_UP(clen, sb->s_blocksize), &new.ext)) {
+		ret = -ENOSPC;
+		goto out;
+	}
+	/* The old blocks stay mapped until the new ones are on disk */
+	ret = tomofs_cluster_write(sb, &new.ext, src, clen);
+	if (ret) {
+		put_empty_block(sb, &new.ext);
+		goto out;
+	}
+	ret = tomofs_extent_remap(sb, t_inode, &new,
+	    TOMOFS_CLUSTER_BLKS(sb->s_blocksize), &old);
+	if (ret) {
+		put_empty_block(sb, &new.ext);
+		goto out;
+	}
+	if (old.count) {
+		put_empty_block(sb, &old);
+	}
+	ret = tomofs_save_inode(sb, t_inode);
+
+out:
+	tomofs_journal_stop(handle);
+	trace_tomofs_write_cluster(inode, cluster, clen, ret);
+	return ret;
+}
+
+/*
+ * Write back the cluster of @own, a page writeback has already cleared
+ * the dirty bit of and unlocked. Every page of the cluster up to EOF is
+ * locked in index order; those that aren't cached or uptodate are read
+ * from the old cluster.
+ */
+static int tomofs_cluster_writeback(struct inode *inode, struct page *own)
+{
+	struct address_space *mapping = inode->i_mapping;
+	struct super_block *sb = inode->i_sb;
+	uint64_t cluster = own->index / TOMOFS_CLUSTER_PAGES;
+	pgoff_t first = cluster * TOMOFS_CLUSTER_PAGES;
+	struct page *pages[TOMOFS_CLUSTER_PAGES] = { NULL };
+	bool dirty[TOMOFS_CLUSTER_PAGES] = { false };
+	struct tomofs_cws *ws;
+	loff_t size = i_size_read(inode);
+	bool any = false;
+	void *kaddr;
+	size_t off;
+	int nr;
+	int i;
+	int ret = 0;
+
+	if ((loff_t)first << PAGE_SHIFT >= size) {
+		return 0;
+	}
+	nr = min_t(loff_t, TOMOFS_CLUSTER_PAGES,
+	    DIV_ROUND_UP(size, PAGE_SIZE) - first);
+	for (i = 0; i < nr; i++) {
+		if (first + i == own->index) {
+			lock_page(own);
+			if (own->mapping != mapping) {
+				/* Truncated meanwhile */
+				unlock_page(own);
+				continue;
+			}
+			get_page(own);
+			pages[i] = own;
+			dirty[i] = true;
+		} else {
+			pages[i] = find_lock_page(mapping, first + i);
+			if (!pages[i]) {
+				continue;
+			}
+		}
+		wait_on_page_writeback(pages[i]);
+		/* Before copying it, so that mmap writes fault and redirty it */
+		if (clear_page_dirty_for_io(pages[i])) {
+			dirty[i] = true;
+		}
+		any |= dirty[i];
+	}
+	if (!any) {
+		goto unlock;
+	}
+
+	ws = tomofs_cws_get(sb);
+	if (IS_ERR(ws)) {
+		ret = PTR_ERR(ws);
+		goto unlock;
+	}
+	for (i = 0; i < nr; i++) {
+		if (!pages[i] || !PageUptodate(pages[i])) {
+			ret = tomofs_cluster_read(inode, cluster, ws);
+			break;
+		}
+	}
+	if (ret) {
+		goto put_ws;
+	}
+	for (i = 0; i < nr; i++) {
+		if (pages[i] && PageUptodate(pages[i])) {
+			kaddr = kmap_atomic(pages[i]);
+			memcpy(ws->data + ((size_t)i << PAGE_SHIFT), kaddr,
+			    PAGE_SIZE);
+			kunmap_atomic(kaddr);
+		}
+	}
+	/* Past EOF stays zero, growing the file exposes it */
+	off = size - ((loff_t)first << PAGE_SHIFT);
+	if (off < TOMOFS_CLUSTER_SIZE) {
+		memset(ws->data + off, 0, TOMOFS_CLUSTER_SIZE - off);
+	}
+
+	ret = tomofs_cluster_remap(inode, cluster, ws);
+	if (ret) {
+		goto put_ws;
+	}
+	/* Already written, the pages are locked throughout */
+	for (i = 0; i < nr; i++) {
+		if (!dirty[i]) {
+			continue;
+		}
+		tomofs_put_reserved(sb, pages[i]);
+		set_page_writeback(pages[i]);
+		end_page_writeback(pages[i]);
+	}
+
+put_ws:
+	tomofs_cws_put(sb, ws);
+unlock:
+	for (i = 0; i < nr; i++) {
+		if (!pages[i]) {
+			continue;
+		}
+		if (ret && dirty[i]) {
+			/* Try again later, or report it and drop the data */
+			if (ret == -ENOMEM) {
+				set_page_dirty(pages[i]);
+			} else {
+				SetPageError(pages[i]);
+			}
+		}
+		unlock_page(pages[i]);
+		put_page(pages[i]);
+	}
+	return ret;
+}
+
+static int tomofs_compress_writepage(struct page *page,
+    struct writeback_control *wbc)
+{
+	struct inode *inode = page->mapping->host;
+	int ret;
+
+	/* Reclaim can't wait for the locks of the rest of the cluster */
+	if (current->flags & PF_MEMALLOC) {
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		return 0;
+	}
+	/* Taken again in index order along with the others */
+	unlock_page(page);
+	ret = tomofs_cluster_writeback(inode, page);
+	if (ret) {
+		mapping_set_error(inode->i_mapping, ret);
+	}
+	return ret;
+}
+
+static int tomofs_compress_write_begin(struct file *file,
+    struct address_space *mapping, loff_t pos, unsigned len, unsigned flags,
+    struct page **pagep, void **fsdata)
+{
+	struct inode *inode = mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct page *page;
+	int ret;
+
+	page = grab_cache_page_write_begin(mapping, pos >> PAGE_SHIFT, flags);
+	if (!page) {
+		return -ENOMEM;
+	}
+	if (!PagePrivate(page)) {
+		ret = tomofs_reserve_blocks(sb,
+		    PAGE_SIZE >> sb->s_blocksize_bits);
+		if (ret) {
+			goto fail;
+		}
+		get_page(page);
+		set_page_private(page, 1);
+		SetPagePrivate(page);
+	}
+	if (!PageUptodate(page) && len != PAGE_SIZE) {
+		if (page_offset(page) >= i_size_read(inode)) {
+			zero_user(page, 0, PAGE_SIZE);
+			SetPageUptodate(page);
+		} else {
+			ret = tomofs_cluster_fill(inode, page);
+			if (ret) {
+				goto fail;
+			}
+		}
+	}
+	*pagep = page;
+	return 0;
+
+fail:
+	/* A reservation taken stays with the page until it is released */
+	unlock_page(page);
+	put_page(page);
+	return ret;
+}
+
+static int tomofs_compress_write_end(struct file *file,
+    struct address_space *mapping, loff_t pos, unsigned len,
+    unsigned copied, struct page *page, void *fsdata)
+{
+	struct inode *inode = mapping->host;
+
+	/* Only a whole page write skips reading the page in write_begin */
+	if (!PageUptodate(page)) {
+		if (copied < len) {
+			copied = 0;
+			goto out;
+		}
+		SetPageUptodate(page);
+	}
+	if (!copied) {
+		goto out;
+	}
+	flush_dcache_page(page);
+	set_page_dirty(page);
+	if (pos + copied > inode->i_size) {
+		i_size_write(inode, pos + copied);
+		mark_inode_dirty(inode);
+	}
+
+out:
+	unlock_page(page);
+	put_page(page);
+	return copied;
+}
+
+static void tomofs_compress_invalidatepage(struct page *page,
+    unsigned int offset, unsigned int length)
+{
+	/* Partly truncated pages are still written */
+	if (offset == 0 && length == PAGE_SIZE) {
+		tomofs_put_reserved(page->mapping->host->i_sb, page);
+	}
+}
+
+/* Clean pages may still hold a reservation, see write_begin */
+static int tomofs_compress_releasepage(struct page *page, gfp_t gfp)
+{
+	if (PageDirty(page)) {
+		return 0;
+	}
+	tomofs_put_reserved(page->mapping->host->i_sb, page);
+	return 1;
+}
+
+/* Only for open(O_DIRECT), direct I/O falls back to the page cache */
+static ssize_t tomofs_compress_direct_IO(struct kiocb *iocb,
+    struct iov_iter *iter)
+{
+	return -EINVAL;
+}
+
+const struct address_space_operations tomofs_compress_aops = {
+	.readpage = tomofs_compress_readpage,
+	.writepage = tomofs_compress_writepage,
+	.write_begin = tomofs_compress_write_begin,
+	.write_end = tomofs_compress_write_end,
+	.set_page_dirty = __set_page_dirty_nobuffers,
+	.invalidatepage = tomofs_compress_invalidatepage,
+	.releasepage = tomofs_compress_releasepage,
+	.direct_IO = tomofs_compress_direct_IO,
+};
+
+int tomofs_compress_truncate(struct inode *inode, loff_t size)
+{
+	struct page *page;
+
+	if (!(size & (TOMOFS_CLUSTER_SIZE - 1))) {
+		return 0;
+	}
+	/* The last page before @size, the one at @size may be past EOF */
+	page = read_mapping_page(inode->i_mapping, (size - 1) >> PAGE_SHIFT,
+	    NULL);
+	if (IS_ERR(page)) {
+		return PTR_ERR(page);
+	}
+	lock_page(page);
+	set_page_dirty(page);
+	unlock_page(page);
+	put_page(page);
+	return 0;
+}
@@ -0,0 +1,847 @@
+#include <linux/fs.h>
+#include <linux/types.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/bitops.h>
+#include <linux/string.h>
+
+#include "tfs.h"
+#include "tomofs_trace.h"
+/*
+ * dir.c: TFS directories
+ *
+ * A directory is a B+tree of its own blocks keyed by name hash. While a
+ * directory is small its root block is the only leaf. Once the root fills
+ * up its contents move down into a new block and the root becomes an index,
+ * so a lookup reads one block per level. Leaves are kept sorted by hash
+ * and never split a run of equal hashes, which lets readdir resume from a
+ * hash and a position within its run.
+ */
+
+#define DX_HDR(bh) ((struct tomofs_dx_header *)(bh)->b_data)
+#define DX_SLOTS(h) ((struct tomofs_dx_slot *)((h) + 1))
+#define DX_ENTRIES(h) ((struct tomofs_dx_entry *)((h) + 1))
+#define DX_DIRENT(h, slot) \
+    ((struct tomofs_dirent *)((char *)(h) + (slot)->off))
+
+/* One past the largest hash */
+#define TOMOFS_DX_EOF ((uint64_t)1 << 32)
+/*
+ * readdir position: hash, then index within the run of that hash. Runs
+ * only grow at the end, see tomofs_dx_leaf_search_end().
+ */
+#define TOMOFS_DX_POS_BITS 8
+#define TOMOFS_DX_POS(hash, seq) \
+    ((loff_t)(((hash) << TOMOFS_DX_POS_BITS) | (seq)))
+
+static uint32_t tomofs_dx_key(void *entries, uint16_t depth, int i)
+{
+	if (depth) {
+		return ((struct tomofs_dx_entry *)entries)[i].hash;
+	}
+	return ((struct tomofs_dx_slot *)entries)[i].hash;
+}
+
+/* Index of the last index entry with hash <= @hash, 0 if none */
+static int tomofs_dx_search(struct tomofs_dx_header *hdr, uint32_t hash)
+{
+	int lo = 0;
+	int hi = hdr->entries - 1;
+	int mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (DX_ENTRIES(hdr)[mid].hash <= hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return hi < 0 ? 0 : hi;
+}
+
+/* Index of the first slot with hash >= @hash */
+static int tomofs_dx_leaf_search(struct tomofs_dx_header *hdr, uint32_t hash)
+{
+	int lo = 0;
+	int hi = hdr->entries;
+	int mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (DX_SLOTS(hdr)[mid].hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Index of the first slot with hash > @hash. New records go at the end of
+ * their hash's run, so readdir positions within a run never shift.
+ */
+static int tomofs_dx_leaf_search_end(struct tomofs_dx_header *hdr,
+    uint32_t hash)
+{
+	int lo = 0;
+	int hi = hdr->entries;
+	int mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (DX_SLOTS(hdr)[mid].hash <= hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* Read directory block @lblk. Caller must brelse */
+static struct buffer_head *tomofs_dx_bread(struct super_block *sb,
+    struct tomofs_inode *t_dir, uint64_t lblk)
+{
+	struct buffer_head *bh;
+	uintptr_t addr;
+	uint64_t count;
+
+	if (tomofs_extent_map(sb, t_dir, lblk, &addr, &count)) {
+		return NULL;
+	}
+	bh = sb_bread(sb, addr >> sb->s_blocksize_bits);
+	if (!bh) {
+		return NULL;
+	}
+	if (DX_HDR(bh)->magic != TOMOFS_DX_MAGIC) {
+		printk(KERN_ERR "tomofs: bad directory block %llu in inode %lu\n",
+		    lblk, t_dir->i_ino);
+		brelse(bh);
+		return NULL;
+	}
+	return bh;
+}
+
+/* Append an empty node of @depth to @t_dir. Caller must brelse */
+static struct buffer_head *tomofs_dx_new_block(struct super_block *sb,
+    struct tomofs_inode *t_dir, uint16_t depth, uint32_t *lblk)
+{
+	struct tomofs_dx_header *hdr;
+	struct buffer_head *bh;
+	struct block_extent e;
+	uint64_t next = t_dir->file_size >> sb->s_blocksize_bits;
+	int ret;
+
+	if (!get_empty_block(sb, tomofs_ino_ag(sb, t_dir->i_ino), 1, &e)) {
+		return ERR_PTR(-ENOSPC);
+	}
+	bh = sb_getblk(sb, e.head >> sb->s_blocksize_bits);
+	if (!bh) {
+		put_empty_block(sb, &e);
+		return ERR_PTR(-EIO);
+	}
+
+	lock_buffer(bh);
+	ret = tomofs_journal_get_create_access(bh);
+	if (ret) {
+		unlock_buffer(bh);
+		brelse(bh);
+		put_empty_block(sb, &e);
+		return ERR_PTR(ret);
+	}
+	memset(bh->b_data, 0, sb->s_blocksize);
+	hdr = DX_HDR(bh);
+	hdr->magic = TOMOFS_DX_MAGIC;
+	hdr->depth = depth;
+	if (depth) {
+		hdr->max = TOMOFS_DX_ENTRIES(sb->s_blocksize);
+	}
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+
+	ret = tomofs_extent_insert(sb, t_dir, next, &e);
+	if (ret) {
+		tomofs_journal_forget(bh);
+		put_empty_block(sb, &e);
+		return ERR_PTR(ret);
+	}
+
+	t_dir->file_size += sb->s_blocksize;
+	*lblk = next;
+	return bh;
+}
+
+/* Undo tomofs_dx_new_block() of @bh, still the last block of @t_dir */
+static int tomofs_dx_drop_block(struct super_block *sb,
+    struct tomofs_inode *t_dir, struct buffer_head *bh, uint32_t lblk)
+{
+	tomofs_journal_forget(bh);
+	t_dir->file_size = (uint64_t)lblk << sb->s_blocksize_bits;
+	return tomofs_extent_truncate(sb, t_dir, lblk, UINT_MAX);
+}
+
+int tomofs_dir_init(struct super_block *sb, struct tomofs_inode *t_dir)
+{
+	struct buffer_head *bh;
+	uint32_t lblk;
+	int ret;
+
+	t_dir->file_size = 0;
+	t_dir->child_count = 0;
+	bh = tomofs_dx_new_block(sb, t_dir, 0, &lblk);
+	if (IS_ERR(bh)) {
+		return PTR_ERR(bh);
+	}
+	ret = tomofs_journal_dirty(bh);
+	brelse(bh);
+	return ret;
+}
+
+/*
+ * Walk down to the leaf covering @hash. @next is set to the lowest hash
+ * of the following leaf, or TOMOFS_DX_EOF if this is the last one.
+ */
+static struct buffer_head *tomofs_dx_find_leaf(struct super_block *sb,
+    struct tomofs_inode *t_dir, uint32_t hash, uint64_t *next)
+{
+	struct tomofs_dx_header *hdr;
+	struct buffer_head *bh;
+	struct buffer_head *child;
+	int i;
+
+	*next = TOMOFS_DX_EOF;
+	bh = tomofs_dx_bread(sb, t_dir, 0);
+	while (bh && DX_HDR(bh)->depth > 0) {
+		hdr = DX_HDR(bh);
+		i = tomofs_dx_search(hdr, hash);
+		if (i + 1 < hdr->entries) {
+			*next = DX_ENTRIES(hdr)[i + 1].hash;
+		}
+		child = tomofs_dx_bread(sb, t_dir, DX_ENTRIES(hdr)[i].lblk);
+		brelse(bh);
+		bh = child;
+	}
+	return bh;
+}
+
+/*
+ * Lookup misses in directories of more than one block are answered from
+ * an in-memory bloom filter of the name hashes, about 10 bits per name
+ * with 4 probes, for a false positive rate near 1%. Bits are never
+ * cleared; the filter is dropped once it holds twice the names it was
+ * sized for and the next miss builds a bigger one. A filter of the largest
+ * size is kept however full it gets.
+ */
+#define TOMOFS_BLOOM_BITS_PER_NAME 10
+#define TOMOFS_BLOOM_PROBES 4
+#define TOMOFS_BLOOM_MIN_SHIFT 10
+#define TOMOFS_BLOOM_MAX_SHIFT 23
+
+struct tomofs_dx_bloom {
+	unsigned int shift;
+	uint64_t capacity;
+	uint64_t count;
+	unsigned long map[];
+};
+
+static struct tomofs_inode_info *tomofs_dir_info(struct tomofs_inode *t_dir)
+{
+	return container_of(t_dir, struct tomofs_inode_info, t_inode);
+}
+
+/* Probe @i of @hash. The second hash only has to be odd and differ */
+static unsigned long tomofs_bloom_bit(struct tomofs_dx_bloom *bloom,
+    uint32_t hash, int i)
+{
+	uint32_t h2 = ((hash >> 16) | (hash << 16)) | 1;
+
+	return (hash + i * h2) & ((1UL << bloom->shift) - 1);
+}
+
+static void tomofs_bloom_add(struct tomofs_dx_bloom *bloom, uint32_t hash)
+{
+	int i;
+
+	for (i = 0; i < TOMOFS_BLOOM_PROBES; i++) {
+		__set_bit(tomofs_bloom_bit(bloom, hash, i), bloom->map);
+	}
+	bloom->count++;
+}
+
+static bool tomofs_bloom_test(struct tomofs_dx_bloom *bloom, uint32_t hash)
+{
+	int i;
+
+	for (i = 0; i < TOMOFS_BLOOM_PROBES; i++) {
+		if (!test_bit(tomofs_bloom_bit(bloom, hash, i), bloom->map)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Build a filter of every name in @t_dir, NULL if that fails */
+static struct tomofs_dx_bloom *tomofs_bloom_build(struct super_block *sb,
+    struct tomofs_inode *t_dir)
+{
+	struct tomofs_dx_bloom *bloom;
+	struct tomofs_dx_header *hdr;
+	struct buffer_head *bh;
+	uint64_t hash = 0;
+	uint64_t next;
+	unsigned int shift = TOMOFS_BLOOM_MIN_SHIFT;
+	int i;
+
+	/* Room for twice the current names */
+	while (shift < TOMOFS_BLOOM_MAX_SHIFT && (1UL << shift) <
+	    t_dir->child_count * 2 * TOMOFS_BLOOM_BITS_PER_NAME) {
+		shift++;
+	}
+	bloom = kvzalloc(sizeof(struct tomofs_dx_bloom) +
+	    BITS_TO_LONGS(1UL << shift) * sizeof(unsigned long), GFP_NOFS);
+	if (!bloom) {
+		return NULL;
+	}
+	bloom->shift = shift;
+	if (shift < TOMOFS_BLOOM_MAX_SHIFT) {
+		bloom->capacity = (1UL << shift) / TOMOFS_BLOOM_BITS_PER_NAME * 2;
+	} else {
+		bloom->capacity = U64_MAX;
+	}
+
+	while (hash < TOMOFS_DX_EOF) {
+		bh = tomofs_dx_find_leaf(sb, t_dir, hash, &next);
+		if (!bh) {
+			kvfree(bloom);
+			return NULL;
+		}
+		hdr = DX_HDR(bh);
+		for (i = 0; i < hdr->entries; i++) {
+			tomofs_bloom_add(bloom, DX_SLOTS(hdr)[i].hash);
+		}
+		brelse(bh);
+		hash = next;
+	}
+	return bloom;
+}
+
+/*
+ * Return false if no name in @t_dir can have @hash. Called with i_rwsem
+ * shared, so concurrent lookups may race to build the filter.
+ */
+static bool tomofs_bloom_may_contain(struct super_block *sb,
+    struct tomofs_inode *t_dir, uint32_t hash)
+{
+	struct tomofs_inode_info *ti = tomofs_dir_info(t_dir);
+	struct tomofs_dx_bloom *bloom = READ_ONCE(ti->bloom);
+
+	if (!bloom) {
+		/* A single leaf is no slower to search than the filter */
+		if (t_dir->file_size <= sb->s_blocksize) {
+			return true;
+		}
+		bloom = tomofs_bloom_build(sb, t_dir);
+		if (!bloom) {
+			return true;
+		}
+		if (cmpxchg(&ti->bloom, NULL, bloom)) {
+			kvfree(bloom);
+			bloom = READ_ONCE(ti->bloom);
+		}
+	}
+	return tomofs_bloom_test(bloom, hash);
+}
+
+/* Record @hash in the filter, called with i_rwsem held exclusive */
+static void tomofs_bloom_insert(struct tomofs_inode *t_dir, uint32_t hash)
+{
+	struct tomofs_inode_info *ti = tomofs_dir_info(t_dir);
+	struct tomofs_dx_bloom *bloom = ti->bloom;
+
+	if (!bloom) {
+		return;
+	}
+	if (bloom->count >= bloom->capacity) {
+		ti->bloom = NULL;
+		kvfree(bloom);
+		return;
+	}
+	tomofs_bloom_add(bloom, hash);
+}
+
+void tomofs_dir_release(struct tomofs_inode *t_dir)
+{
+	struct tomofs_inode_info *ti = tomofs_dir_info(t_dir);
+
+	kvfree(ti->bloom);
+	ti->bloom = NULL;
+}
+
+int tomofs_dir_lookup(struct super_block *sb, struct tomofs_inode *t_dir,
+    const char *name, unsigned int len, uint64_t *ino)
+{
+	uint32_t hash = tomofs_name_hash(name, len);
+	struct tomofs_dx_header *hdr;
+	struct tomofs_dx_slot *slots;
+	struct tomofs_dirent *de;
+	struct buffer_head *bh;
+	uint64_t next;
+	int ret = -ENOENT;
+	int i;
+
+	if (len > TOMOFS_MAX_FILENAME_LEN) {
+		return -ENAMETOOLONG;
+	}
+	if (!tomofs_bloom_may_contain(sb, t_dir, hash)) {
+		return -ENOENT;
+	}
+	bh = tomofs_dx_find_leaf(sb, t_dir, hash, &next);
+	if (!bh) {
+		return -EIO;
+	}
+	hdr = DX_HDR(bh);
+	slots = DX_SLOTS(hdr);
+	for (i = tomofs_dx_leaf_search(hdr, hash);
+	    i < hdr->entries && slots[i].hash == hash; i++) {
+		de = DX_DIRENT(hdr, &slots[i]);
+		if (de->name_len == len && !memcmp(de->name, name, len)) {
+			*ino = de->i_ino;
+			ret = 0;
+			break;
+		}
+	}
+	brelse(bh);
+	return ret;
+}
+
+/*
+ * Pick where to split @n sorted entries so that no hash ends up in both
+ * halves, as close to entry @mid as possible. Returns 0 if every entry has
+ * the same hash.
+ */
+static int tomofs_dx_split_point(void *entries, uint16_t depth, int n,
+    int mid)
+{
+	int d;
+
+	for (d = 0; d < n; d++) {
+		if (mid - d > 0 && mid - d < n &&
+		    tomofs_dx_key(entries, depth, mid - d - 1) !=
+		    tomofs_dx_key(entries, depth, mid - d)) {
+			return mid - d;
+		}
+		if (mid + d < n && mid + d > 0 &&
+		    tomofs_dx_key(entries, depth, mid + d - 1) !=
+		    tomofs_dx_key(entries, depth, mid + d)) {
+			return mid + d;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Insert index @entry at @pos in node @bh.
+ * A full root is pushed down into a new block, which is then split like any
+ * other node. A full non-root node is split in two; the index entry for the
+ * new right half is returned in @split and 1 is returned.
+ */
+static int tomofs_dx_node_insert(struct super_block *sb,
+    struct tomofs_inode *t_dir, struct buffer_head *bh, bool is_root,
+    int pos, struct tomofs_dx_entry *entry, struct tomofs_dx_entry *split)
+{
+	struct tomofs_dx_header *hdr = DX_HDR(bh);
+	struct tomofs_dx_header *nhdr;
+	struct tomofs_dx_entry child_split;
+	struct tomofs_dx_entry *entries = DX_ENTRIES(hdr);
+	struct tomofs_dx_entry *tmp;
+	struct buffer_head *nbh;
+	size_t esize = sizeof(struct tomofs_dx_entry);
+	uint32_t lblk;
+	int half;
+	int n;
+	int ret;
+
+	ret = tomofs_journal_get_write_access(bh);
+	if (ret) {
+		return ret;
+	}
+	if (hdr->entries < hdr->max) {
+		memmove(entries + pos + 1, entries + pos,
+		    (hdr->entries - pos) * esize);
+		entries[pos] = *entry;
+		hdr->entries++;
+		return tomofs_journal_dirty(bh);
+	}
+
+	if (is_root) {
+		/* Grow the tree by one level */
+		nbh = tomofs_dx_new_block(sb, t_dir, hdr->depth, &lblk);
+		if (IS_ERR(nbh)) {
+			return PTR_ERR(nbh);
+		}
+		nhdr = DX_HDR(nbh);
+		memcpy(DX_ENTRIES(nhdr), entries, hdr->entries * esize);
+		nhdr->entries = hdr->entries;
+
+		hdr->depth++;
+		hdr->entries = 1;
+		entries[0].hash = 0;
+		entries[0].lblk = lblk;
+
+		ret = tomofs_dx_node_insert(sb, t_dir, nbh, false, pos, entry,
+		    &child_split);
+		tomofs_journal_dirty(nbh);
+		brelse(nbh);
+		if (ret == 1) {
+			ret = tomofs_dx_node_insert(sb, t_dir, bh, true, 1,
+			    &child_split, NULL);
+		}
+		tomofs_journal_dirty(bh);
+		return ret < 0 ? ret : 0;
+	}
+
+	/* Lay out all n entries in order before picking the split */
+	n = hdr->entries + 1;
+	tmp = kmalloc(n * esize, GFP_NOFS);
+	if (!tmp) {
+		return -ENOMEM;
+	}
+	memcpy(tmp, entries, pos * esize);
+	tmp[pos] = *entry;
+	memcpy(tmp + pos + 1, entries + pos, (hdr->entries - pos) * esize);
+
+	half = tomofs_dx_split_point(tmp, hdr->depth, n, n / 2);
+	nbh = tomofs_dx_new_block(sb, t_dir, hdr->depth, &lblk);
+	if (IS_ERR(nbh)) {
+		kfree(tmp);
+		return PTR_ERR(nbh);
+	}
+	nhdr = DX_HDR(nbh);
+
+	/* Index keys are distinct, so @half is never 0 */
+	memcpy(entries, tmp, half * esize);
+	hdr->entries = half;
+	memcpy(DX_ENTRIES(nhdr), tmp + half, (n - half) * esize);
+	nhdr->entries = n - half;
+	split->hash = tmp[half].hash;
+	split->lblk = lblk;
+	kfree(tmp);
+
+	tomofs_journal_dirty(nbh);
+	brelse(nbh);
+	tomofs_journal_dirty(bh);
+	return 1;
+}
+
+/* Offset of the lowest record in a leaf of block size @bs */
+static unsigned int tomofs_dx_heap(struct tomofs_dx_header *hdr,
+    unsigned int bs)
+{
+	return hdr->heap ? hdr->heap : bs;
+}
+
+/* Bytes left between the slot array and the records of a leaf */
+static size_t tomofs_dx_leaf_free(struct tomofs_dx_header *hdr,
+    unsigned int bs)
+{
+	return tomofs_dx_heap(hdr, bs) - sizeof(struct tomofs_dx_header) -
+	    hdr->entries * sizeof(struct tomofs_dx_slot);
+}
+
+/* Add @de at slot @pos of a leaf that has room for it */
+static void tomofs_dx_leaf_put(struct tomofs_dx_header *hdr,
+    unsigned int bs, int pos, uint32_t hash, struct tomofs_dirent *de)
+{
+	struct tomofs_dx_slot *slots = DX_SLOTS(hdr);
+	size_t len = TOMOFS_DIRENT_LEN(de->name_len);
+
+	memmove(slots + pos + 1, slots + pos,
+	    (hdr->entries - pos) * sizeof(struct tomofs_dx_slot));
+	hdr->heap = tomofs_dx_heap(hdr, bs) - len;
+	memcpy((char *)hdr + hdr->heap, de, len);
+	slots[pos].hash = hash;
+	slots[pos].off = hdr->heap;
+	slots[pos].len = len;
+	hdr->entries++;
+}
+
+/*
+ * Rebuild leaf @hdr from slots [from, to) of @slots. Their records are in
+ * @base, except for offset 0 which stands for @de.
+ */
+static void tomofs_dx_leaf_fill(struct tomofs_dx_header *hdr,
+    unsigned int bs, struct tomofs_dx_slot *slots, char *base,
+    struct tomofs_dirent *de, int from, int to)
+{
+	int i;
+
+	memset(hdr + 1, 0, bs - sizeof(struct tomofs_dx_header));
+	hdr->entries = 0;
+	hdr->heap = 0;
+	for (i = from; i < to; i++) {
+		tomofs_dx_leaf_put(hdr, bs, hdr->entries, slots[i].hash,
+		    slots[i].off ? (struct tomofs_dirent *)(base +
+		    slots[i].off) : de);
+	}
+}
+
+/*
+ * Split the records of full leaf @hdr plus @de, at slot @pos, between
+ * @hdr and the empty leaf @nhdr. Cuts near the middle by bytes, without
+ * splitting a run of equal hashes. Returns the first hash of @nhdr.
+ */
+static int tomofs_dx_leaf_split(struct tomofs_dx_header *hdr,
+    struct tomofs_dx_header *nhdr, unsigned int bs, int pos, uint32_t hash,
+    struct tomofs_dirent *de, uint32_t *split_hash)
+{
+	size_t room = bs - sizeof(struct tomofs_dx_header);
+	size_t len = TOMOFS_DIRENT_LEN(de->name_len);
+	struct tomofs_dx_slot *slots;
+	size_t total = 0;
+	size_t left = 0;
+	char *old;
+	int half;
+	int mid;
+	int n;
+	int i;
+
+	old = kmalloc(bs, GFP_NOFS);
+	n = hdr->entries + 1;
+	slots = kmalloc_array(n, sizeof(struct tomofs_dx_slot), GFP_NOFS);
+	if (!old || !slots) {
+		kfree(old);
+		kfree(slots);
+		return -ENOMEM;
+	}
+	memcpy(old, hdr, bs);
+	memcpy(slots, DX_SLOTS(hdr), pos * sizeof(struct tomofs_dx_slot));
+	/* Records never start at 0, where the header is */
+	slots[pos].hash = hash;
+	slots[pos].off = 0;
+	slots[pos].len = len;
+	memcpy(slots + pos + 1, DX_SLOTS(hdr) + pos,
+	    (hdr->entries - pos) * sizeof(struct tomofs_dx_slot));
+
+	for (i = 0; i < n; i++) {
+		total += slots[i].len + sizeof(struct tomofs_dx_slot);
+	}
+	for (mid = 0; mid < n - 1 && left < total / 2; mid++) {
+		left += slots[mid].len + sizeof(struct tomofs_dx_slot);
+	}
+	half = tomofs_dx_split_point(slots, 0, n, mid ? mid : 1);
+
+	left = 0;
+	for (i = 0; i < half; i++) {
+		left += slots[i].len + sizeof(struct tomofs_dx_slot);
+	}
+	if (!half || left > room || total - left > room) {
+		kfree(old);
+		kfree(slots);
+		return -ENOSPC;
+	}
+
+	tomofs_dx_leaf_fill(hdr, bs, slots, old, de, 0, half);
+	tomofs_dx_leaf_fill(nhdr, bs, slots, old, de, half, n);
+	*split_hash = slots[half].hash;
+	kfree(old);
+	kfree(slots);
+	return 0;
+}
+
+/*
+ * Insert record @de into leaf @bh, pushing a full root down or splitting a
+ * full leaf like tomofs_dx_node_insert().
+ */
+static int tomofs_dx_leaf_insert(struct super_block *sb,
+    struct tomofs_inode *t_dir, struct buffer_head *bh, bool is_root,
+    uint32_t hash, struct tomofs_dirent *de, struct tomofs_dx_entry *split)
+{
+	struct tomofs_dx_header *hdr = DX_HDR(bh);
+	struct tomofs_dx_entry child_split;
+	struct buffer_head *nbh;
+	size_t len = TOMOFS_DIRENT_LEN(de->name_len);
+	int pos = tomofs_dx_leaf_search_end(hdr, hash);
+	uint32_t lblk;
+	int ret;
+
+	/* readdir numbers the records of a run in TOMOFS_DX_POS_BITS */
+	if (pos - tomofs_dx_leaf_search(hdr, hash) >=
+	    1 << TOMOFS_DX_POS_BITS) {
+		printk(KERN_ERR "tomofs: too many hash collisions in inode %lu\n",
+		    t_dir->i_ino);
+		return -ENOSPC;
+	}
+	ret = tomofs_journal_get_write_access(bh);
+	if (ret) {
+		return ret;
+	}
+	if (tomofs_dx_leaf_free(hdr, sb->s_blocksize) >=
+	    len + sizeof(struct tomofs_dx_slot)) {
+		tomofs_dx_leaf_put(hdr, sb->s_blocksize, pos, hash, de);
+		return tomofs_journal_dirty(bh);
+	}
+
+	nbh = tomofs_dx_new_block(sb, t_dir, 0, &lblk);
+	if (IS_ERR(nbh)) {
+		return PTR_ERR(nbh);
+	}
+
+	if (is_root) {
+		/* Grow the tree by one level, the leaf moves as it is */
+		memcpy(nbh->b_data, bh->b_data, sb->s_blocksize);
+		memset(hdr + 1, 0, sb->s_blocksize -
+		    sizeof(struct tomofs_dx_header));
+		hdr->depth = 1;
+		hdr->max = TOMOFS_DX_ENTRIES(sb->s_blocksize);
+		hdr->heap = 0;
+		hdr->entries = 1;
+		DX_ENTRIES(hdr)[0].hash = 0;
+		DX_ENTRIES(hdr)[0].lblk = lblk;
+
+		ret = tomofs_dx_leaf_insert(sb, t_dir, nbh, false, hash, de,
+		    &child_split);
+		tomofs_journal_dirty(nbh);
+		brelse(nbh);
+		if (ret == 1) {
+			ret = tomofs_dx_node_insert(sb, t_dir, bh, true, 1,
+			    &child_split, NULL);
+		}
+		tomofs_journal_dirty(bh);
+		return ret < 0 ? ret : 0;
+	}
+
+	ret = tomofs_dx_leaf_split(hdr, DX_HDR(nbh), sb->s_blocksize, pos,
+	    hash, de, &split->hash);
+	if (ret) {
+		if (ret == -ENOSPC) {
+			printk(KERN_ERR "tomofs: too many hash collisions in inode %lu\n",
+			    t_dir->i_ino);
+		}
+		/* Nothing points to the new block yet */
+		if (tomofs_dx_drop_block(sb, t_dir, nbh, lblk)) {
+			printk(KERN_ERR "tomofs: unable to free directory "
+			    "block %u of inode %lu\n", lblk, t_dir->i_ino);
+		}
+		return ret;
+	}
+	split->lblk = lblk;
+
+	tomofs_journal_dirty(nbh);
+	brelse(nbh);
+	tomofs_journal_dirty(bh);
+	return 1;
+}
+
+static int tomofs_dx_insert(struct super_block *sb, struct tomofs_inode *t_dir,
+    struct buffer_head *bh, bool is_root, uint32_t hash,
+    struct tomofs_dirent *de, struct tomofs_dx_entry *split)
+{
+	struct tomofs_dx_header *hdr = DX_HDR(bh);
+	struct tomofs_dx_entry child_split;
+	struct buffer_head *child;
+	int i;
+	int ret;
+
+	if (hdr->depth == 0) {
+		return tomofs_dx_leaf_insert(sb, t_dir, bh, is_root, hash, de,
+		    split);
+	}
+
+	i = tomofs_dx_search(hdr, hash);
+	child = tomofs_dx_bread(sb, t_dir, DX_ENTRIES(hdr)[i].lblk);
+	if (!child) {
+		return -EIO;
+	}
+	ret = tomofs_dx_insert(sb, t_dir, child, false, hash, de,
+	    &child_split);
+	brelse(child);
+	if (ret <= 0) {
+		return ret;
+	}
+
+	return tomofs_dx_node_insert(sb, t_dir, bh, is_root, i + 1,
+	    &child_split, split);
+}
+
+int tomofs_dir_add(struct super_block *sb, struct tomofs_inode *t_dir,
+    const char *name, unsigned int len, uint64_t ino, umode_t mode)
+{
+	uint64_t buf[TOMOFS_DIRENT_LEN(TOMOFS_MAX_FILENAME_LEN) /
+	    sizeof(uint64_t)];
+	struct tomofs_dirent *de = (struct tomofs_dirent *)buf;
+	uint32_t hash;
+	struct buffer_head *bh;
+	int ret;
+
+	if (len > TOMOFS_MAX_FILENAME_LEN) {
+		return -ENAMETOOLONG;
+	}
+	memset(buf, 0, TOMOFS_DIRENT_LEN(len));
+	de->i_ino = ino;
+	de->name_len = len;
+	de->file_type = tomofs_mode_to_dtype(mode);
+	memcpy(de->name, name, len);
+	hash = tomofs_name_hash(name, len);
+
+	bh = tomofs_dx_bread(sb, t_dir, 0);
+	if (!bh) {
+		return -EIO;
+	}
+	ret = tomofs_dx_insert(sb, t_dir, bh, true, hash, de, NULL);
+	brelse(bh);
+	if (ret) {
+		return ret;
+	}
+
+	t_dir->child_count++;
+	tomofs_bloom_insert(t_dir, hash);
+	trace_tomofs_dir_add(sb, t_dir->i_ino, name, len, ino, hash);
+	return 0;
+}
+
+int tomofs_dir_iterate(struct super_block *sb, struct tomofs_inode *t_dir,
+    struct dir_context *ctx)
+{
+	uint64_t hash = (uint64_t)ctx->pos >> TOMOFS_DX_POS_BITS;
+	unsigned int seq = ctx->pos & ((1 << TOMOFS_DX_POS_BITS) - 1);
+	struct tomofs_dx_header *hdr;
+	struct tomofs_dx_slot *slots;
+	struct tomofs_dirent *de;
+	struct buffer_head *bh;
+	uint64_t next;
+	int i;
+
+	while (hash < TOMOFS_DX_EOF) {
+		bh = tomofs_dx_find_leaf(sb, t_dir, hash, &next);
+		if (!bh) {
+			return -EIO;
+		}
+		hdr = DX_HDR(bh);
+		slots = DX_SLOTS(hdr);
+		/* Skip what was already emitted from this hash's run */
+		for (i = tomofs_dx_leaf_search(hdr, hash) + seq;
+		    i < hdr->entries; i++) {
+			if (slots[i].hash != hash) {
+				hash = slots[i].hash;
+				seq = 0;
+			}
+			de = DX_DIRENT(hdr, &slots[i]);
+			ctx->pos = TOMOFS_DX_POS(hash, seq);
+			if (!dir_emit(ctx, de->name, de->name_len, de->i_ino,
+			    de->file_type)) {
+				brelse(bh);
+				return 0;
+			}
+			seq++;
+			ctx->pos = TOMOFS_DX_POS(hash, seq);
+		}
+		brelse(bh);
+		hash = next;
+		seq = 0;
+	}
+	ctx->pos = TOMOFS_DX_POS(TOMOFS_DX_EOF, 0);
+	return 0;
+}
@@ -0,0 +1,576 @@
+#include <linux/fs.h>
+#include <linux/types.h>
+#include <linux/buffer_head.h>
+
+#include "tfs.h"
+/*
+ * extent.c: TFS file block mapping
+ *
+ * Every inode maps its file blocks onto disk through a B+tree of extents.
+ * The root node is embedded in the inode and holds a handful of entries;
+ * once it overflows its contents are pushed down into a block and the
+ * root becomes an index node. Index entries carry the first file block of
+ * their subtree, so a lookup is a binary search per level.
+ */
+
+#define EXT_FIRST(h) ((struct tomofs_extent *)((h) + 1))
+#define EXT_FIRST_IDX(h) ((struct tomofs_extent_idx *)((h) + 1))
+/* Both entry types start with their first file block */
+#define EXT_KEY(h, esize, i) \
+    (*(uint64_t *)((char *)((h) + 1) + (i) * (esize)))
+
+void tomofs_extent_init(struct tomofs_inode *t_inode)
+{
+	memset(&t_inode->extents, 0, sizeof(struct tomofs_extent_root));
+	t_inode->extents.hdr.magic = TOMOFS_EXTENT_MAGIC;
+	t_inode->extents.hdr.max = TOMOFS_INODE_EXTENTS;
+}
+
+/* Index of the last entry starting at or before @lblk, -1 if none */
+static int tomofs_ext_search(struct tomofs_extent_header *hdr, size_t esize,
+    uint64_t lblk)
+{
+	int lo = 0;
+	int hi = hdr->entries - 1;
+	int mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (EXT_KEY(hdr, esize, mid) <= lblk) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return hi;
+}
+
+static struct buffer_head *tomofs_ext_bread(struct super_block *sb,
+    uintptr_t addr)
+{
+	struct buffer_head *bh;
+
+	bh = sb_bread(sb, addr >> sb->s_blocksize_bits);
+	if (!bh) {
+		return NULL;
+	}
+	if (((struct tomofs_extent_header *)bh->b_data)->magic !=
+	    TOMOFS_EXTENT_MAGIC) {
+		printk(KERN_ERR "tomofs: bad extent node at 0x%lx\n", addr);
+		brelse(bh);
+		return NULL;
+	}
+	return bh;
+}
+
+/* Copy the leaf entry mapping @lblk into @out, -ENOENT if it is a hole */
+static int tomofs_ext_lookup(struct super_block *sb,
+    struct tomofs_inode *t_inode, uint64_t lblk, struct tomofs_extent *out)
+{
+	struct tomofs_extent_header *hdr = &t_inode->extents.hdr;
+	struct buffer_head *bh = NULL;
+	struct buffer_head *child;
+	struct tomofs_extent *ex;
+	int i;
+	int ret = -ENOENT;
+
+	while (hdr->depth > 0) {
+		i = tomofs_ext_search(hdr, sizeof(struct tomofs_extent_idx),
+		    lblk);
+		if (i < 0) {
+			goto release;
+		}
+		child = tomofs_ext_bread(sb, EXT_FIRST_IDX(hdr)[i].child);
+		brelse(bh);
+		bh = child;
+		if (!bh) {
+			ret = -EIO;
+			goto release;
+		}
+		hdr = (struct tomofs_extent_header *)bh->b_data;
+	}
+
+	i = tomofs_ext_search(hdr, sizeof(struct tomofs_extent), lblk);
+	if (i < 0) {
+		goto release;
+	}
+	ex = EXT_FIRST(hdr) + i;
+	if (lblk >= ex->lblk + tomofs_extent_len(ex, sb->s_blocksize)) {
+		goto release;
+	}
+	*out = *ex;
+	ret = 0;
+
+release:
+	brelse(bh);
+	return ret;
+}
+
+int tomofs_extent_map(struct super_block *sb, struct tomofs_inode *t_inode,
+    uint64_t lblk, uintptr_t *addr, uint64_t *count)
+{
+	struct tomofs_extent ex;
+	int ret;
+
+	down_read(tomofs_inode_sem(t_inode));
+	ret = tomofs_ext_lookup(sb, t_inode, lblk, &ex);
+	up_read(tomofs_inode_sem(t_inode));
+	if (ret) {
+		return ret;
+	}
+	/* Compressed blocks don't correspond to file blocks */
+	if (ex.clen) {
+		return -EIO;
+	}
+	*addr = ex.ext.head + ((lblk - ex.lblk) << sb->s_blocksize_bits);
+	*count = ex.ext.count - (lblk - ex.lblk);
+	return 0;
+}
+
+int tomofs_extent_lookup(struct super_block *sb, struct tomofs_inode *t_inode,
+    uint64_t lblk, struct tomofs_extent *ex)
+{
+	int ret;
+
+	down_read(tomofs_inode_sem(t_inode));
+	ret = tomofs_ext_lookup(sb, t_inode, lblk, ex);
+	up_read(tomofs_inode_sem(t_inode));
+	return ret;
+}
+
+/* Does @b directly follow @a both in the file and on disk? */
+static bool tomofs_ext_contiguous(struct super_block *sb,
+    struct tomofs_extent *a, struct tomofs_extent *b)
+{
+	/* A compressed cluster always has an extent of its own */
+	if (a->clen || b->clen) {
+		return false;
+	}
+	return a->lblk + a->ext.count == b->lblk &&
+	    a->ext.head + (a->ext.count << sb->s_blocksize_bits) == b->ext.head;
+}
+
+/*
+ * Insert @entry at @pos in node @hdr.
+ * A full root is pushed down into a new block which then takes the entry.
+ * A full block node is split in half; the index entry for the new right
+ * half is returned in @split and 1 is returned.
+ */
+static int tomofs_ext_node_insert(struct super_block *sb, uint64_t agno,
+    struct tomofs_extent_header *hdr, bool is_root, int pos, void *entry,
+    size_t esize, struct tomofs_extent_idx *split)
+{
+	struct tomofs_extent_header *nhdr;
+	struct buffer_head *nbh;
+	struct block_extent e;
+	char *entries = (char *)(hdr + 1);
+	int half;
+	int ret;
+
+	if (hdr->entries < hdr->max) {
+		memmove(entries + (pos + 1) * esize, entries + pos * esize,
+		    (hdr->entries - pos) * esize);
+		memcpy(entries + pos * esize, entry, esize);
+		hdr->entries++;
+		return 0;
+	}
+
+	if (!get_empty_block(sb, agno, 1, &e)) {
+		return -ENOSPC;
+	}
+	nbh = sb_getblk(sb, e.head >> sb->s_blocksize_bits);
+	if (!nbh) {
+		put_empty_block(sb, &e);
+		return -EIO;
+	}
+	lock_buffer(nbh);
+	ret = tomofs_journal_get_create_access(nbh);
+	if (ret) {
+		unlock_buffer(nbh);
+		brelse(nbh);
+		put_empty_block(sb, &e);
+		return ret;
+	}
+	memset(nbh->b_data, 0, sb->s_blocksize);
+	nhdr = (struct tomofs_extent_header *)nbh->b_data;
+	nhdr->magic = TOMOFS_EXTENT_MAGIC;
+	nhdr->depth = hdr->depth;
+	nhdr->max = hdr->depth ? TOMOFS_BLK_EXTENT_IDX(sb->s_blocksize) :
+	    TOMOFS_BLK_EXTENTS(sb->s_blocksize);
+
+	if (is_root) {
+		/* Grow the tree by one level */
+		memcpy(nhdr + 1, entries, hdr->entries * esize);
+		nhdr->entries = hdr->entries;
+		tomofs_ext_node_insert(sb, agno, nhdr, false, pos, entry,
+		    esize, NULL);
+
+		hdr->depth++;
+		hdr->entries = 1;
+		hdr->max = TOMOFS_INODE_EXTENT_IDX;
+		EXT_FIRST_IDX(hdr)[0].lblk = EXT_KEY(nhdr, esize, 0);
+		EXT_FIRST_IDX(hdr)[0].child = e.head;
+	} else {
+		half = hdr->entries / 2;
+		memcpy(nhdr + 1, entries + half * esize,
+		    (hdr->entries - half) * esize);
+		nhdr->entries = hdr->entries - half;
+		hdr->entries = half;
+		if (pos <= half) {
+			tomofs_ext_node_insert(sb, agno, hdr, false, pos,
+			    entry, esize, NULL);
+		} else {
+			tomofs_ext_node_insert(sb, agno, nhdr, false,
+			    pos - half, entry, esize, NULL);
+		}
+		split->lblk = EXT_KEY(nhdr, esize, 0);
+		split->child = e.head;
+	}
+
+	set_buffer_uptodate(nbh);
+	unlock_buffer(nbh);
+	ret = tomofs_journal_dirty(nbh);
+	brelse(nbh);
+	if (ret) {
+		return ret;
+	}
+	return is_root ? 0 : 1;
+}
+
+static int tomofs_ext_insert(struct super_block *sb, uint64_t agno,
+    struct tomofs_extent_header *hdr, bool is_root,
+    struct tomofs_extent *new, struct tomofs_extent_idx *split)
+{
+	struct tomofs_extent *ex;
+	struct tomofs_extent_idx *idx;
+	struct tomofs_extent_idx child_split;
+	struct buffer_head *bh;
+	int i;
+	int ret;
+
+	if (hdr->depth == 0) {
+		ex = EXT_FIRST(hdr);
+		i = tomofs_ext_search(hdr, sizeof(struct tomofs_extent),
+		    new->lblk);
+		if (i >= 0 && tomofs_ext_contiguous(sb, &ex[i], new)) {
+			ex[i].ext.count += new->ext.count;
+			return 0;
+		}
+		if (i + 1 < hdr->entries &&
+		    tomofs_ext_contiguous(sb, new, &ex[i + 1])) {
+			ex[i + 1].lblk = new->lblk;
+			ex[i + 1].ext.head = new->ext.head;
+			ex[i + 1].ext.count += new->ext.count;
+			return 0;
+		}
+		return tomofs_ext_node_insert(sb, agno, hdr, is_root, i + 1,
+		    new, sizeof(struct tomofs_extent), split);
+	}
+
+	idx = EXT_FIRST_IDX(hdr);
+	i = tomofs_ext_search(hdr, sizeof(struct tomofs_extent_idx),
+	    new->lblk);
+	if (i < 0) {
+		/* New leftmost mapping */
+		i = 0;
+		idx[0].lblk = new->lblk;
+	}
+
+	bh = tomofs_ext_bread(sb, idx[i].child);
+	if (!bh) {
+		return -EIO;
+	}
+	ret = tomofs_journal_get_write_access(bh);
+	if (ret) {
+		brelse(bh);
+		return ret;
+	}
+	ret = tomofs_ext_insert(sb, agno,
+	    (struct tomofs_extent_header *)bh->b_data, false, new,
+	    &child_split);
+	if (ret >= 0) {
+		tomofs_journal_dirty(bh);
+	}
+	brelse(bh);
+	if (ret <= 0) {
+		return ret;
+	}
+
+	return tomofs_ext_node_insert(sb, agno, hdr, is_root, i + 1,
+	    &child_split, sizeof(struct tomofs_extent_idx), split);
+}
+
+int tomofs_extent_insert(struct super_block *sb, struct tomofs_inode *t_inode,
+    uint64_t lblk, struct block_extent *e)
+{
+	struct tomofs_extent new = {
+		.lblk = lblk,
+		.ext = *e,
+	};
+	struct tomofs_extent_idx split;
+	int ret;
+
+	down_write(tomofs_inode_sem(t_inode));
+	/* Tree blocks live in the same group as the inode */
+	ret = tomofs_ext_insert(sb, tomofs_ino_ag(sb, t_inode->i_ino),
+	    &t_inode->extents.hdr, true, &new, &split);
+	up_write(tomofs_inode_sem(t_inode));
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Cut file blocks [@lblk, @lblk + @len) out of the extent mapping them in
+ * subtree @hdr, returning the disk blocks they were mapped to in @old.
+ * What is left of the extent past the cut goes in @tail, which has no
+ * blocks if there is nothing left. Returns 1 if the cut was the whole
+ * extent, which then simply moves onto @new.
+ */
+static int tomofs_ext_carve(struct super_block *sb,
+    struct tomofs_extent_header *hdr, struct tomofs_extent *new, uint64_t len,
+    struct tomofs_extent *tail, struct block_extent *old)
+{
+	unsigned int bits = sb->s_blocksize_bits;
+	struct tomofs_extent *ex;
+	struct buffer_head *bh;
+	uint64_t lblk = new->lblk;
+	uint64_t end = lblk + len;
+	uint64_t ex_end;
+	int i;
+	int ret;
+
+	if (hdr->depth > 0) {
+		i = tomofs_ext_search(hdr, sizeof(struct tomofs_extent_idx),
+		    lblk);
+		if (i < 0) {
+			return -ENOENT;
+		}
+		bh = tomofs_ext_bread(sb, EXT_FIRST_IDX(hdr)[i].child);
+		if (!bh) {
+			return -EIO;
+		}
+		ret = tomofs_journal_get_write_access(bh);
+		if (ret) {
+			brelse(bh);
+			return ret;
+		}
+		ret = tomofs_ext_carve(sb,
+		    (struct tomofs_extent_header *)bh->b_data, new, len, tail,
+		    old);
+		if (ret >= 0) {
+			tomofs_journal_dirty(bh);
+		}
+		brelse(bh);
+		return ret;
+	}
+
+	i = tomofs_ext_search(hdr, sizeof(struct tomofs_extent), lblk);
+	if (i < 0) {
+		return -ENOENT;
+	}
+	ex = EXT_FIRST(hdr) + i;
+	ex_end = ex->lblk + tomofs_extent_len(ex, sb->s_blocksize);
+	if (lblk >= ex_end) {
+		return -ENOENT;
+	}
+	if (end > ex_end || (ex->clen && (lblk != ex->lblk || end != ex_end))) {
+		return -EINVAL;
+	}
+	tail->ext.count = 0;
+
+	if (lblk == ex->lblk && end == ex_end) {
+		*old = ex->ext;
+		ex->ext = new->ext;
+		ex->clen = new->clen;
+		return 1;
+	}
+	old->head = ex->ext.head + ((lblk - ex->lblk) << bits);
+	old->count = len;
+	if (lblk == ex->lblk) {
+		/* The key only grows, so the index above stays valid */
+		ex->lblk = end;
+		ex->ext.head += len << bits;
+		ex->ext.count -= len;
+		return 0;
+	}
+	if (end < ex_end) {
+		tail->lblk = end;
+		tail->ext.head = ex->ext.head + ((end - ex->lblk) << bits);
+		tail->ext.count = ex_end - end;
+		tail->clen = 0;
+	}
+	ex->ext.count = lblk - ex->lblk;
+	return 0;
+}
+
+int tomofs_extent_remap(struct super_block *sb, struct tomofs_inode *t_inode,
+    struct tomofs_extent *new, uint64_t len, struct block_extent *old)
+{
+	uint64_t agno = tomofs_ino_ag(sb, t_inode->i_ino);
+	struct tomofs_extent tail;
+	struct tomofs_extent_idx split;
+	int ret;
+
+	down_write(tomofs_inode_sem(t_inode));
+	ret = tomofs_ext_carve(sb, &t_inode->extents.hdr, new, len, &tail, old);
+	if (ret == -ENOENT) {
+		/* Nothing to move, a hole simply gets mapped */
+		old->count = 0;
+		tail.ext.count = 0;
+	} else if (ret) {
+		goto out;
+	}
+	ret = tomofs_ext_insert(sb, agno, &t_inode->extents.hdr, true, new,
+	    &split);
+	if (ret >= 0 && tail.ext.count) {
+		ret = tomofs_ext_insert(sb, agno, &t_inode->extents.hdr, true,
+		    &tail, &split);
+	}
+out:
+	up_write(tomofs_inode_sem(t_inode));
+	return ret < 0 ? ret : 0;
+}
+
+static int tomofs_ext_next(struct super_block *sb,
+    struct tomofs_extent_header *hdr, uint64_t lblk, uint64_t *next)
+{
+	struct tomofs_extent *ex;
+	struct buffer_head *bh;
+	int i;
+	int ret;
+
+	if (hdr->depth == 0) {
+		ex = EXT_FIRST(hdr);
+		i = tomofs_ext_search(hdr, sizeof(struct tomofs_extent), lblk);
+		if (i >= 0 && lblk < ex[i].lblk +
+		    tomofs_extent_len(&ex[i], sb->s_blocksize)) {
+			*next = lblk;
+			return 0;
+		}
+		if (i + 1 < hdr->entries) {
+			*next = ex[i + 1].lblk;
+			return 0;
+		}
+		return -ENOENT;
+	}
+
+	/* The subtree holding @lblk may end in a hole, then try the next */
+	i = tomofs_ext_search(hdr, sizeof(struct tomofs_extent_idx), lblk);
+	for (i = max(i, 0); i < hdr->entries; i++) {
+		bh = tomofs_ext_bread(sb, EXT_FIRST_IDX(hdr)[i].child);
+		if (!bh) {
+			return -EIO;
+		}
+		ret = tomofs_ext_next(sb,
+		    (struct tomofs_extent_header *)bh->b_data, lblk, next);
+		brelse(bh);
+		if (ret != -ENOENT) {
+			return ret;
+		}
+	}
+	return -ENOENT;
+}
+
+int tomofs_extent_next(struct super_block *sb, struct tomofs_inode *t_inode,
+    uint64_t lblk, uint64_t *next)
+{
+	int ret;
+
+	down_read(tomofs_inode_sem(t_inode));
+	ret = tomofs_ext_next(sb, &t_inode->extents.hdr, lblk, next);
+	up_read(tomofs_inode_sem(t_inode));
+	return ret;
+}
+
+/* Frees at most @left extents, returning -EAGAIN if that wasn't enough */
+static int tomofs_ext_truncate(struct super_block *sb,
+    struct tomofs_extent_header *hdr, uint64_t lblk, unsigned int *left)
+{
+	struct tomofs_extent *ex;
+	struct tomofs_extent_idx *idx;
+	struct tomofs_extent_header *child;
+	struct block_extent freed;
+	struct buffer_head *bh;
+	uint64_t keep;
+	bool empty;
+	int ret;
+
+	if (hdr->depth == 0) {
+		while (hdr->entries > 0) {
+			ex = EXT_FIRST(hdr) + hdr->entries - 1;
+			if (ex->lblk + tomofs_extent_len(ex, sb->s_blocksize) <=
+			    lblk) {
+				break;
+			}
+			if (*left == 0) {
+				return -EAGAIN;
+			}
+			if (ex->lblk >= lblk) {
+				(*left)--;
+				put_empty_block(sb, &ex->ext);
+				hdr->entries--;
+				continue;
+			}
+			/* A compressed cluster can only go as a whole */
+			if (ex->clen) {
+				break;
+			}
+			(*left)--;
+			keep = lblk - ex->lblk;
+			freed.head = ex->ext.head + (keep << sb->s_blocksize_bits);
+			freed.count = ex->ext.count - keep;
+			put_empty_block(sb, &freed);
+			ex->ext.count = keep;
+			break;
+		}
+		return 0;
+	}
+
+	while (hdr->entries > 0) {
+		idx = EXT_FIRST_IDX(hdr) + hdr->entries - 1;
+		bh = tomofs_ext_bread(sb, idx->child);
+		if (!bh) {
+			return -EIO;
+		}
+		ret = tomofs_journal_get_write_access(bh);
+		if (ret) {
+			brelse(bh);
+			return ret;
+		}
+		child = (struct tomofs_extent_header *)bh->b_data;
+		ret = tomofs_ext_truncate(sb, child, lblk, left);
+		empty = child->entries == 0;
+		if (ret || !empty) {
+			tomofs_journal_dirty(bh);
+			brelse(bh);
+			if (ret) {
+				return ret;
+			}
+			break;
+		}
+		/*
+		 * Don't let a stale node get written over the freed block,
+		 * now or on replay
+		 */
+		tomofs_journal_forget(bh);
+
+		freed.head = idx->child;
+		freed.count = 1;
+		put_empty_block(sb, &freed);
+		hdr->entries--;
+	}
+	return 0;
+}
+
+int tomofs_extent_truncate(struct super_block *sb,
+    struct tomofs_inode *t_inode, uint64_t lblk, unsigned int max)
+{
+	int ret;
+
+	down_write(tomofs_inode_sem(t_inode));
+	ret = tomofs_ext_truncate(sb, &t_inode->extents.hdr, lblk, &max);
+	if (!ret && t_inode->extents.hdr.entries == 0) {
+		tomofs_extent_init(t_inode);
+	}
+	up_write(tomofs_inode_sem(t_inode));
+	return ret;
+}
@@ -0,0 +1,236 @@
+#include <linux/fs.h>
+#include <linux/types.h>
+#include <linux/buffer_head.h>
+#include <linux/bitops.h>
+
+#include "tfs.h"
+#include "tomofs_trace.h"
+/*
+ * inode.c: TFS inode tables
+ *
+ * Each allocation group owns an inode bitmap and a chunk map, both one
+ * block long and pinned in memory while mounted. The bitmap says which
+ * inode numbers are in use, and a rotating hint keeps allocation from
+ * rescanning the used part of it. Table blocks are only allocated when
+ * the first inode in their chunk is, so an empty group costs two blocks
+ * and translating an inode number is two array lookups.
+ */
+
+int tomofs_load_itable(struct super_block *sb, uint64_t agno)
+{
+	struct tomofs_ag *ag = &TOMOFS_SB(sb)->ags[agno];
+
+	ag->inode_bitmap = sb_bread(sb,
+	    ag->desc.inode_bitmap >> sb->s_blocksize_bits);
+	if (!ag->inode_bitmap) {
+		return -EIO;
+	}
+	ag->inode_chunks = sb_bread(sb,
+	    ag->desc.inode_chunks >> sb->s_blocksize_bits);
+	if (!ag->inode_chunks) {
+		brelse(ag->inode_bitmap);
+		ag->inode_bitmap = NULL;
+		return -EIO;
+	}
+	ag->inode_hint = 1;
+	return 0;
+}
+
+void tomofs_destroy_itable(struct super_block *sb, uint64_t agno)
+{
+	struct tomofs_ag *ag = &TOMOFS_SB(sb)->ags[agno];
+
+	brelse(ag->inode_chunks);
+	brelse(ag->inode_bitmap);
+	ag->inode_chunks = NULL;
+	ag->inode_bitmap = NULL;
+}
+
+struct buffer_head *tomofs_inode_bread(struct super_block *sb, uint64_t ino)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	uint64_t agno = tomofs_ino_ag(sb, ino);
+	unsigned long bs = sb->s_blocksize;
+	uint64_t idx = ino % TOMOFS_AG_INODES(bs);
+	uintptr_t *chunks;
+	uintptr_t chunk;
+
+	if (agno >= sbi->tsb.ag_count) {
+		printk(KERN_ERR "tomofs: inode %llu out of range\n", ino);
+		return NULL;
+	}
+	chunks = (uintptr_t *)sbi->ags[agno].inode_chunks->b_data;
+	chunk = READ_ONCE(chunks[idx / TOMOFS_INODE_CHUNK_INODES(bs)]);
+	if (!chunk) {
+		return NULL;
+	}
+	return sb_bread(sb, (chunk >> sb->s_blocksize_bits) +
+	    (idx / TOMOFS_INODES_PER_BLK(bs)) % TOMOFS_INODE_CHUNK_BLKS);
+}
+
+/* Allocate the table chunk holding @idx. Called with inode_lock held */
+static int tomofs_itable_grow(struct super_block *sb, uint64_t agno,
+    uint64_t idx)
+{
+	struct tomofs_ag *ag = &TOMOFS_SB(sb)->ags[agno];
+	uintptr_t *chunks = (uintptr_t *)ag->inode_chunks->b_data;
+	uint64_t chunk = idx / TOMOFS_INODE_CHUNK_INODES(sb->s_blocksize);
+	struct block_extent e;
+	int ret;
+
+	if (chunks[chunk]) {
+		return 0;
+	}
+	if (!get_empty_block(sb, agno, TOMOFS_INODE_CHUNK_BLKS, &e)) {
+		return -ENOSPC;
+	}
+	ret = zero_block(sb, &e);
+	if (ret) {
+		put_empty_block(sb, &e);
+		return ret;
+	}
+	ret = tomofs_journal_get_write_access(ag->inode_chunks);
+	if (ret) {
+		put_empty_block(sb, &e);
+		return ret;
+	}
+	trace_tomofs_itable_grow(sb, agno, chunk, e.head);
+	WRITE_ONCE(chunks[chunk], e.head);
+	return tomofs_journal_dirty(ag->inode_chunks);
+}
+
+/* Claim a free inode in group @agno. Called with its inode_lock held */
+static int tomofs_ag_alloc_ino(struct super_block *sb, uint64_t agno,
+    uint64_t *ino)
+{
+	struct tomofs_ag *ag = &TOMOFS_SB(sb)->ags[agno];
+	unsigned long *map = (unsigned long *)ag->inode_bitmap->b_data;
+	uint64_t ag_inodes = TOMOFS_AG_INODES(sb->s_blocksize);
+	uint64_t idx;
+	int ret;
+
+	idx = find_next_zero_bit(map, ag_inodes, ag->inode_hint);
+	if (idx >= ag_inodes) {
+		/* index 0 is reserved */
+		idx = find_next_zero_bit(map, ag_inodes, 1);
+		if (idx >= ag_inodes) {
+			return -ENOSPC;
+		}
+	}
+
+	ret = tomofs_itable_grow(sb, agno, idx);
+	if (ret) {
+		return ret;
+	}
+
+	ret = tomofs_journal_get_write_access(ag->inode_bitmap);
+	if (ret) {
+		return ret;
+	}
+	__set_bit(idx, map);
+	tomofs_journal_dirty(ag->inode_bitmap);
+	ag->inode_hint = idx + 1;
+	ag->desc.inode_count++;
+	percpu_counter_dec(&TOMOFS_SB(sb)->free_inodes);
+	tomofs_save_ag_desc(sb, agno);
+
+	*ino = agno * ag_inodes + idx;
+	return 0;
+}
+
+/*
+ * Prefer group @agno and then the current CPU's group. Busy groups are
+ * skipped on the first pass so that parallel creates spread out instead
+ * of queueing on one group.
+ */
+int tomofs_alloc_ino(struct super_block *sb, uint64_t agno, uint64_t *ino)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	uint64_t ag_count = sbi->tsb.ag_count;
+	uint64_t cpu_ag = raw_smp_processor_id() % ag_count;
+	struct tomofs_ag *ag;
+	u64 start = tomofs_stats_start();
+	uint64_t i;
+	uint64_t g = agno;
+	int pass;
+	int ret = -ENOSPC;
+
+	agno %= ag_count;
+	for (pass = 0; pass < 2; pass++) {
+		/* @agno, then every group starting from the CPU's */
+		for (i = 0; i <= ag_count; i++) {
+			g = i == 0 ? agno : (cpu_ag + i - 1) % ag_count;
+			ag = &sbi->ags[g];
+			if (READ_ONCE(ag->desc.inode_count) >=
+			    TOMOFS_AG_INODES(sb->s_blocksize) - 1) {
+				continue;
+			}
+			if (pass == 0) {
+				if (!mutex_trylock(&ag->inode_lock)) {
+					continue;
+				}
+			} else {
+				mutex_lock(&ag->inode_lock);
+			}
+			ret = tomofs_ag_alloc_ino(sb, g, ino);
+			mutex_unlock(&ag->inode_lock);
+			if (ret != -ENOSPC) {
+				goto out;
+			}
+		}
+	}
+
+out:
+	trace_tomofs_alloc_ino(sb, g, ret ? 0 : *ino, ret);
+	tomofs_stats_account(sb, TOMOFS_OP_ALLOC_INO, start, ret);
+	return ret;
+}
+
+void tomofs_free_ino(struct super_block *sb, uint64_t ino)
+{
+	uint64_t agno = tomofs_ino_ag(sb, ino);
+	struct tomofs_ag *ag = &TOMOFS_SB(sb)->ags[agno];
+	unsigned long *map = (unsigned long *)ag->inode_bitmap->b_data;
+	uint64_t idx = ino % TOMOFS_AG_INODES(sb->s_blocksize);
+	struct buffer_head *bh;
+	int ret;
+
+	/* The table slot first, an inode in use must be in the bitmap */
+	bh = tomofs_inode_bread(sb, ino);
+	if (!bh) {
+		ret = -EIO;
+		goto fail;
+	}
+	ret = tomofs_journal_get_write_access(bh);
+	if (ret) {
+		brelse(bh);
+		goto fail;
+	}
+	lock_buffer(bh);
+	memset((struct tomofs_inode *)bh->b_data + tomofs_ino_slot(sb, ino), 0,
+	    sizeof(struct tomofs_inode));
+	unlock_buffer(bh);
+	ret = tomofs_journal_dirty(bh);
+	brelse(bh);
+	if (ret) {
+		goto fail;
+	}
+
+	mutex_lock(&ag->inode_lock);
+	ret = tomofs_journal_get_write_access(ag->inode_bitmap);
+	if (ret) {
+		mutex_unlock(&ag->inode_lock);
+		goto fail;
+	}
+	__clear_bit(idx, map);
+	tomofs_journal_dirty(ag->inode_bitmap);
+	ag->desc.inode_count--;
+	percpu_counter_inc(&TOMOFS_SB(sb)->free_inodes);
+	tomofs_save_ag_desc(sb, agno);
+	mutex_unlock(&ag->inode_lock);
+	return;
+
+fail:
+	printk(KERN_ERR "tomofs: unable to free inode %llu, error %d\n", ino,
+	    ret);
+}
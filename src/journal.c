@@ -0,0 +1,312 @@
+#include <linux/fs.h>
+#include <linux/types.h>
+#include <linux/buffer_head.h>
+#include <linux/jbd2.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/blkdev.h>
+#include <linux/list_sort.h>
+#include <linux/workqueue.h>
+
+#include "tfs.h"
+/*
+ * journal.c: TFS metadata journal
+ *
+ * Metadata updates are logged through jbd2; see Documentation/tx.md.
+ * Namespace operations, block allocation and truncate each run inside a
+ * handle. The helpers below act on journal_current_handle(), so the block,
+ * extent and directory code doesn't need to pass handles around.
+ *
+ * Blocks freed by a transaction only go back to the allocator once it has
+ * committed. With -o discard they are discarded first, from a work item
+ * that batches every transaction committed since it last ran.
+ */
+
+/* Blocks freed by a transaction, queued on its t_private_list */
+struct tomofs_freed_extent {
+	struct list_head list;
+	uint64_t start;
+	uint64_t count;
+};
+
+static void tomofs_release_freed(struct super_block *sb,
+    struct list_head *freed)
+{
+	struct tomofs_freed_extent *fe;
+	struct tomofs_freed_extent *tmp;
+
+	list_for_each_entry_safe(fe, tmp, freed, list) {
+		tomofs_release_blocks(sb, fe->start, fe->count);
+		list_del(&fe->list);
+		kfree(fe);
+	}
+}
+
+static int tomofs_freed_cmp(void *priv, struct list_head *a,
+    struct list_head *b)
+{
+	struct tomofs_freed_extent *fa;
+	struct tomofs_freed_extent *fb;
+
+	fa = list_entry(a, struct tomofs_freed_extent, list);
+	fb = list_entry(b, struct tomofs_freed_extent, list);
+	if (fa->start < fb->start) {
+		return -1;
+	}
+	return fa->start > fb->start;
+}
+
+static void tomofs_discard_work(struct work_struct *work)
+{
+	struct tomofs_sb_info *sbi =
+	    container_of(work, struct tomofs_sb_info, discard_work);
+	struct super_block *sb = sbi->sb;
+	struct tomofs_freed_extent *fe;
+	uint64_t start = 0;
+	uint64_t count = 0;
+	LIST_HEAD(freed);
+
+	spin_lock(&sbi->freed_lock);
+	list_splice_init(&sbi->discard_list, &freed);
+	spin_unlock(&sbi->freed_lock);
+
+	/*
+	 * Adjacent extents, often freed by different transactions, go down
+	 * as one discard. Discard is only a hint, so errors are ignored.
+	 */
+	list_sort(NULL, &freed, tomofs_freed_cmp);
+	list_for_each_entry(fe, &freed, list) {
+		if (count && fe->start == start + count) {
+			count += fe->count;
+			continue;
+		}
+		if (count) {
+			sb_issue_discard(sb, start, count, GFP_NOFS, 0);
+		}
+		start = fe->start;
+		count = fe->count;
+	}
+	if (count) {
+		sb_issue_discard(sb, start, count, GFP_NOFS, 0);
+	}
+
+	/* Only now can the blocks be reallocated */
+	tomofs_release_freed(sb, &freed);
+}
+
+/* Runs in kjournald2 once @txn is safely on disk */
+static void tomofs_journal_commit_callback(journal_t *journal,
+    transaction_t *txn)
+{
+	struct super_block *sb = journal->j_private;
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	LIST_HEAD(freed);
+
+	if (sbi->mount_opts & TOMOFS_MOUNT_DISCARD) {
+		spin_lock(&sbi->freed_lock);
+		list_splice_tail_init(&txn->t_private_list, &sbi->discard_list);
+		spin_unlock(&sbi->freed_lock);
+		/* Keep the commit thread off the device's discard latency */
+		queue_work(system_unbound_wq, &sbi->discard_work);
+		return;
+	}
+
+	spin_lock(&sbi->freed_lock);
+	list_splice_init(&txn->t_private_list, &freed);
+	spin_unlock(&sbi->freed_lock);
+	tomofs_release_freed(sb, &freed);
+}
+
+int tomofs_journal_load(struct super_block *sb)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	struct block_extent *je = &sbi->tsb.journal;
+	journal_t *journal;
+	int ret;
+
+	if (je->count < TOMOFS_JOURNAL_BLKS) {
+		printk(KERN_ERR "tomofs: no journal, run mkfs.tomofs again\n");
+		return -EINVAL;
+	}
+	journal = jbd2_journal_init_dev(sb->s_bdev, sb->s_bdev,
+	    je->head >> sb->s_blocksize_bits, je->count, sb->s_blocksize);
+	if (!journal) {
+		return -ENOMEM;
+	}
+	journal->j_private = sb;
+	journal->j_commit_callback = tomofs_journal_commit_callback;
+	INIT_LIST_HEAD(&sbi->discard_list);
+	INIT_WORK(&sbi->discard_work, tomofs_discard_work);
+	/* Commit blocks are written with a flush and FUA */
+	journal->j_flags |= JBD2_BARRIER;
+
+	ret = jbd2_journal_load(journal);
+	if (ret) {
+		printk(KERN_ERR "tomofs: unable to load journal: %d\n", ret);
+		jbd2_journal_destroy(journal);
+		return ret;
+	}
+	spin_lock_init(&sbi->freed_lock);
+	sbi->journal = journal;
+	return 0;
+}
+
+void tomofs_journal_destroy(struct super_block *sb)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+
+	if (!sbi->journal) {
+		return;
+	}
+	if (jbd2_journal_destroy(sbi->journal)) {
+		printk(KERN_ERR "tomofs: journal aborted on unmount\n");
+	}
+	/* The last commits may have queued discards */
+	flush_work(&sbi->discard_work);
+	sbi->journal = NULL;
+}
+
+handle_t *tomofs_journal_start(struct super_block *sb, int nblocks)
+{
+	return jbd2_journal_start(TOMOFS_SB(sb)->journal, nblocks);
+}
+
+int tomofs_journal_stop(handle_t *handle)
+{
+	return jbd2_journal_stop(handle);
+}
+
+/* Freeing an extent, which may straddle two groups, and a node it empties */
+static int tomofs_free_credits(struct super_block *sb)
+{
+	int credits = 2 + 3;
+
+	if (atomic_read(&TOMOFS_SB(sb)->refcount_maps)) {
+		credits += 2 * TOMOFS_REFCOUNT_BLKS;
+	}
+	return credits;
+}
+
+int tomofs_truncate_credits(struct super_block *sb)
+{
+	return min(TOMOFS_EXTENT_CREDITS + TOMOFS_INODE_CREDITS +
+	    TOMOFS_TRUNCATE_BATCH * tomofs_free_credits(sb),
+	    TOMOFS_SB(sb)->journal->j_max_transaction_buffers);
+}
+
+unsigned int tomofs_truncate_batch(struct super_block *sb)
+{
+	handle_t *handle = journal_current_handle();
+	int left;
+
+	if (!handle) {
+		return TOMOFS_TRUNCATE_BATCH;
+	}
+	left = handle->h_buffer_credits - TOMOFS_EXTENT_CREDITS -
+	    TOMOFS_INODE_CREDITS;
+	return left > 0 ? left / tomofs_free_credits(sb) : 0;
+}
+
+int tomofs_journal_ensure_credits(int nblocks)
+{
+	handle_t *handle = journal_current_handle();
+	int ret;
+
+	if (!handle || handle->h_buffer_credits >= nblocks) {
+		return 0;
+	}
+	ret = jbd2_journal_extend(handle, nblocks - handle->h_buffer_credits);
+	if (ret <= 0) {
+		return ret;
+	}
+	return jbd2_journal_restart(handle, nblocks);
+}
+
+int tomofs_journal_commit(struct super_block *sb, int wait)
+{
+	journal_t *journal = TOMOFS_SB(sb)->journal;
+	tid_t tid;
+
+	/* Also returns the tid of a commit already in flight */
+	if (!jbd2_journal_start_commit(journal, &tid) || !wait) {
+		return 0;
+	}
+	return jbd2_log_wait_commit(journal, tid);
+}
+
+int tomofs_journal_get_write_access(struct buffer_head *bh)
+{
+	handle_t *handle = journal_current_handle();
+
+	if (!handle) {
+		return 0;
+	}
+	return jbd2_journal_get_write_access(handle, bh);
+}
+
+int tomofs_journal_get_create_access(struct buffer_head *bh)
+{
+	handle_t *handle = journal_current_handle();
+
+	if (!handle) {
+		return 0;
+	}
+	return jbd2_journal_get_create_access(handle, bh);
+}
+
+int tomofs_journal_dirty(struct buffer_head *bh)
+{
+	handle_t *handle = journal_current_handle();
+	int ret;
+
+	if (!handle) {
+		mark_buffer_dirty(bh);
+		return 0;
+	}
+	ret = jbd2_journal_dirty_metadata(handle, bh);
+	if (ret) {
+		printk(KERN_ERR "tomofs: unable to journal block %llu: %d\n",
+		    (unsigned long long)bh->b_blocknr, ret);
+	}
+	return ret;
+}
+
+void tomofs_journal_forget(struct buffer_head *bh)
+{
+	handle_t *handle = journal_current_handle();
+
+	if (!handle) {
+		bforget(bh);
+		return;
+	}
+	/* Drops our reference to @bh like bforget() */
+	if (jbd2_journal_revoke(handle, bh->b_blocknr, bh)) {
+		printk(KERN_ERR "tomofs: unable to revoke block %llu\n",
+		    (unsigned long long)bh->b_blocknr);
+	}
+}
+
+bool tomofs_journal_defer_free(struct super_block *sb, uint64_t start,
+    uint64_t count)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	handle_t *handle = journal_current_handle();
+	struct tomofs_freed_extent *fe;
+
+	if (!handle) {
+		return false;
+	}
+	fe = kmalloc(sizeof(struct tomofs_freed_extent), GFP_NOFS);
+	if (!fe) {
+		/* Reusing them early only matters if we crash before commit */
+		printk(KERN_WARNING "tomofs: releasing freed blocks early\n");
+		return false;
+	}
+	fe->start = start;
+	fe->count = count;
+
+	spin_lock(&sbi->freed_lock);
+	list_add_tail(&fe->list, &handle->h_transaction->t_private_list);
+	spin_unlock(&sbi->freed_lock);
+	return true;
+}
@@ -0,0 +1,186 @@
+#include <linux/fs.h>
+#include <linux/types.h>
+#include <linux/buffer_head.h>
+
+#include "tfs.h"
+/*
+ * refcount.c: TFS shared blocks
+ *
+ * Cloning a file range maps the same disk blocks into both files. Every
+ * allocation group counts the extra owners of its blocks in a refcount
+ * map, which is only allocated once a clone shares blocks of the group.
+ * Freeing a shared block drops an owner instead, and writeback gives a
+ * file its own copy of a shared block before overwriting it, see
+ * tomofs_get_block(). A group's map is covered by its free space lock.
+ */
+
+/* Map block holding the count of block @blk, and the count's index in it */
+static struct buffer_head *tomofs_refcount_bread(struct super_block *sb,
+    struct tomofs_ag *ag, uint64_t blk, unsigned int *i)
+{
+	uint64_t per_blk = TOMOFS_REFCOUNTS_PER_BLK(sb->s_blocksize);
+	uint64_t idx = blk % TOMOFS_AG_BLOCKS(sb->s_blocksize);
+
+	*i = idx % per_blk;
+	return sb_bread(sb, (ag->desc.refcount_map >> sb->s_blocksize_bits) +
+	    idx / per_blk);
+}
+
+/* Give group @agno an all zero refcount map */
+static int tomofs_refcount_create(struct super_block *sb, uint64_t agno)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	struct tomofs_ag *ag = &sbi->ags[agno];
+	struct block_extent e;
+	int ret;
+
+	/* Allocating takes the group's lock, so check again afterwards */
+	if (!get_empty_block(sb, agno, TOMOFS_REFCOUNT_BLKS, &e)) {
+		return -ENOSPC;
+	}
+	ret = zero_block(sb, &e);
+	if (ret) {
+		goto out;
+	}
+
+	/* The descriptor is saved under the inode lock, which comes first */
+	mutex_lock(&ag->inode_lock);
+	mutex_lock(&ag->free.lock);
+	if (!ag->desc.refcount_map) {
+		ag->desc.refcount_map = e.head;
+		ret = tomofs_save_ag_desc(sb, agno);
+		if (ret) {
+			ag->desc.refcount_map = 0;
+		} else {
+			atomic_inc(&sbi->refcount_maps);
+			e.count = 0;
+		}
+	}
+	mutex_unlock(&ag->free.lock);
+	mutex_unlock(&ag->inode_lock);
+
+out:
+	/* Also when another clone created the map first */
+	if (e.count) {
+		put_empty_block(sb, &e);
+	}
+	return ret;
+}
+
+int tomofs_share_blocks(struct super_block *sb, uint64_t start,
+    uint64_t count)
+{
+	uint64_t per_blk = TOMOFS_REFCOUNTS_PER_BLK(sb->s_blocksize);
+	uint64_t agno = tomofs_blk_ag(sb, start);
+	struct tomofs_ag *ag = &TOMOFS_SB(sb)->ags[agno];
+	struct buffer_head *bh;
+	uint16_t *counts;
+	unsigned int i;
+	uint64_t j;
+	int ret;
+
+	if (!READ_ONCE(ag->desc.refcount_map)) {
+		ret = tomofs_refcount_create(sb, agno);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	mutex_lock(&ag->free.lock);
+	bh = tomofs_refcount_bread(sb, ag, start, &i);
+	if (!bh) {
+		ret = -EIO;
+		goto out;
+	}
+	count = min_t(uint64_t, count, per_blk - i);
+	counts = (uint16_t *)bh->b_data + i;
+	for (j = 0; j < count; j++) {
+		if (counts[j] == TOMOFS_REFCOUNT_MAX) {
+			ret = -EMLINK;
+			goto release;
+		}
+	}
+	ret = tomofs_journal_get_write_access(bh);
+	if (ret) {
+		goto release;
+	}
+	for (j = 0; j < count; j++) {
+		counts[j]++;
+	}
+	ret = tomofs_journal_dirty(bh);
+	if (!ret) {
+		ret = count;
+	}
+release:
+	brelse(bh);
+out:
+	mutex_unlock(&ag->free.lock);
+	return ret;
+}
+
+int tomofs_block_shared(struct super_block *sb, uint64_t blk)
+{
+	struct tomofs_ag *ag = &TOMOFS_SB(sb)->ags[tomofs_blk_ag(sb, blk)];
+	struct buffer_head *bh;
+	unsigned int i;
+	int ret = 0;
+
+	/* Maps are never taken away */
+	if (!READ_ONCE(ag->desc.refcount_map)) {
+		return 0;
+	}
+	mutex_lock(&ag->free.lock);
+	bh = tomofs_refcount_bread(sb, ag, blk, &i);
+	if (bh) {
+		ret = ((uint16_t *)bh->b_data)[i] != 0;
+		brelse(bh);
+	} else {
+		ret = -EIO;
+	}
+	mutex_unlock(&ag->free.lock);
+	return ret;
+}
+
+uint64_t tomofs_refcount_put(struct super_block *sb, struct tomofs_ag *ag,
+    uint64_t start, uint64_t count, bool *shared)
+{
+	uint64_t per_blk = TOMOFS_REFCOUNTS_PER_BLK(sb->s_blocksize);
+	struct buffer_head *bh;
+	uint16_t *counts;
+	unsigned int i;
+	uint64_t n;
+	uint64_t j;
+
+	*shared = false;
+	if (!ag->desc.refcount_map) {
+		return count;
+	}
+	bh = tomofs_refcount_bread(sb, ag, start, &i);
+	if (!bh) {
+		/* Leak the blocks rather than free what others may still use */
+		printk(KERN_ERR "tomofs: unable to read refcount map, leaking "
+		    "%llu blocks at %llu\n", count, start);
+		*shared = true;
+		return count;
+	}
+	count = min_t(uint64_t, count, per_blk - i);
+	counts = (uint16_t *)bh->b_data + i;
+	*shared = counts[0] != 0;
+	for (n = 1; n < count; n++) {
+		if ((counts[n] != 0) != *shared) {
+			break;
+		}
+	}
+	if (*shared) {
+		if (tomofs_journal_get_write_access(bh)) {
+			printk(KERN_ERR "tomofs: refcount map update failed\n");
+		} else {
+			for (j = 0; j < n; j++) {
+				counts[j]--;
+			}
+			tomofs_journal_dirty(bh);
+		}
+	}
+	brelse(bh);
+	return n;
+}
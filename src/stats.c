@@ -0,0 +1,186 @@
+#include <linux/fs.h>
+#include <linux/types.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/bitops.h>
+
+#include "tfs.h"
+
+#define CREATE_TRACE_POINTS
+#include "tomofs_trace.h"
+
+/*
+ * stats.c: TFS operation statistics
+ *
+ * Every mount counts its VFS operations, inode table I/O and allocations
+ * in per-CPU counters along with a log2 histogram of their latencies.
+ * They are summed over the CPUs when read from
+ * /sys/kernel/debug/tomofs/<device>/stats; writing to the file resets
+ * them. The same operations have tracepoints, see tomofs_trace.h.
+ */
+
+static const char * const tomofs_op_names[TOMOFS_NR_OPS] = {
+	[TOMOFS_OP_LOOKUP] = "lookup",
+	[TOMOFS_OP_CREATE] = "create",
+	[TOMOFS_OP_MKDIR] = "mkdir",
+	[TOMOFS_OP_READDIR] = "readdir",
+	[TOMOFS_OP_SETATTR] = "setattr",
+	[TOMOFS_OP_FSYNC] = "fsync",
+	[TOMOFS_OP_READ_INODE] = "read_inode",
+	[TOMOFS_OP_SAVE_INODE] = "save_inode",
+	[TOMOFS_OP_SYNC_SB] = "sync_sb",
+	[TOMOFS_OP_ALLOC_INO] = "alloc_ino",
+	[TOMOFS_OP_ALLOC_BLOCKS] = "alloc_blocks",
+	[TOMOFS_OP_FREE_BLOCKS] = "free_blocks",
+};
+
+static struct dentry *tomofs_debugfs_root;
+
+void tomofs_debugfs_init(void)
+{
+	/* Statistics are optional, failures leave it NULL or an ERR_PTR */
+	tomofs_debugfs_root = debugfs_create_dir("tomofs", NULL);
+}
+
+void tomofs_debugfs_exit(void)
+{
+	debugfs_remove_recursive(tomofs_debugfs_root);
+}
+
+void tomofs_stats_account(struct super_block *sb, enum tomofs_stat_op op,
+    u64 start, int err)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	u64 ns = ktime_get_ns() - start;
+	int bucket = min(fls64(ns), TOMOFS_LAT_BUCKETS - 1);
+
+	if (!sbi || !sbi->stats) {
+		return;
+	}
+	this_cpu_inc(sbi->stats->ops[op].count);
+	if (err) {
+		this_cpu_inc(sbi->stats->ops[op].errors);
+	}
+	this_cpu_add(sbi->stats->ops[op].ns, ns);
+	this_cpu_inc(sbi->stats->ops[op].hist[bucket]);
+}
+
+/* Sum of @op over every CPU. Updates in flight may be missed */
+static void tomofs_stats_sum(struct tomofs_sb_info *sbi, int op,
+    struct tomofs_op_stats *sum)
+{
+	struct tomofs_op_stats *st;
+	int cpu;
+	int i;
+
+	memset(sum, 0, sizeof(struct tomofs_op_stats));
+	for_each_possible_cpu(cpu) {
+		st = &per_cpu_ptr(sbi->stats, cpu)->ops[op];
+		sum->count += READ_ONCE(st->count);
+		sum->errors += READ_ONCE(st->errors);
+		sum->ns += READ_ONCE(st->ns);
+		for (i = 0; i < TOMOFS_LAT_BUCKETS; i++) {
+			sum->hist[i] += READ_ONCE(st->hist[i]);
+		}
+	}
+}
+
+static int tomofs_stats_show(struct seq_file *m, void *v)
+{
+	struct tomofs_sb_info *sbi = m->private;
+	struct tomofs_op_stats sum;
+	int op;
+	int i;
+
+	seq_printf(m, "%-14s %12s %12s %12s\n", "op", "count", "errors",
+	    "avg_ns");
+	for (op = 0; op < TOMOFS_NR_OPS; op++) {
+		tomofs_stats_sum(sbi, op, &sum);
+		seq_printf(m, "%-14s %12llu %12llu %12llu\n",
+		    tomofs_op_names[op], sum.count, sum.errors,
+		    sum.count ? div64_u64(sum.ns, sum.count) : 0);
+	}
+
+	/* Bucket i counts latencies in [2^(i-1), 2^i) ns */
+	seq_puts(m, "\nlatency histograms, ns\n");
+	for (op = 0; op < TOMOFS_NR_OPS; op++) {
+		tomofs_stats_sum(sbi, op, &sum);
+		if (!sum.count) {
+			continue;
+		}
+		seq_printf(m, "%s:\n", tomofs_op_names[op]);
+		for (i = 0; i < TOMOFS_LAT_BUCKETS; i++) {
+			if (!sum.hist[i]) {
+				continue;
+			}
+			if (i == TOMOFS_LAT_BUCKETS - 1) {
+				seq_printf(m, "  >= %11llu %12llu\n",
+				    1ULL << (i - 1), sum.hist[i]);
+			} else {
+				seq_printf(m, "  <  %11llu %12llu\n",
+				    1ULL << i, sum.hist[i]);
+			}
+		}
+	}
+	return 0;
+}
+
+static int tomofs_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tomofs_stats_show, inode->i_private);
+}
+
+static ssize_t tomofs_stats_write(struct file *file, const char __user *buf,
+    size_t len, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct tomofs_sb_info *sbi = m->private;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		memset(per_cpu_ptr(sbi->stats, cpu), 0,
+		    sizeof(struct tomofs_stats));
+	}
+	return len;
+}
+
+static const struct file_operations tomofs_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = tomofs_stats_open,
+	.read = seq_read,
+	.write = tomofs_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+int tomofs_stats_init(struct super_block *sb)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+
+	sbi->stats = alloc_percpu(struct tomofs_stats);
+	if (!sbi->stats) {
+		return -ENOMEM;
+	}
+	if (IS_ERR_OR_NULL(tomofs_debugfs_root)) {
+		return 0;
+	}
+	sbi->debugfs = debugfs_create_dir(sb->s_id, tomofs_debugfs_root);
+	if (IS_ERR_OR_NULL(sbi->debugfs)) {
+		sbi->debugfs = NULL;
+		return 0;
+	}
+	debugfs_create_file("stats", 0600, sbi->debugfs, sbi,
+	    &tomofs_stats_fops);
+	return 0;
+}
+
+void tomofs_stats_destroy(struct super_block *sb)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+
+	debugfs_remove_recursive(sbi->debugfs);
+	sbi->debugfs = NULL;
+	free_percpu(sbi->stats);
+	sbi->stats = NULL;
+}
@@ -6,19 +6,36 @@
 #include <linux/vfs.h>
 #include <linux/time.h>
 #include <linux/atomic.h>
+#include <linux/mpage.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/writeback.h>
+#include <linux/iomap.h>
+#include <linux/uio.h>
+#include <linux/blkdev.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
 
 #include <tfs.h>
+#include <tomofs_trace.h>
 
-static DEFINE_MUTEX(tomofs_sb_lock);
-/* TODO: Make lock per-inode */
-static DEFINE_MUTEX(tomofs_inode_tbl_lock);
-/* TODO: Make lock per-inode */
-static DEFINE_MUTEX(tomofs_directory_record_lock);
+/* Where delayed buffers point until writeback allocates their block */
+#define TOMOFS_DELALLOC_BLOCK (~(sector_t)0)
+
+/*
+ * Locking:
+ * Directory records are only changed under the parent's i_rwsem, which the
+ * VFS holds for create and mkdir. Inode table slots are copied in and out
+ * under the table block's buffer lock, and each in-memory inode is covered
+ * by its own tomofs_inode_info.sem. Nothing is global to the module.
+ */
 
 static struct dentry *tomofs_mount(struct file_system_type *fs_type,	
 	int flags, const char *dev_name, void *data);
 
 static void tomofs_kill_superblock(struct super_block *sb);
+static void tomofs_put_super(struct super_block *sb);
 
 static int tomofs_create(struct inode *parent, struct dentry *dentry,
     umode_t mode, bool excl);
@@ -29,11 +46,21 @@ static struct dentry *tomofs_lookup(struct inode *parent,
 static int tomofs_mkdir(struct inode *parent, struct dentry *dentry,
     umode_t mode);
 
-ssize_t tomofs_read(struct file *f, char __user *buf, size_t len,
-    loff_t *offset);
-
-ssize_t tomofs_write(struct file *f, const char __user *buf, size_t len,
-    loff_t *offset);
+static int tomofs_setattr(struct dentry *dentry, struct iattr *attr);
+static int tomofs_fsync(struct file *file, loff_t start, loff_t end,
+    int datasync);
+static ssize_t tomofs_file_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t tomofs_file_write_iter(struct kiocb *iocb,
+    struct iov_iter *from);
+static int tomofs_write_inode(struct inode *inode,
+    struct writeback_control *wbc);
+static int tomofs_sync_fs(struct super_block *sb, int wait);
+static int tomofs_statfs(struct dentry *dentry, struct kstatfs *buf);
+static int tomofs_show_options(struct seq_file *m, struct dentry *root);
+static long tomofs_ioctl(struct file *file, unsigned int cmd,
+    unsigned long arg);
+static int tomofs_clone_file_range(struct file *file_in, loff_t pos_in,
+    struct file *file_out, loff_t pos_out, u64 len);
 
 static int tomofs_iterate(struct file *fp, struct dir_context *ctx);
 
@@ -54,226 +81,334 @@ static const struct inode_operations tomofs_i_op = {
 	.mkdir = tomofs_mkdir,
 };
 
+static const struct inode_operations tomofs_i_file_iop = {
+	.setattr = tomofs_setattr,
+};
+
 static const struct file_operations tomofs_i_file_op = {
-	.read = NULL,
-	.write = NULL,
+	.owner = THIS_MODULE,
+	.llseek = generic_file_llseek,
+	.read_iter = tomofs_file_read_iter,
+	.write_iter = tomofs_file_write_iter,
+	.mmap = generic_file_mmap,
+	.fsync = tomofs_fsync,
+	.splice_read = generic_file_splice_read,
+	.unlocked_ioctl = tomofs_ioctl,
+	.clone_file_range = tomofs_clone_file_range,
 };
 
+static const struct address_space_operations tomofs_aops;
+
 static const struct file_operations tomofs_i_dir_op = {
 	.owner = THIS_MODULE,
 	.iterate = tomofs_iterate,
+	.unlocked_ioctl = tomofs_ioctl,
 };
 
+static struct inode *tomofs_alloc_inode(struct super_block *sb);
+
+static void tomofs_destroy_inode(struct inode *inode);
+
 static const struct super_operations tomofs_sops = {
-	.destroy_inode = NULL,
-	.put_super = NULL,
+	.alloc_inode = tomofs_alloc_inode,
+	.destroy_inode = tomofs_destroy_inode,
+	.write_inode = tomofs_write_inode,
+	.sync_fs = tomofs_sync_fs,
+	.statfs = tomofs_statfs,
+	.show_options = tomofs_show_options,
+	.put_super = tomofs_put_super,
 };
 
+static void tomofs_inode_init_once(void *foo)
+{
+	struct tomofs_inode_info *ti = (struct tomofs_inode_info *)foo;
+
+	init_rwsem(&ti->sem);
+	inode_init_once(&ti->vfs_inode);
+}
 
 static int __init init_tomofs_fs(void)
 {
-	tomofs_inode_cachep = KMEM_CACHE(tomofs_inode, \
-	    (SLAB_RECLAIM_ACCOUNT| SLAB_MEM_SPREAD));
+	int ret;
+
+	BUILD_BUG_ON(sizeof(struct tomofs_inode) != TOMOFS_INODE_SIZE);
+	tomofs_inode_cachep = kmem_cache_create("tomofs_inode_cache",
+	    sizeof(struct tomofs_inode_info), 0,
+	    (SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT),
+	    tomofs_inode_init_once);
 	if (!tomofs_inode_cachep) {
 		return -ENOMEM;
 	}
 	printk(KERN_INFO "loading tomofs.ko\n");
-	return register_filesystem(&tomofs_fs_type);
+	tomofs_debugfs_init();
+	ret = register_filesystem(&tomofs_fs_type);
+	if (ret) {
+		tomofs_debugfs_exit();
+		kmem_cache_destroy(tomofs_inode_cachep);
+	}
+	return ret;
 }
 
 static void __exit exit_tomofs_fs(void)
 {
 	printk(KERN_INFO "unloading tomofs.ko\n");
+	unregister_filesystem(&tomofs_fs_type);
+	tomofs_debugfs_exit();
+	/* Let pending tomofs_i_callback()s finish before the cache goes */
+	rcu_barrier();
 	kmem_cache_destroy(tomofs_inode_cachep);
-	return unregister_filesystem(&tomofs_fs_type);
 }
 
-/* Allocates struct tomofs_inode. Caller must clean up */
-struct tomofs_inode *tomofs_get_inode(struct super_block *sb, uint64_t ino)
+static struct inode *tomofs_alloc_inode(struct super_block *sb)
 {
-	struct tomofs_inode *t_inode = NULL;
-	struct tomofs_super_block *tsb = (struct tomofs_super_block *)sb->s_fs_info;
+	struct tomofs_inode_info *ti;
+
+	ti = kmem_cache_alloc(tomofs_inode_cachep, GFP_KERNEL);
+	if (!ti) {
+		return NULL;
+	}
+	memset(&ti->t_inode, 0, sizeof(struct tomofs_inode));
+	atomic_set(&ti->delalloc, 0);
+	ti->bloom = NULL;
+	return &ti->vfs_inode;
+}
+
+static void tomofs_i_callback(struct rcu_head *head)
+{
+	struct inode *inode = container_of(head, struct inode, i_rcu);
+
+	kmem_cache_free(tomofs_inode_cachep, TOMOFS_I(inode));
+}
+
+static void tomofs_destroy_inode(struct inode *inode)
+{
+	tomofs_dir_release(TOMOFS_T(inode));
+	call_rcu(&inode->i_rcu, tomofs_i_callback);
+}
+
+/* Copy inode @ino from the inode table into @t_inode */
+static int tomofs_read_inode(struct super_block *sb, uint64_t ino,
+    struct tomofs_inode *t_inode)
+{
+	int ret = -EIO;
 	struct buffer_head *bh;
 	struct tomofs_inode *inodes;
-	BUG_ON(!tsb);
-
-	if (mutex_lock_interruptible(&tomofs_inode_tbl_lock)) {
-		printk(KERN_DEBUG "fail to aquire lock tomofs_get_inode()\n");
+	uint64_t slot = tomofs_ino_slot(sb, ino);
+	u64 start = tomofs_stats_start();
 
-		return NULL;
+	if (ino % TOMOFS_AG_INODES(sb->s_blocksize) == 0) {
+		printk(KERN_ERR "inode no. %llu is unused", ino);
+		ret = -ESTALE;
+		goto out;
 	}
 
-	bh = __bread(sb->s_bdev, tsb->inodes >> sb->s_blocksize_bits,
-	    TOMOFS_BLK_SIZE);
-	BUG_ON(!bh);
+	bh = tomofs_inode_bread(sb, ino);
+	if (!bh) {
+		goto out;
+	}
 	inodes = (struct tomofs_inode *)bh->b_data;
-	printk(KERN_DEBUG "inode 0 magic: 0x%x\n", inodes->i_ino);
-	WARN_ON(inodes->i_ino != 0xdeadbeef);
 
-	if (ino == 0) {
-		printk(KERN_ERR "inode no. 0 is unused");
-		goto release;
-	}
 	/* Checking for used flag */
-	if ((inodes[ino].flags & 0x1) != 0x1) {
+	if (!(inodes[slot].flags & TOMOFS_INODE_USED)) {
 		printk(KERN_ERR "Unused inode was requested.\n");
+		ret = -ESTALE;
 		goto release;
 	}
 
-	t_inode = kmem_cache_alloc(tomofs_inode_cachep, GFP_KERNEL);
-	if (!t_inode) {
-		printk(KERN_ERR "ENOMEM in tomofs_get_inode()\n");
+	lock_buffer(bh);
+	memcpy(t_inode, inodes + slot, sizeof(struct tomofs_inode));
+	unlock_buffer(bh);
+	ret = 0;
+	if (!tomofs_has_inline(t_inode) &&
+	    t_inode->extents.hdr.magic != TOMOFS_EXTENT_MAGIC) {
+		printk(KERN_ERR "tomofs: bad extent tree root in inode %llu, "
+		    "older images need a fresh mkfs.tomofs\n", ino);
+		ret = -EIO;
 	}
-	memcpy(t_inode, inodes + ino, sizeof(struct tomofs_inode));
 
 release:
 	brelse(bh);
-	mutex_unlock(&tomofs_inode_tbl_lock);
-	return t_inode;
+out:
+	trace_tomofs_read_inode(sb, ino, ret);
+	tomofs_stats_account(sb, TOMOFS_OP_READ_INODE, start, ret);
+	return ret;
 }
 
-static int tomofs_sync_sb(struct super_block *sb)
+/*
+ * Get the in-memory inode for @ino, reading it from the inode table only
+ * if it is not cached already.
+ */
+static struct inode *tomofs_iget(struct super_block *sb, uint64_t ino)
 {
-	struct buffer_head *bh;
+	struct tomofs_inode *t_inode;
+	struct inode *inode;
 	int ret;
 
+	inode = iget_locked(sb, ino);
+	if (!inode) {
+		return ERR_PTR(-ENOMEM);
+	}
+	if (!(inode->i_state & I_NEW)) {
+		return inode;
+	}
+
+	t_inode = TOMOFS_T(inode);
+	ret = tomofs_read_inode(sb, ino, t_inode);
+	if (ret) {
+		iget_failed(inode);
+		return ERR_PTR(ret);
+	}
+
+	inode_init_owner(inode, NULL, t_inode->mode);
+	inode->i_op = &tomofs_i_op;
+	if (S_ISDIR(t_inode->mode)) {
+		inode->i_fop = &tomofs_i_dir_op;
+	} else if (S_ISREG(t_inode->mode)) {
+		if (tomofs_is_compressed(t_inode) &&
+		    PAGE_SIZE > TOMOFS_CLUSTER_SIZE) {
+			printk(KERN_ERR "tomofs: inode %llu is compressed, which "
+			    "needs pages of at most %d bytes\n", ino,
+			    TOMOFS_CLUSTER_SIZE);
+			iget_failed(inode);
+			return ERR_PTR(-EOPNOTSUPP);
+		}
+		inode->i_op = &tomofs_i_file_iop;
+		inode->i_fop = &tomofs_i_file_op;
+		inode->i_mapping->a_ops = tomofs_is_compressed(t_inode) ?
+		    &tomofs_compress_aops : &tomofs_aops;
+	} else {
+		printk(KERN_ERR "tomofs: inode %llu has unknown mode 0%o\n",
+		    ino, t_inode->mode);
+		iget_failed(inode);
+		return ERR_PTR(-EIO);
+	}
+	inode->i_size = t_inode->file_size;
+	inode->i_atime = t_inode->i_atime;
+	inode->i_ctime = t_inode->i_ctime;
+	inode->i_mtime = t_inode->i_mtime;
+	unlock_new_inode(inode);
+	return inode;
+}
+
+/* Copy the super block into its buffer, writing it out if @wait */
+static int tomofs_sync_sb(struct super_block *sb, int wait)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	struct buffer_head *bh;
+	uint64_t agno;
+	u64 start = tomofs_stats_start();
+	int ret = 0;
+
 	bh = sb_bread(sb, TOMOFS_SB_BLK_NO);
 	/* PANIC on failure to read super block */
 	BUG_ON(!bh);
 
-	bh->b_data = (char *)sb->s_fs_info;
-	printk(KERN_DEBUG "sync_sb: inode table: %x\n", ((struct tomofs_super_block *)bh->b_data)->inodes);
+	sbi->tsb.inode_count = 0;
+	for (agno = 0; agno < sbi->tsb.ag_count; agno++) {
+		sbi->tsb.inode_count += READ_ONCE(sbi->ags[agno].desc.inode_count);
+	}
+	sbi->tsb.free_blocks = percpu_counter_sum_positive(&sbi->free_blocks);
+
+	lock_buffer(bh);
+	memcpy(bh->b_data, &sbi->tsb, sizeof(struct tomofs_super_block));
+	unlock_buffer(bh);
 	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
+	if (wait) {
+		ret = sync_dirty_buffer(bh);
+	}
 	brelse(bh);
-	return 0;
+	trace_tomofs_sync_sb(sb, sbi->tsb.inode_count, wait, ret);
+	tomofs_stats_account(sb, TOMOFS_OP_SYNC_SB, start, ret);
+	return ret;
 }
 
-/* called with inode_tbl lock held */
-static uint64_t tomofs_allocate_next_inode(struct super_block *sb)
+/* Pick up size and times the VFS changed since @inode was last saved */
+static void tomofs_update_inode(struct inode *inode)
 {
-	struct tomofs_super_block *tsb;
-	struct buffer_head *bh;
-	struct tomofs_inode *inode;
-	uint64_t next_ino = 0;
-	uint64_t i;
-
-	tsb = (struct tomofs_super_block *)sb->s_fs_info;
-	printk(KERN_DEBUG "allocate: tsb->inodes %x\n", tsb->inodes);
-	bh = __bread(sb->s_bdev, tsb->inodes >> sb->s_blocksize_bits,
-	    TOMOFS_BLK_SIZE);
-	inode = (struct tomofs_inode *)bh->b_data;
-	/* start from 1 */
-	inode++;
-	if (tsb->inode_count >= TOMOFS_MAXINODES) {
-		next_ino = -ENOSPC;
-		goto release;
-	}
-	for (i = 1; i < TOMOFS_MAXINODES; i++, inode++) {
-		if ((inode->flags & 0x1) == 0) {
-			tsb->inode_count++;
-			inode->flags |= 0x1;
-			next_ino = i;
-			break;
-		}
+	struct tomofs_inode *t_inode = TOMOFS_T(inode);
+
+	down_write(tomofs_inode_sem(t_inode));
+	/*
+	 * dir.c sets a directory's size as it adds blocks, under i_rwsem
+	 * only, and i_size follows it afterwards
+	 */
+	if (!S_ISDIR(inode->i_mode)) {
+		t_inode->file_size = i_size_read(inode);
 	}
-
-	//WARN_ON(next_ino == 1);
-	printk(KERN_DEBUG "Allocating inode %d\n", i);
-	tomofs_sync_sb(sb);
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-
-release:
-	mutex_unlock(&tomofs_inode_tbl_lock);
-	mutex_unlock(&tomofs_sb_lock);
-	brelse(bh);
-	return next_ino;
+	t_inode->i_atime = inode->i_atime;
+	t_inode->i_mtime = inode->i_mtime;
+	t_inode->i_ctime = inode->i_ctime;
+	up_write(tomofs_inode_sem(t_inode));
 }
 
-/* called with inode_tbl lock held */
-/* Nobody assures that the inode being written to is not in use */
-static int tomofs_save_inode(struct super_block *sb,
-    struct tomofs_inode *t_inode)
+/* Copy @t_inode into its table slot */
+int tomofs_save_inode(struct super_block *sb, struct tomofs_inode *t_inode)
 {
-	struct tomofs_super_block *tsb;
 	struct buffer_head *bh;
 	struct tomofs_inode *inodes;
+	uint64_t slot = tomofs_ino_slot(sb, t_inode->i_ino);
+	u64 start = tomofs_stats_start();
 	int ret = -EIO;
 
-	tsb = (struct tomofs_super_block *)sb->s_fs_info;
-	printk("tsb->inodes: %x\n", tsb->inodes);
-	bh = __bread(sb->s_bdev, tsb->inodes >> sb->s_blocksize_bits,
-	    TOMOFS_BLK_SIZE);
-	BUG_ON(!bh);
+	bh = tomofs_inode_bread(sb, t_inode->i_ino);
+	if (!bh) {
+		goto out;
+	}
 
-	printk(KERN_DEBUG "Saving inode %d\n", t_inode->i_ino);
+	ret = tomofs_journal_get_write_access(bh);
+	if (ret) {
+		goto release;
+	}
 	inodes = (struct tomofs_inode *)bh->b_data;
-	printk(KERN_DEBUG "inode 0 magic before: 0x%x\n", inodes->i_ino);
-	//WARN_ON(inodes->i_ino != 0xdeadbeef);
-	printk(KERN_DEBUG "Overwriting %d\n", inodes[t_inode->i_ino].i_ino);
-	memcpy(&(inodes[t_inode->i_ino]), t_inode,
-	    sizeof(struct tomofs_inode));
-	printk(KERN_DEBUG "inode 0 magic after: 0x%x\n", inodes->i_ino);
+	down_read(tomofs_inode_sem(t_inode));
+	lock_buffer(bh);
+	memcpy(&(inodes[slot]), t_inode, sizeof(struct tomofs_inode));
+	unlock_buffer(bh);
+	up_read(tomofs_inode_sem(t_inode));
 
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	ret = 0;
+	ret = tomofs_journal_dirty(bh);
 
 release:
 	brelse(bh);
+out:
+	trace_tomofs_save_inode(sb, t_inode->i_ino, ret);
+	tomofs_stats_account(sb, TOMOFS_OP_SAVE_INODE, start, ret);
 	return ret;
 }
 
-/* called with sb, inode_tbl, and directory_registry locks held */
+/*
+ * Called with parent's i_rwsem held. @added is set once the entry is in
+ * the directory, which errors after that don't undo.
+ */
 static int tomofs_register_inode(struct inode *parent,
-    uint64_t ino, char *filename)
+    uint64_t ino, umode_t mode, const struct qstr *name, bool *added)
 {
-	/* TODO: Error handling */
-	struct super_block *sb;
+	struct super_block *sb = parent->i_sb;
 	struct tomofs_inode *t_parent;
-	struct buffer_head *bh;
-	struct tomofs_directory_record *record;
-
-#if 1
-	int i;
-	struct tomofs_directory_record *foo;
-#endif
-
-	sb = parent->i_sb;
-	t_parent = (struct tomofs_inode *)parent->i_private;
-
-	bh = __bread(sb->s_bdev,
-	    t_parent->inode_block_ptr >> sb->s_blocksize_bits,
-	    TOMOFS_BLK_SIZE);
-	BUG_ON(!bh);
-
-	record =
-	    &((struct tomofs_directory_record *)bh->b_data)[t_parent->child_count];
-#if 0
-	foo = (struct tomofs_directory_record *)bh->b_data;
-#endif
-
-	record->i_ino = ino;
-	strncpy(record->filename, filename, TOMOFS_MAX_FILENAME_LEN);
-
-	t_parent->child_count += 1;
-
-	printk("register_inode(): adding ino: %d, filename: %s\n", record->i_ino, record->filename);
+	uint64_t old_size;
+	int ret;
 
-	printk(KERN_DEBUG "register_inode(): Saving parent inode\n");
-	tomofs_save_inode(sb, t_parent);
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
+	t_parent = TOMOFS_T(parent);
+	old_size = t_parent->file_size;
+	*added = false;
+	ret = tomofs_dir_add(sb, t_parent, (const char *)name->name,
+	    name->len, ino, mode);
+	if (ret) {
+		return ret;
+	}
+	*added = true;
 
-#if 0
-	for (i = 0; i < t_parent->child_count; i++) {
-		printk("register_inode(): ino: %d, filename: %s\n", foo[i].i_ino, foo[i].filename);
+	parent->i_mtime = parent->i_ctime = current_time(parent);
+	mark_inode_dirty(parent);
+	if (t_parent->file_size == old_size) {
+		/* Times are written back later by tomofs_write_inode() */
+		return 0;
 	}
-#endif
 
-	brelse(bh);
-	return 0;
+	/* The new directory block hangs off the inode's extent tree */
+	i_size_write(parent, t_parent->file_size);
+	tomofs_update_inode(parent);
+	return tomofs_save_inode(sb, t_parent);
 }
 
 static int tomofs_create_inode(struct inode *parent, struct dentry *dentry,
@@ -281,326 +416,1705 @@ static int tomofs_create_inode(struct inode *parent, struct dentry *dentry,
 {
 	struct inode *inode;
 	struct tomofs_inode *t_inode = NULL;
-	struct tomofs_inode *t_parent;
 	struct super_block *sb;
+	handle_t *handle;
 	uint64_t next_ino = 0;
-	struct block_extent inode_block;
-
-	if (mutex_lock_interruptible(&tomofs_sb_lock)) {
-		printk(KERN_DEBUG "fail to aquire lock tomofs_create_inode()\n");
-		return -EINTR;
-	}
-
-	if (mutex_lock_interruptible(&tomofs_inode_tbl_lock)) {
-		printk(KERN_DEBUG "fail to aquire lock tomofs_create_inode()\n");
-		mutex_unlock(&tomofs_sb_lock);
-		return -EINTR;
-	}
+	uint64_t agno;
+	bool added;
+	int ret;
 
-	if (mutex_lock_interruptible(&tomofs_directory_record_lock)) {
-		printk(KERN_DEBUG "fail to aquire lock tomofs_create_inode()\n");
-		mutex_unlock(&tomofs_directory_record_lock);
-		mutex_unlock(&tomofs_sb_lock);
-		return -EINTR;
+	if (dentry->d_name.len > TOMOFS_MAX_FILENAME_LEN) {
+		return -ENAMETOOLONG;
 	}
 
 	sb = parent->i_sb;
-	next_ino = tomofs_allocate_next_inode(sb);
-	switch (next_ino) {
-	case -EINTR:
-		return -EINTR;
-		break;
-	case -ENOSPC:
-		return -ENOSPC;
-		break;
-	default:
-		break;
+	/* Spread directories over the groups, keep files near their parent */
+	if (S_ISDIR(mode)) {
+		agno = atomic_inc_return(&TOMOFS_SB(sb)->ag_rotor);
+	} else {
+		agno = tomofs_ino_ag(sb, parent->i_ino);
 	}
 
-	t_inode = kmem_cache_alloc(tomofs_inode_cachep, GFP_KERNEL);
-
-	if (!t_inode) {
-		return -ENOMEM;
+	/* The inode, its directory block and the parent's entry commit together */
+	handle = tomofs_journal_start(sb, TOMOFS_CREATE_CREDITS);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+	ret = tomofs_alloc_ino(sb, agno, &next_ino);
+	if (ret) {
+		goto out;
 	}
 
 	inode = new_inode(sb);
 
 	if (!inode) {
-		return -ENOMEM;
+		ret = -ENOMEM;
+		tomofs_free_ino(sb, next_ino);
+		goto out;
 	}
 
+	t_inode = TOMOFS_T(inode);
 	t_inode->i_ino = next_ino;
 	/* This is morally wrong */
-	t_inode->flags |= 1;
+	t_inode->flags |= TOMOFS_INODE_USED;
 
 	t_inode->i_atime = current_time(inode);
 	t_inode->i_ctime = current_time(inode);
 	t_inode->i_mtime = current_time(inode);
 
 	inode->i_sb = sb;
-	printk(KERN_ALERT "sb inode table of created inode: %x\n", ((struct tomofs_super_block *)sb->s_fs_info)->inodes);
 	inode->i_op = parent->i_op;
 
-	inode->i_private = t_inode;
 	inode->i_ino = t_inode->i_ino;
 	inode->i_atime = t_inode->i_atime;
 	inode->i_ctime = t_inode->i_ctime;
 	inode->i_mtime = t_inode->i_mtime;
 	t_inode->mode = mode;
 
+	tomofs_extent_init(t_inode);
 	if (S_ISDIR(t_inode->mode)) {
 		inode->i_fop = &tomofs_i_dir_op;
-		t_inode->child_count = 0;
+		ret = tomofs_dir_init(sb, t_inode);
+		if (ret) {
+			goto out_iput;
+		}
+		inode->i_size = t_inode->file_size;
 	} else if (S_ISREG(t_inode->mode)){
+		inode->i_op = &tomofs_i_file_iop;
 		inode->i_fop = &tomofs_i_file_op;
 		t_inode->file_size = 0;
+		inode->i_size = 0;
+		if (TOMOFS_SB(sb)->mount_opts & TOMOFS_MOUNT_COMPRESS) {
+			/* Never inline, the extent tree maps the clusters */
+			inode->i_mapping->a_ops = &tomofs_compress_aops;
+			t_inode->flags |= TOMOFS_INODE_COMPRESSED;
+		} else {
+			/* Files start out inline, see tomofs_convert_inline() */
+			inode->i_mapping->a_ops = &tomofs_aops;
+			memset(t_inode->inline_data, 0, TOMOFS_INLINE_DATA);
+			t_inode->flags |= TOMOFS_INODE_INLINE;
+		}
 	} else {
 		printk(KERN_ERR "Unknown inode type\n");
-		return -EINVAL;
+		ret = -EINVAL;
+		goto out_iput;
 	}
 
-	get_empty_block(sb, 1, &inode_block);
-	zero_block(sb, &inode_block);
-
-	t_inode->inode_block_ptr = inode_block.head;
-
-	printk(KERN_DEBUG "create_inode(): Saving new inode\n");
-	tomofs_save_inode(sb, t_inode);
-
-	t_parent = (struct tomofs_inode *)parent->i_private;
-	printk(KERN_DEBUG "t_parent->i_ino: %d\n", t_parent->i_ino);
-	tomofs_register_inode(parent, t_inode->i_ino, dentry->d_name.name);
+	ret = tomofs_save_inode(sb, t_inode);
+	if (ret) {
+		goto out_iput;
+	}
+	insert_inode_hash(inode);
+
+	ret = tomofs_register_inode(parent, t_inode->i_ino, mode,
+	    &dentry->d_name, &added);
+	if (ret && added) {
+		/* The entry points at the inode, which must stay allocated */
+		iput(inode);
+		goto out;
+	}
+	if (ret) {
+		goto out_iput;
+	}
 
 	inode_init_owner(inode, parent, mode);
-	d_add(dentry, inode);
-
-	mutex_unlock(&tomofs_directory_record_lock);
-	mutex_unlock(&tomofs_inode_tbl_lock);
-	mutex_unlock(&tomofs_sb_lock);
-	return 0;
+	/* @dentry may be a hashed negative dentry from an earlier lookup */
+	d_instantiate(dentry, inode);
+	goto out;
+
+out_iput:
+	/* Nothing else would ever free the inode number or its blocks */
+	if (S_ISDIR(mode) &&
+	    tomofs_extent_truncate(sb, t_inode, 0, UINT_MAX)) {
+		printk(KERN_ERR "tomofs: unable to free the blocks of inode "
+		    "%llu\n", next_ino);
+	}
+	tomofs_free_ino(sb, next_ino);
+	/* Don't leave it in the inode cache */
+	clear_nlink(inode);
+	iput(inode);
+out:
+	tomofs_journal_stop(handle);
+	trace_tomofs_create(parent, dentry->d_name.name, mode, next_ino, ret);
+	return ret;
 }
 
 static int tomofs_create(struct inode *parent, struct dentry *dentry,
     umode_t mode, bool excl)
 {
-	printk("create\n");
-	return tomofs_create_inode(parent, dentry, mode);
+	u64 start = tomofs_stats_start();
+	int ret;
+
+	ret = tomofs_create_inode(parent, dentry, mode);
+	tomofs_stats_account(parent->i_sb, TOMOFS_OP_CREATE, start, ret);
+	return ret;
 }
 
 static int tomofs_mkdir(struct inode *parent, struct dentry *dentry,
     umode_t mode)
 {
-	printk("mkdir\n");
-	return tomofs_create_inode(parent, dentry, S_IFDIR | mode);
+	u64 start = tomofs_stats_start();
+	int ret;
+
+	ret = tomofs_create_inode(parent, dentry, S_IFDIR | mode);
+	tomofs_stats_account(parent->i_sb, TOMOFS_OP_MKDIR, start, ret);
+	return ret;
 }
 
 static struct dentry *tomofs_lookup(struct inode *parent,
     struct dentry *child_dentry, unsigned int flags)
 {
-	struct tomofs_inode *t_parent =
-	    (struct tomofs_inode *)parent->i_private;
-	struct tomofs_inode *t_child;
+	struct tomofs_inode *t_parent = TOMOFS_T(parent);
 	struct super_block *sb = parent->i_sb;
-	struct buffer_head *bh;
-	struct tomofs_directory_record *record;
+	struct dentry *ret_dentry = NULL;
 	struct inode *inode;
-	int i;
+	uint64_t ino = 0;
+	u64 start = tomofs_stats_start();
+	int ret;
 
-	if (mutex_lock_interruptible(&tomofs_directory_record_lock)) {
-		printk(KERN_DEBUG "fail to aquire lock tomofs_lookup()\n");
-		return NULL;
+	/* parent's i_rwsem is held at least shared */
+	ret = tomofs_dir_lookup(sb, t_parent,
+	    (const char *)child_dentry->d_name.name,
+	    child_dentry->d_name.len, &ino);
+	if (ret == -ENOENT) {
+		/* Cache the miss as a negative dentry, create instantiates it */
+		d_add(child_dentry, NULL);
+		goto out;
 	}
-
-	bh = __bread(sb->s_bdev,
-	    t_parent->inode_block_ptr >> sb->s_blocksize_bits,
-	    TOMOFS_BLK_SIZE);
-	BUG_ON(!bh);
-
-	record = (struct tomofs_directory_record *)bh->b_data;
-	for (i = 0; i < t_parent->child_count; i++, record++) {
-		if (!strcmp(record->filename,
-		    child_dentry->d_name.name)) {
-			inode = new_inode(sb);
-			t_child = tomofs_get_inode(sb, record->i_ino);
-			inode->i_ino = t_child->i_ino;
-			inode->i_sb = sb;
-			inode->i_op = &tomofs_i_op;
-			if (S_ISDIR(t_child->mode)) {
-				inode->i_fop = &tomofs_i_dir_op;
-			} else if (S_ISREG(t_child->mode)) {
-				inode->i_fop = &tomofs_i_file_op;
-				t_child->file_size = 0;
-			} else {
-				printk(KERN_ERR "Unknown inode type\n");
-			}
-			/* TODO: Update atime */
-			inode->i_atime = t_child->i_atime;
-			inode->i_ctime = t_child->i_ctime;
-			inode->i_mtime = t_child->i_mtime;
-			inode->i_private = t_child;
-			atomic_inc(&(inode->i_count));
-			inode_init_owner(inode, parent, t_child->mode);
-			d_add(child_dentry, inode);
-			mutex_unlock(&tomofs_directory_record_lock);
-			return NULL;
-		}
+	if (ret) {
+		ret_dentry = ERR_PTR(ret);
+		goto out;
 	}
 
-	mutex_unlock(&tomofs_directory_record_lock);
-	return NULL;
+	inode = tomofs_iget(sb, ino);
+	ret_dentry = d_splice_alias(inode, child_dentry);
+	ret = PTR_ERR_OR_ZERO(ret_dentry);
+
+out:
+	trace_tomofs_lookup(parent, child_dentry->d_name.name, ino, ret);
+	/* Misses are the point of negative dentries, not errors */
+	tomofs_stats_account(sb, TOMOFS_OP_LOOKUP, start,
+	    ret == -ENOENT ? 0 : ret);
+	return ret_dentry;
 }
 
-ssize_t tomofs_read(struct file *f, char __user *buf, size_t len,
-    loff_t *offset)
+/* Point @bh at no block until writeback allocates one for it */
+static void tomofs_set_delayed(struct inode *inode, struct buffer_head *bh)
 {
-	ssize_t read;
-	return read;
+	atomic_inc(&TOMOFS_I(inode)->delalloc);
+	map_bh(bh, inode->i_sb, TOMOFS_DELALLOC_BLOCK);
+	set_buffer_delay(bh);
 }
 
-ssize_t tomofs_write(struct file *f, const char __user *buf, size_t len,
-    loff_t *offset)
+/* Drop the reservations of @count delayed blocks of @inode */
+static void tomofs_release_delayed(struct inode *inode, int count)
 {
-	ssize_t wrote;
-	return wrote;
+	atomic_sub(count, &TOMOFS_I(inode)->delalloc);
+	tomofs_release_reserved(inode->i_sb, count);
 }
 
-static int tomofs_iterate(struct file *fp, struct dir_context *ctx)
+/*
+ * Count the delayed blocks following @iblock in the page cache, so that a
+ * run of them can be allocated as one extent. The page holding @iblock is
+ * locked by writeback; others are only peeked at if their lock is free.
+ */
+static uint64_t tomofs_delalloc_run(struct inode *inode, sector_t iblock,
+    uint64_t max)
 {
-	loff_t pos;
-	struct inode *inode;
-	struct super_block *sb;
+	unsigned int bits = PAGE_SHIFT - inode->i_blkbits;
+	pgoff_t own = iblock >> bits;
+	sector_t lblk = iblock + 1;
 	struct buffer_head *bh;
-	struct tomofs_inode *t_inode;
-	struct tomofs_directory_record *records;
-	struct tomofs_directory_record *rd;
-
-	printk("iterate\n");
-	pos = ctx->pos;
-#if 0
-	if (pos > 0) {
-		printk(KERN_DEBUG "iterate(): exiting ... 0x%x\n", pos);
-		return 0;
+	struct page *page;
+	uint64_t len = 1;
+	bool more = true;
+	unsigned int i;
+
+	while (more && len < max) {
+		page = find_get_page(inode->i_mapping, lblk >> bits);
+		if (!page) {
+			break;
+		}
+		if (page->index != own && !trylock_page(page)) {
+			put_page(page);
+			break;
+		}
+		more = false;
+		if (page->mapping == inode->i_mapping && page_has_buffers(page)) {
+			bh = page_buffers(page);
+			for (i = 0; i < (lblk & ((1 << bits) - 1)); i++) {
+				bh = bh->b_this_page;
+			}
+			do {
+				/* Not blocks being copied on write */
+				more = buffer_delay(bh) &&
+				    bh->b_blocknr == TOMOFS_DELALLOC_BLOCK &&
+				    len < max;
+				if (!more) {
+					break;
+				}
+				len++;
+				lblk++;
+				bh = bh->b_this_page;
+			} while (lblk & ((1 << bits) - 1));
+		}
+		if (page->index != own) {
+			unlock_page(page);
+		}
+		put_page(page);
 	}
-#endif
-	printk(KERN_DEBUG "0x%x\n", pos);
-	inode = file_inode(fp);
-	sb = inode->i_sb;
-	t_inode = (struct tomofs_inode *)inode->i_private;
+	return len;
+}
 
-	if (unlikely(!S_ISDIR(t_inode->mode))) {
-		return -ENOTDIR;
+/*
+ * Map up to @len blocks of the hole at @iblock onto a new extent @e. Settles
+ * for fewer if free space is fragmented.
+ */
+static int tomofs_alloc_extent(struct inode *inode, sector_t iblock,
+    uint64_t len, struct block_extent *e)
+{
+	struct super_block *sb = inode->i_sb;
+	struct tomofs_inode *t_inode = TOMOFS_T(inode);
+	handle_t *handle;
+	int ret;
+
+	handle = tomofs_journal_start(sb, TOMOFS_WRITE_CREDITS);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+	while (!get_empty_block(sb, tomofs_ino_ag(sb, inode->i_ino), len, e)) {
+		if (len == 1) {
+			ret = -ENOSPC;
+			goto out;
+		}
+		len = len / 2;
+	}
+	ret = tomofs_extent_insert(sb, t_inode, iblock, e);
+	if (ret) {
+		put_empty_block(sb, e);
+		goto out;
 	}
 
-	bh = __bread(sb->s_bdev,
-	    t_inode->inode_block_ptr >> sb->s_blocksize_bits,
-	    TOMOFS_BLK_SIZE);
-	BUG_ON(!bh);
+	ret = tomofs_save_inode(sb, t_inode);
+	if (ret) {
+		goto out;
+	}
+	/* Freed metadata blocks may still be cached through the device */
+	clean_bdev_aliases(sb->s_bdev, e->head >> sb->s_blocksize_bits,
+	    e->count);
 
-	records = (struct tomofs_directory_record *)bh->b_data;
-	rd = (struct tomofs_directory_record *)(bh->b_data + pos);
-	for (; rd < (records + t_inode->child_count); rd++) {
-		if (!dir_emit(ctx, rd->filename, TOMOFS_MAX_FILENAME_LEN,
-		    rd->i_ino, DT_UNKNOWN)) {
-			goto release;
-		}
-		printk(KERN_DEBUG "before increment: 0x%x", ctx->pos);
-		ctx->pos += sizeof(struct tomofs_directory_record);
-		printk(KERN_DEBUG "after increment: 0x%x", ctx->pos);
+out:
+	tomofs_journal_stop(handle);
+	return ret;
+}
+
+/*
+ * Allocate disk blocks for @iblock at writeback. A delayed block takes the
+ * delayed blocks after it along, as one extent if there is room.
+ */
+static int tomofs_alloc_blocks(struct inode *inode, sector_t iblock,
+    struct buffer_head *bh_result)
+{
+	struct super_block *sb = inode->i_sb;
+	bool delayed = buffer_delay(bh_result);
+	struct block_extent e;
+	uint64_t len = 1;
+	int ret;
+
+	if (delayed) {
+		len = tomofs_delalloc_run(inode, iblock,
+		    min_t(uint64_t, TOMOFS_ALLOC_MAX_BLKS,
+		    TOMOFS_MAX_FILE_BLKS - iblock));
+	}
+
+	ret = tomofs_alloc_extent(inode, iblock, len, &e);
+	if (ret) {
+		return ret;
 	}
-release:
-	brelse(bh);
 
+	/*
+	 * The rest of the run keeps its delayed buffers and reservations
+	 * until writeback maps them, see tomofs_get_block()
+	 */
+	if (delayed) {
+		tomofs_release_delayed(inode, 1);
+	}
+	map_bh(bh_result, sb, e.head >> sb->s_blocksize_bits);
+	bh_result->b_size = sb->s_blocksize;
 	return 0;
 }
 
-int tomofs_fill_super(struct super_block *sb, void *data, int silent)
+/*
+ * Write the data of page buffer @src to block @blk and wait for it, so that
+ * a handle pointing the file at @blk can't commit before it is on disk
+ */
+static int tomofs_write_copy(struct super_block *sb, struct buffer_head *src,
+    sector_t blk)
 {
-	struct inode *root_inode;
 	struct buffer_head *bh;
-	struct tomofs_super_block *tsb;
-	struct tomofs_inode *t_root;
-	int ret = -EPERM;
+	void *kaddr;
+	int ret = 0;
 
-	bh = sb_bread(sb, TOMOFS_SB_BLK_NO);
-	/* PANIC on failure to read super block */
-	BUG_ON(!bh);
+	bh = sb_getblk(sb, blk);
+	if (!bh) {
+		return -ENOMEM;
+	}
+	lock_buffer(bh);
+	kaddr = kmap_atomic(src->b_page);
+	memcpy(bh->b_data, kaddr + bh_offset(src), sb->s_blocksize);
+	kunmap_atomic(kaddr);
+	set_buffer_uptodate(bh);
+	get_bh(bh);
+	bh->b_end_io = end_buffer_write_sync;
+	submit_bh(REQ_OP_WRITE, 0, bh);
+	wait_on_buffer(bh);
+	if (!buffer_uptodate(bh)) {
+		ret = -EIO;
+	}
+	brelse(bh);
+	return ret;
+}
 
-	tsb = kmalloc(sizeof(struct tomofs_super_block), GFP_KERNEL);
-	memcpy((char *)tsb, bh->b_data, sizeof(struct tomofs_super_block));
-	if (unlikely(tsb->magic != TOMOFS_SB_MAGIC)) {
-		printk(KERN_ERR "tomofs: NOT TOMOFS!\n");
-		goto release;
+/*
+ * Give file block @iblock, whose disk block is shared with another file,
+ * a block of its own. The copy of the buffer is written before the block
+ * is remapped, and writeback then writes the buffer over it again.
+ */
+static int tomofs_cow_block(struct inode *inode, sector_t iblock,
+    struct buffer_head *bh_result)
+{
+	struct super_block *sb = inode->i_sb;
+	struct tomofs_inode *t_inode = TOMOFS_T(inode);
+	struct tomofs_extent new = {
+		.lblk = iblock,
+	};
+	struct block_extent *e = &new.ext;
+	struct block_extent old;
+	handle_t *handle;
+	int ret;
+
+	handle = tomofs_journal_start(sb, TOMOFS_COW_CREDITS);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+	if (!get_empty_block(sb, tomofs_ino_ag(sb, inode->i_ino), 1, e)) {
+		ret = -ENOSPC;
+		goto out;
+	}
+	ret = tomofs_write_copy(sb, bh_result,
+	    e->head >> sb->s_blocksize_bits);
+	if (ret) {
+		put_empty_block(sb, e);
+		goto out;
 	}
+	ret = tomofs_extent_remap(sb, t_inode, &new, 1, &old);
+	if (ret) {
+		put_empty_block(sb, e);
+		goto out;
+	}
+	/* The other owners keep the old block */
+	put_empty_block(sb, &old);
 
-	sb->s_magic = TOMOFS_SB_MAGIC;
-	sb->s_fs_info = tsb;
-	/* max file size */
-	sb->s_maxbytes = TOMOFS_MAXBYTES;
-	sb->s_op = &tomofs_sops;
-	t_root = tomofs_get_inode(sb, TOMOFS_ROOTDIR_INODE_NO);
+	ret = tomofs_save_inode(sb, t_inode);
+	if (ret) {
+		goto out;
+	}
+	/* Drop the copy's alias, writeback goes through the page */
+	clean_bdev_aliases(sb->s_bdev, e->head >> sb->s_blocksize_bits, 1);
+	map_bh(bh_result, sb, e->head >> sb->s_blocksize_bits);
+	bh_result->b_size = sb->s_blocksize;
 
-	/* rootdir inode should have been created at mkfs time */
-	BUG_ON(!t_root);
-	root_inode = new_inode(sb);
-	root_inode->i_ino = t_root->i_ino;
-	inode_init_owner(root_inode, NULL, S_IFDIR);
-	/* Nasty hack */
-	t_root->mode = root_inode->i_mode;
-	root_inode->i_sb = sb;
-	root_inode->i_op = &tomofs_i_op;
-	root_inode->i_fop = &tomofs_i_dir_op;
-	if (t_root->i_atime.tv_sec == 0) {
-		root_inode->i_atime = t_root->i_atime;
-	} else {
-		root_inode->i_atime = current_time(root_inode);
-		t_root->i_atime = root_inode->i_atime;
+out:
+	tomofs_journal_stop(handle);
+	return ret;
+}
+
+/*
+ * Map file block @iblock of @inode to its on-disk block through the extent
+ * tree. @create is only set by writeback: a delayed block gets its disk
+ * block then, along with the delayed blocks after it, and a shared block
+ * gets a copy of its own. write_begin only reserves holes, see
+ * tomofs_da_get_block().
+ * Mapped runs are reported up to bh_result->b_size so that readahead and
+ * writeback can build multi-block bios.
+ */
+static int tomofs_get_block(struct inode *inode, sector_t iblock,
+    struct buffer_head *bh_result, int create)
+{
+	struct super_block *sb = inode->i_sb;
+	struct tomofs_inode *t_inode = TOMOFS_T(inode);
+	uint64_t max_blocks = bh_result->b_size >> sb->s_blocksize_bits;
+	uintptr_t addr;
+	uint64_t count;
+	int ret;
+
+	if (WARN_ON_ONCE(tomofs_has_inline(t_inode))) {
+		return -EIO;
+	}
+	if (iblock >= TOMOFS_MAX_FILE_BLKS) {
+		return create ? -EFBIG : 0;
 	}
 
-	if (t_root->i_ctime.tv_sec == 0) {
-		root_inode->i_ctime = t_root->i_ctime;
-	} else {
-		root_inode->i_ctime = current_time(root_inode);
-		t_root->i_ctime = root_inode->i_ctime;
+	ret = tomofs_extent_map(sb, t_inode, iblock, &addr, &count);
+	if (!ret && create && tomofs_is_shared(t_inode)) {
+		/* Never write over a block another file still maps */
+		ret = tomofs_block_shared(sb, addr >> sb->s_blocksize_bits);
+		if (ret < 0) {
+			return ret;
+		}
+		if (ret) {
+			ret = tomofs_cow_block(inode, iblock, bh_result);
+			if (!ret && buffer_delay(bh_result)) {
+				tomofs_release_delayed(inode, 1);
+			}
+			return ret;
+		}
+	}
+	if (!ret) {
+		/*
+		 * Allocated along with an earlier block of its run, or no
+		 * longer shared by the time it got written
+		 */
+		if (create && buffer_delay(bh_result)) {
+			tomofs_release_delayed(inode, 1);
+		}
+		map_bh(bh_result, sb, addr >> sb->s_blocksize_bits);
+		bh_result->b_size =
+		    min(count, max_blocks) << sb->s_blocksize_bits;
+		return 0;
+	}
+	if (ret != -ENOENT) {
+		return ret;
+	}
+	if (!create) {
+		return 0;
 	}
+	return tomofs_alloc_blocks(inode, iblock, bh_result);
+}
 
-	if (t_root->i_mtime.tv_sec == 0) {
-		root_inode->i_mtime = t_root->i_mtime;
-	} else {
-		root_inode->i_mtime = current_time(root_inode);
-		t_root->i_mtime = root_inode->i_mtime;
+/*
+ * get_block for write_begin. Holes only get a reservation and a delayed
+ * buffer pointing nowhere; the disk block is picked at writeback.
+ */
+static int tomofs_da_get_block(struct inode *inode, sector_t iblock,
+    struct buffer_head *bh_result, int create)
+{
+	struct super_block *sb = inode->i_sb;
+	int ret;
+
+	ret = tomofs_get_block(inode, iblock, bh_result, 0);
+	if (ret || buffer_mapped(bh_result) || !create) {
+		return ret;
 	}
-	root_inode->i_private = t_root;
-	/* make dentry for rootdir from inode */
-	sb->s_root = d_make_root(root_inode);
-	if (!sb->s_root) {
-		ret = -ENOMEM;
-		goto release;
+	if (iblock >= TOMOFS_MAX_FILE_BLKS) {
+		return -EFBIG;
 	}
-	ret = 0;
 
-release:
-	brelse(bh);
-	return ret;
+	ret = tomofs_reserve_blocks(sb, 1);
+	if (ret) {
+		return ret;
+	}
+	tomofs_set_delayed(inode, bh_result);
+	set_buffer_new(bh_result);
+	return 0;
 }
 
-static struct dentry *tomofs_mount(struct file_system_type *fs_type,
-    int flags, const char *dev_name, void *data)
+/* Fill @page from the inline data, zeroing everything past it */
+static void tomofs_read_inline_page(struct inode *inode, struct page *page)
 {
-	struct dentry *root_dentry;
-	root_dentry = mount_bdev(fs_type, flags, dev_name, data, tomofs_fill_super);
-	if (unlikely(IS_ERR(root_dentry))) {
-		printk("Error mounting tomofs\n");
-	} else {
-		printk("mounted tomofs\n");
+	struct tomofs_inode *t_inode = TOMOFS_T(inode);
+	size_t size = 0;
+	void *kaddr;
+
+	kaddr = kmap(page);
+	down_read(tomofs_inode_sem(t_inode));
+	if (page->index == 0) {
+		size = min_t(loff_t, i_size_read(inode), TOMOFS_INLINE_DATA);
+		memcpy(kaddr, t_inode->inline_data, size);
 	}
+	up_read(tomofs_inode_sem(t_inode));
+	memset(kaddr + size, 0, PAGE_SIZE - size);
+	kunmap(page);
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+}
 
-	return root_dentry;
+/* Copy [pos, pos + len) of page 0 into the inline data */
+static void tomofs_write_inline_page(struct inode *inode, struct page *page,
+    loff_t pos, size_t len)
+{
+	struct tomofs_inode *t_inode = TOMOFS_T(inode);
+	void *kaddr;
+
+	kaddr = kmap(page);
+	down_write(tomofs_inode_sem(t_inode));
+	memcpy(t_inode->inline_data + pos, kaddr + pos, len);
+	up_write(tomofs_inode_sem(t_inode));
+	kunmap(page);
 }
 
-static void tomofs_kill_superblock(struct super_block *sb)
+/*
+ * Move an inline file's contents to a delayed block 0, leaving it with an
+ * empty extent tree. Called with i_rwsem held.
+ */
+static int tomofs_convert_inline(struct inode *inode)
 {
+	struct super_block *sb = inode->i_sb;
+	struct tomofs_inode *t_inode = TOMOFS_T(inode);
+	struct buffer_head *bh;
+	struct page *page;
+	loff_t size = i_size_read(inode);
+	int ret;
+
+	page = find_or_create_page(inode->i_mapping, 0,
+	    mapping_gfp_mask(inode->i_mapping) & ~__GFP_FS);
+	if (!page) {
+		return -ENOMEM;
+	}
+	if (size) {
+		ret = tomofs_reserve_blocks(sb, 1);
+		if (ret) {
+			goto out;
+		}
+	}
+	if (!PageUptodate(page)) {
+		tomofs_read_inline_page(inode, page);
+	}
+
+	down_write(tomofs_inode_sem(t_inode));
+	t_inode->flags &= ~TOMOFS_INODE_INLINE;
+	memset(t_inode->inline_data, 0, TOMOFS_INLINE_DATA);
+	tomofs_extent_init(t_inode);
+	up_write(tomofs_inode_sem(t_inode));
+	ret = 0;
+
+	if (size) {
+		/* The page cache now holds the only copy */
+		if (!page_has_buffers(page)) {
+			create_empty_buffers(page, sb->s_blocksize, 0);
+		}
+		bh = page_buffers(page);
+		tomofs_set_delayed(inode, bh);
+		set_buffer_uptodate(bh);
+		mark_buffer_dirty(bh);
+	}
+	mark_inode_dirty(inode);
+
+out:
+	unlock_page(page);
+	put_page(page);
+	return ret;
+}
+
+/* Length in blocks of the hole at @lblk, looking no further than @max */
+static uint64_t tomofs_hole_len(struct super_block *sb,
+    struct tomofs_inode *t_inode, uint64_t lblk, uint64_t max)
+{
+	uint64_t next;
+	int ret;
+
+	ret = tomofs_extent_next(sb, t_inode, lblk, &next);
+	if (ret == -ENOENT) {
+		return max;
+	}
+	if (ret) {
+		/* Too short is safe, the caller maps the rest later */
+		return 1;
+	}
+	return min(next - lblk, max);
+}
+
+/*
+ * Map [pos, pos + length) for direct I/O. Writes into holes allocate the
+ * blocks up front; iomap zeroes whatever part of them isn't written.
+ */
+static int tomofs_iomap_begin(struct inode *inode, loff_t pos,
+    loff_t length, unsigned flags, struct iomap *iomap)
+{
+	struct super_block *sb = inode->i_sb;
+	struct tomofs_inode *t_inode = TOMOFS_T(inode);
+	unsigned int bits = sb->s_blocksize_bits;
+	uint64_t lblk = pos >> bits;
+	uint64_t max = ((pos + length - 1) >> bits) - lblk + 1;
+	struct block_extent e;
+	uintptr_t addr;
+	uint64_t count;
+	int ret;
+
+	if (lblk >= TOMOFS_MAX_FILE_BLKS) {
+		return -EFBIG;
+	}
+	max = min_t(uint64_t, max, TOMOFS_MAX_FILE_BLKS - lblk);
+
+	iomap->bdev = sb->s_bdev;
+	iomap->offset = (loff_t)lblk << bits;
+	iomap->flags = 0;
+
+	ret = tomofs_extent_map(sb, t_inode, lblk, &addr, &count);
+	if (ret == -ENOENT) {
+		count = tomofs_hole_len(sb, t_inode, lblk,
+		    min_t(uint64_t, max, TOMOFS_ALLOC_MAX_BLKS));
+		if (!(flags & IOMAP_WRITE)) {
+			iomap->type = IOMAP_HOLE;
+			iomap->blkno = IOMAP_NULL_BLOCK;
+			iomap->length = count << bits;
+			return 0;
+		}
+		ret = tomofs_alloc_extent(inode, lblk, count, &e);
+		if (ret) {
+			return ret;
+		}
+		addr = e.head;
+		count = e.count;
+		iomap->flags |= IOMAP_F_NEW;
+	} else if (ret) {
+		return ret;
+	}
+
+	iomap->type = IOMAP_MAPPED;
+	iomap->blkno = addr >> 9;
+	iomap->length = min(count, max) << bits;
+	return 0;
+}
+
+static const struct iomap_ops tomofs_iomap_ops = {
+	.iomap_begin = tomofs_iomap_begin,
+};
+
+/* Extend i_size once a direct write past EOF has completed */
+static int tomofs_dio_write_end_io(struct kiocb *iocb, ssize_t size,
+    unsigned flags)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct tomofs_inode *t_inode = TOMOFS_T(inode);
+
+	if (size <= 0) {
+		return size;
+	}
+	/* AIO completions run from a workqueue without i_rwsem */
+	down_write(tomofs_inode_sem(t_inode));
+	if (iocb->ki_pos + size > i_size_read(inode)) {
+		i_size_write(inode, iocb->ki_pos + size);
+	}
+	up_write(tomofs_inode_sem(t_inode));
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+static ssize_t tomofs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (!(iocb->ki_flags & IOCB_DIRECT)) {
+		return generic_file_read_iter(iocb, to);
+	}
+	if (!iov_iter_count(to)) {
+		return 0;
+	}
+
+	inode_lock_shared(inode);
+	if (tomofs_has_inline(TOMOFS_T(inode)) ||
+	    tomofs_is_compressed(TOMOFS_T(inode))) {
+		/* Nothing to DMA from, the data is in the inode or compressed */
+		inode_unlock_shared(inode);
+		iocb->ki_flags &= ~IOCB_DIRECT;
+		return generic_file_read_iter(iocb, to);
+	}
+	ret = iomap_dio_rw(iocb, to, &tomofs_iomap_ops, NULL);
+	inode_unlock_shared(inode);
+
+	file_accessed(iocb->ki_filp);
+	return ret;
+}
+
+static ssize_t tomofs_file_write_iter(struct kiocb *iocb,
+    struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+	int err;
+
+	if (!(iocb->ki_flags & IOCB_DIRECT)) {
+		return generic_file_write_iter(iocb, from);
+	}
+
+	inode_lock(inode);
+	if (tomofs_is_shared(TOMOFS_T(inode)) ||
+	    tomofs_is_compressed(TOMOFS_T(inode))) {
+		/*
+		 * Shared blocks are copied and clusters compressed at
+		 * writeback, so write through it
+		 */
+		inode_unlock(inode);
+		iocb->ki_flags &= ~IOCB_DIRECT;
+		ret = generic_file_write_iter(iocb, from);
+		if (ret > 0) {
+			err = filemap_write_and_wait_range(inode->i_mapping,
+			    iocb->ki_pos - ret, iocb->ki_pos - 1);
+			if (err) {
+				ret = err;
+			}
+		}
+		return ret;
+	}
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0) {
+		goto out;
+	}
+	ret = file_remove_privs(iocb->ki_filp);
+	if (ret) {
+		goto out;
+	}
+	ret = file_update_time(iocb->ki_filp);
+	if (ret) {
+		goto out;
+	}
+	if (tomofs_has_inline(TOMOFS_T(inode))) {
+		/* iomap_dio_rw() writes the converted page back first */
+		ret = tomofs_convert_inline(inode);
+		if (ret) {
+			goto out;
+		}
+	}
+	ret = iomap_dio_rw(iocb, from, &tomofs_iomap_ops,
+	    tomofs_dio_write_end_io);
+
+out:
+	inode_unlock(inode);
+	if (ret > 0) {
+		ret = generic_write_sync(iocb, ret);
+	}
+	return ret;
+}
+
+/* Only for open(O_DIRECT); direct I/O itself goes through iomap */
+static ssize_t tomofs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+{
+	return -EINVAL;
+}
+
+static int tomofs_readpage(struct file *file, struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+
+	if (tomofs_has_inline(TOMOFS_T(inode))) {
+		tomofs_read_inline_page(inode, page);
+		unlock_page(page);
+		return 0;
+	}
+	return mpage_readpage(page, tomofs_get_block);
+}
+
+static int tomofs_readpages(struct file *file, struct address_space *mapping,
+    struct list_head *pages, unsigned nr_pages)
+{
+	/* Readahead is pointless, readpage() gets the whole file */
+	if (tomofs_has_inline(TOMOFS_T(mapping->host))) {
+		return 0;
+	}
+	return mpage_readpages(mapping, pages, nr_pages, tomofs_get_block);
+}
+
+/*
+ * Unmap the dirty buffers of @page that still point at shared blocks, as
+ * mmap writes leave them, so that block_write_full_page() asks
+ * tomofs_get_block() for blocks of their own. An error reading the
+ * refcount map is left for tomofs_get_block() to report.
+ */
+static void tomofs_unmap_shared(struct inode *inode, struct page *page)
+{
+	struct buffer_head *head;
+	struct buffer_head *bh;
+
+	if (!page_has_buffers(page)) {
+		return;
+	}
+	head = bh = page_buffers(page);
+	do {
+		if (buffer_dirty(bh) && buffer_mapped(bh) &&
+		    !buffer_delay(bh) &&
+		    tomofs_block_shared(inode->i_sb, bh->b_blocknr)) {
+			clear_buffer_mapped(bh);
+		}
+		bh = bh->b_this_page;
+	} while (bh != head);
+}
+
+static int tomofs_writepage(struct page *page, struct writeback_control *wbc)
+{
+	struct inode *inode = page->mapping->host;
+	loff_t size;
+
+	if (!tomofs_has_inline(TOMOFS_T(inode))) {
+		if (tomofs_is_shared(TOMOFS_T(inode))) {
+			tomofs_unmap_shared(inode, page);
+		}
+		return block_write_full_page(page, tomofs_get_block, wbc);
+	}
+
+	/* Only mmap leaves inline pages dirty, write_end copies right away */
+	size = i_size_read(inode);
+	if (page->index == 0 && size) {
+		tomofs_write_inline_page(inode, page, 0,
+		    min_t(loff_t, size, TOMOFS_INLINE_DATA));
+		mark_inode_dirty(inode);
+	}
+	set_page_writeback(page);
+	unlock_page(page);
+	end_page_writeback(page);
+	return 0;
+}
+
+static int tomofs_writepages(struct address_space *mapping,
+    struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+
+	/*
+	 * mpage would submit delayed buffers to TOMOFS_DELALLOC_BLOCK, and
+	 * write over shared blocks without asking tomofs_get_block()
+	 */
+	if (atomic_read(&TOMOFS_I(inode)->delalloc) ||
+	    tomofs_has_inline(TOMOFS_T(inode)) ||
+	    tomofs_is_shared(TOMOFS_T(inode))) {
+		return generic_writepages(mapping, wbc);
+	}
+	return mpage_writepages(mapping, wbc, tomofs_get_block);
+}
+
+/*
+ * Reserve a block for each shared block [pos, pos + len) of @page is about
+ * to overwrite, so that copying it at writeback can't run out of space.
+ * The buffers are marked delayed but keep pointing at the shared block,
+ * which partial writes still read from.
+ */
+static int tomofs_reserve_cow(struct inode *inode, struct page *page,
+    loff_t pos, unsigned len)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *head;
+	struct buffer_head *bh;
+	unsigned int from = pos & (PAGE_SIZE - 1);
+	unsigned int to = from + len;
+	unsigned int start = 0;
+	int shared;
+	int ret;
+
+	head = bh = page_buffers(page);
+	do {
+		if (start < to && start + bh->b_size > from &&
+		    buffer_mapped(bh) && !buffer_delay(bh)) {
+			shared = tomofs_block_shared(sb, bh->b_blocknr);
+			if (shared < 0) {
+				return shared;
+			}
+			if (shared) {
+				ret = tomofs_reserve_blocks(sb, 1);
+				if (ret) {
+					return ret;
+				}
+				atomic_inc(&TOMOFS_I(inode)->delalloc);
+				set_buffer_delay(bh);
+			}
+		}
+		start += bh->b_size;
+		bh = bh->b_this_page;
+	} while (bh != head);
+	return 0;
+}
+
+static int tomofs_write_begin(struct file *file, struct address_space *mapping,
+    loff_t pos, unsigned len, unsigned flags, struct page **pagep,
+    void **fsdata)
+{
+	struct inode *inode = mapping->host;
+	struct page *page;
+	int ret;
+
+	if (tomofs_has_inline(TOMOFS_T(inode))) {
+		if (pos + len > TOMOFS_INLINE_DATA) {
+			ret = tomofs_convert_inline(inode);
+			if (ret) {
+				return ret;
+			}
+		} else {
+			page = grab_cache_page_write_begin(mapping, 0, flags);
+			if (!page) {
+				return -ENOMEM;
+			}
+			if (!PageUptodate(page)) {
+				tomofs_read_inline_page(inode, page);
+			}
+			*pagep = page;
+			return 0;
+		}
+	}
+	ret = block_write_begin(mapping, pos, len, flags, pagep,
+	    tomofs_da_get_block);
+	if (ret || !tomofs_is_shared(TOMOFS_T(inode))) {
+		return ret;
+	}
+	ret = tomofs_reserve_cow(inode, *pagep, pos, len);
+	if (ret) {
+		unlock_page(*pagep);
+		put_page(*pagep);
+	}
+	return ret;
+}
+
+static int tomofs_write_end(struct file *file, struct address_space *mapping,
+    loff_t pos, unsigned len, unsigned copied, struct page *page,
+    void *fsdata)
+{
+	struct inode *inode = mapping->host;
+
+	if (!tomofs_has_inline(TOMOFS_T(inode))) {
+		/* Marks the inode dirty when i_size grows */
+		return generic_write_end(file, mapping, pos, len, copied,
+		    page, fsdata);
+	}
+
+	/* The page was uptodate, so a short copy is still good */
+	flush_dcache_page(page);
+	tomofs_write_inline_page(inode, page, pos, copied);
+	if (pos + copied > inode->i_size) {
+		i_size_write(inode, pos + copied);
+	}
+	unlock_page(page);
+	put_page(page);
+	mark_inode_dirty(inode);
+	return copied;
+}
+
+/* Give back the reservations of delayed buffers being dropped */
+static void tomofs_invalidatepage(struct page *page, unsigned int offset,
+    unsigned int length)
+{
+	struct inode *inode = page->mapping->host;
+	struct buffer_head *head;
+	struct buffer_head *bh;
+	unsigned int start = 0;
+	unsigned int stop = offset + length;
+	int released = 0;
+
+	if (page_has_buffers(page)) {
+		head = bh = page_buffers(page);
+		do {
+			if (start + bh->b_size > stop) {
+				break;
+			}
+			/* The same buffers block_invalidatepage() discards */
+			if (start >= offset && buffer_delay(bh)) {
+				released++;
+			}
+			start += bh->b_size;
+			bh = bh->b_this_page;
+		} while (bh != head);
+	}
+	if (released) {
+		tomofs_release_delayed(inode, released);
+	}
+	block_invalidatepage(page, offset, length);
+}
+
+static sector_t tomofs_bmap(struct address_space *mapping, sector_t block)
+{
+	if (tomofs_has_inline(TOMOFS_T(mapping->host))) {
+		return 0;
+	}
+	/* Delayed blocks have no address until they are written */
+	if (atomic_read(&TOMOFS_I(mapping->host)->delalloc)) {
+		filemap_write_and_wait(mapping);
+	}
+	return generic_block_bmap(mapping, block, tomofs_get_block);
+}
+
+static const struct address_space_operations tomofs_aops = {
+	.readpage = tomofs_readpage,
+	.readpages = tomofs_readpages,
+	.writepage = tomofs_writepage,
+	.writepages = tomofs_writepages,
+	.write_begin = tomofs_write_begin,
+	.write_end = tomofs_write_end,
+	.invalidatepage = tomofs_invalidatepage,
+	.direct_IO = tomofs_direct_IO,
+	.bmap = tomofs_bmap,
+};
+
+/* Resize an inline file that stays inline. Nothing to free */
+static int tomofs_setattr_inline(struct inode *inode, struct iattr *attr)
+{
+	struct tomofs_inode *t_inode = TOMOFS_T(inode);
+
+	/* Bytes past EOF are kept zero, so growing needs nothing */
+	if (attr->ia_size < i_size_read(inode)) {
+		down_write(tomofs_inode_sem(t_inode));
+		memset(t_inode->inline_data + attr->ia_size, 0,
+		    TOMOFS_INLINE_DATA - attr->ia_size);
+		up_write(tomofs_inode_sem(t_inode));
+	}
+	truncate_setsize(inode, attr->ia_size);
+	setattr_copy(inode, attr);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+static int tomofs_do_setattr(struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *inode = d_inode(dentry);
+	struct super_block *sb = inode->i_sb;
+	struct tomofs_inode *t_inode = TOMOFS_T(inode);
+	bool truncate = false;
+	handle_t *handle;
+	uint64_t lblk;
+	int ret;
+
+	ret = setattr_prepare(dentry, attr);
+	if (ret) {
+		return ret;
+	}
+
+	if ((attr->ia_valid & ATTR_SIZE) &&
+	    attr->ia_size != i_size_read(inode)) {
+		if (attr->ia_size > inode->i_sb->s_maxbytes) {
+			return -EFBIG;
+		}
+		/* Direct writes in flight may still map blocks past the new size */
+		inode_dio_wait(inode);
+		if (tomofs_has_inline(t_inode)) {
+			if (attr->ia_size <= TOMOFS_INLINE_DATA) {
+				return tomofs_setattr_inline(inode, attr);
+			}
+			ret = tomofs_convert_inline(inode);
+			if (ret) {
+				return ret;
+			}
+		}
+		if (!tomofs_is_compressed(t_inode)) {
+			ret = block_truncate_page(inode->i_mapping,
+			    attr->ia_size, tomofs_get_block);
+			if (ret) {
+				return ret;
+			}
+		}
+		truncate = true;
+	}
+
+	if (!truncate) {
+		/* Written back later by tomofs_write_inode() */
+		setattr_copy(inode, attr);
+		mark_inode_dirty(inode);
+		return 0;
+	}
+
+	/*
+	 * Waits for page locks and writeback, which may start handles of
+	 * their own, so it must come before ours
+	 */
+	truncate_setsize(inode, attr->ia_size);
+	lblk = DIV_ROUND_UP(attr->ia_size, sb->s_blocksize);
+	if (tomofs_is_compressed(t_inode)) {
+		/* Clusters go as a whole */
+		lblk = round_up(lblk, TOMOFS_CLUSTER_BLKS(sb->s_blocksize));
+	}
+
+	/* Freed blocks and the shrunk extent tree commit together */
+	handle = tomofs_journal_start(sb, tomofs_truncate_credits(sb));
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+	for (;;) {
+		ret = tomofs_extent_truncate(sb, t_inode, lblk,
+		    tomofs_truncate_batch(sb));
+		if (ret != -EAGAIN) {
+			break;
+		}
+		/* Save the tree matching the blocks freed so far */
+		ret = tomofs_save_inode(sb, t_inode);
+		if (ret) {
+			break;
+		}
+		ret = tomofs_journal_ensure_credits(
+		    tomofs_truncate_credits(sb));
+		if (ret) {
+			break;
+		}
+	}
+	if (ret) {
+		goto out;
+	}
+
+	setattr_copy(inode, attr);
+	tomofs_update_inode(inode);
+	ret = tomofs_save_inode(sb, t_inode);
+
+	mark_inode_dirty(inode);
+out:
+	tomofs_journal_stop(handle);
+	if (!ret && tomofs_is_compressed(t_inode)) {
+		ret = tomofs_compress_truncate(inode, attr->ia_size);
+	}
+	return ret;
+}
+
+static int tomofs_setattr(struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *inode = d_inode(dentry);
+	u64 start = tomofs_stats_start();
+	int ret;
+
+	ret = tomofs_do_setattr(dentry, attr);
+	trace_tomofs_setattr(inode, attr->ia_valid, attr->ia_size, ret);
+	tomofs_stats_account(inode->i_sb, TOMOFS_OP_SETATTR, start, ret);
+	return ret;
+}
+
+static int tomofs_fsync(struct file *file, loff_t start, loff_t end,
+    int datasync)
+{
+	struct inode *inode = file_inode(file);
+	u64 start_ns = tomofs_stats_start();
+	int ret;
+
+	ret = generic_file_fsync(file, start, end, datasync);
+	if (!ret) {
+		/* Metadata is only durable once its transaction commits */
+		ret = tomofs_journal_commit(inode->i_sb, 1);
+	}
+	trace_tomofs_fsync(inode, datasync, ret);
+	tomofs_stats_account(inode->i_sb, TOMOFS_OP_FSYNC, start_ns, ret);
+	return ret;
+}
+
+static int tomofs_write_inode(struct inode *inode,
+    struct writeback_control *wbc)
+{
+	handle_t *handle;
+	int ret;
+
+	handle = tomofs_journal_start(inode->i_sb, TOMOFS_INODE_CREDITS);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+	tomofs_update_inode(inode);
+	ret = tomofs_save_inode(inode->i_sb, TOMOFS_T(inode));
+	tomofs_journal_stop(handle);
+	/* fsync and sync_fs commit the transaction themselves */
+	return ret;
+}
+
+static int tomofs_sync_fs(struct super_block *sb, int wait)
+{
+	int ret;
+
+	ret = tomofs_sync_sb(sb, wait);
+	if (ret) {
+		return ret;
+	}
+	return tomofs_journal_commit(sb, wait);
+}
+
+/*
+ * Only reads the per-CPU counters, which may lag the allocator by a
+ * batch per CPU, so polling it never waits for or touches the disk
+ */
+static int tomofs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+	s64 bfree;
+
+	bfree = percpu_counter_read_positive(&sbi->free_blocks) -
+	    percpu_counter_read_positive(&sbi->delalloc_blocks);
+
+	buf->f_type = TOMOFS_SB_MAGIC;
+	buf->f_bsize = sb->s_blocksize;
+	buf->f_blocks = sbi->tsb.dev.block_cnt;
+	buf->f_bfree = max_t(s64, bfree, 0);
+	/* Writes stop at the slack kept for metadata */
+	buf->f_bavail = max_t(s64, bfree - TOMOFS_DELALLOC_SLACK, 0);
+	buf->f_files = sbi->tsb.ag_count *
+	    (TOMOFS_AG_INODES(sb->s_blocksize) - 1);
+	buf->f_ffree = percpu_counter_read_positive(&sbi->free_inodes);
+	buf->f_namelen = TOMOFS_MAX_FILENAME_LEN;
+	buf->f_fsid.val[0] = (u32)id;
+	buf->f_fsid.val[1] = (u32)(id >> 32);
+	return 0;
+}
+
+static int tomofs_show_options(struct seq_file *m, struct dentry *root)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(root->d_sb);
+
+	if (sbi->mount_opts & TOMOFS_MOUNT_DISCARD) {
+		seq_puts(m, ",discard");
+	}
+	if (sbi->mount_opts & TOMOFS_MOUNT_COMPRESS) {
+		seq_puts(m, ",compress");
+	}
+	return 0;
+}
+
+static long tomofs_ioctl(struct file *file, unsigned int cmd,
+    unsigned long arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct request_queue *q = bdev_get_queue(sb->s_bdev);
+	struct fstrim_range __user *urange = (struct fstrim_range __user *)arg;
+	struct fstrim_range range;
+	int ret;
+
+	switch (cmd) {
+	case FITRIM:
+		if (!capable(CAP_SYS_ADMIN)) {
+			return -EPERM;
+		}
+		if (!blk_queue_discard(q)) {
+			return -EOPNOTSUPP;
+		}
+		if (copy_from_user(&range, urange, sizeof(range))) {
+			return -EFAULT;
+		}
+		/* Shorter extents would be dropped by the device anyway */
+		range.minlen = max_t(u64, range.minlen,
+		    q->limits.discard_granularity);
+		ret = tomofs_trim_fs(sb, &range);
+		if (ret) {
+			return ret;
+		}
+		if (copy_to_user(urange, &range, sizeof(range))) {
+			return -EFAULT;
+		}
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* Flag @inode as sharing blocks, before any of them are */
+static int tomofs_set_shared(struct super_block *sb, struct inode *inode)
+{
+	struct tomofs_inode *t_inode = TOMOFS_T(inode);
+
+	if (tomofs_is_shared(t_inode)) {
+		return 0;
+	}
+	down_write(tomofs_inode_sem(t_inode));
+	t_inode->flags |= TOMOFS_INODE_SHARED;
+	up_write(tomofs_inode_sem(t_inode));
+	return tomofs_save_inode(sb, t_inode);
+}
+
+/*
+ * Map the @count disk blocks at @addr into @dst from file block @lblk as
+ * well. Shares no more than one refcount map block covers and returns how
+ * many blocks it did.
+ */
+static int tomofs_clone_extent(struct inode *dst, uint64_t lblk,
+    uintptr_t addr, uint64_t count)
+{
+	struct super_block *sb = dst->i_sb;
+	struct tomofs_inode *t_dst = TOMOFS_T(dst);
+	struct block_extent e;
+	handle_t *handle;
+	int ret;
+
+	handle = tomofs_journal_start(sb, TOMOFS_CLONE_CREDITS);
+	if (IS_ERR(handle)) {
+		return PTR_ERR(handle);
+	}
+	ret = tomofs_share_blocks(sb, addr >> sb->s_blocksize_bits, count);
+	if (ret < 0) {
+		goto out;
+	}
+	e.head = addr;
+	e.count = ret;
+	ret = tomofs_extent_insert(sb, t_dst, lblk, &e);
+	if (ret) {
+		/* Drops the owner just added */
+		put_empty_block(sb, &e);
+		goto out;
+	}
+	ret = tomofs_save_inode(sb, t_dst);
+	if (!ret) {
+		ret = e.count;
+	}
+out:
+	tomofs_journal_stop(handle);
+	return ret;
+}
+
+/* Share @len blocks of @src from @lblk_in with @dst at @lblk_out */
+static int tomofs_clone_blocks(struct inode *src, uint64_t lblk_in,
+    struct inode *dst, uint64_t lblk_out, uint64_t len)
+{
+	struct super_block *sb = src->i_sb;
+	struct tomofs_inode *t_src = TOMOFS_T(src);
+	uintptr_t addr;
+	uint64_t count;
+	uint64_t next;
+	int ret;
+
+	while (len > 0) {
+		ret = tomofs_extent_map(sb, t_src, lblk_in, &addr, &count);
+		if (ret == -ENOENT) {
+			/* Holes stay holes */
+			ret = tomofs_extent_next(sb, t_src, lblk_in, &next);
+			if (ret == -ENOENT || (!ret && next - lblk_in >= len)) {
+				return 0;
+			}
+			if (ret) {
+				return ret;
+			}
+			count = next - lblk_in;
+		} else if (ret) {
+			return ret;
+		} else {
+			ret = tomofs_clone_extent(dst, lblk_out, addr,
+			    min(count, len));
+			if (ret < 0) {
+				return ret;
+			}
+			count = ret;
+		}
+		lblk_in += count;
+		lblk_out += count;
+		len -= count;
+	}
+	return 0;
+}
+
+/*
+ * FICLONE and FICLONERANGE. The destination range must be a hole, which
+ * then maps the same blocks as the source range.
+ */
+static int tomofs_clone_file_range(struct file *file_in, loff_t pos_in,
+    struct file *file_out, loff_t pos_out, u64 len)
+{
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+	struct super_block *sb = src->i_sb;
+	unsigned int bits = sb->s_blocksize_bits;
+	handle_t *handle;
+	uint64_t next;
+	int ret;
+
+	lock_two_nondirectories(src, dst);
+	/* Inline data has no blocks to share, clusters can't be shared */
+	if (tomofs_has_inline(TOMOFS_T(src)) ||
+	    tomofs_is_compressed(TOMOFS_T(src)) ||
+	    tomofs_is_compressed(TOMOFS_T(dst))) {
+		ret = -EOPNOTSUPP;
+		goto out;
+	}
+	if (tomofs_has_inline(TOMOFS_T(dst))) {
+		ret = tomofs_convert_inline(dst);
+		if (ret) {
+			goto out;
+		}
+	}
+	/* Checks alignment and writes back both ranges */
+	ret = vfs_clone_file_prep_inodes(src, pos_in, dst, pos_out, &len,
+	    false);
+	if (ret <= 0) {
+		goto out;
+	}
+
+	ret = tomofs_extent_next(sb, TOMOFS_T(dst), pos_out >> bits, &next);
+	if (!ret) {
+		ret = next < DIV_ROUND_UP(pos_out + len, sb->s_blocksize) ?
+		    -EOPNOTSUPP : 0;
+	} else if (ret == -ENOENT) {
+		ret = 0;
+	}
+	if (ret) {
+		goto out;
+	}
+
+	handle = tomofs_journal_start(sb, 2 * TOMOFS_INODE_CREDITS);
+	if (IS_ERR(handle)) {
+		ret = PTR_ERR(handle);
+		goto out;
+	}
+	ret = tomofs_set_shared(sb, src);
+	if (!ret) {
+		ret = tomofs_set_shared(sb, dst);
+	}
+	tomofs_journal_stop(handle);
+	if (ret) {
+		goto out;
+	}
+
+	ret = tomofs_clone_blocks(src, pos_in >> bits, dst, pos_out >> bits,
+	    DIV_ROUND_UP(len, sb->s_blocksize));
+	if (ret) {
+		goto out;
+	}
+	/* Pages cached for the hole are stale now */
+	ret = invalidate_inode_pages2_range(dst->i_mapping,
+	    pos_out >> PAGE_SHIFT, (pos_out + len - 1) >> PAGE_SHIFT);
+	if (ret) {
+		goto out;
+	}
+
+	handle = tomofs_journal_start(sb, TOMOFS_INODE_CREDITS);
+	if (IS_ERR(handle)) {
+		ret = PTR_ERR(handle);
+		goto out;
+	}
+	if (pos_out + len > i_size_read(dst)) {
+		i_size_write(dst, pos_out + len);
+	}
+	dst->i_mtime = dst->i_ctime = current_time(dst);
+	tomofs_update_inode(dst);
+	ret = tomofs_save_inode(sb, TOMOFS_T(dst));
+	tomofs_journal_stop(handle);
+
+out:
+	unlock_two_nondirectories(src, dst);
+	return ret;
+}
+
+static int tomofs_iterate(struct file *fp, struct dir_context *ctx)
+{
+	struct inode *inode;
+	struct tomofs_inode *t_inode;
+	loff_t pos = ctx->pos;
+	u64 start = tomofs_stats_start();
+	int ret;
+
+	inode = file_inode(fp);
+	t_inode = TOMOFS_T(inode);
+
+	if (unlikely(!S_ISDIR(t_inode->mode))) {
+		return -ENOTDIR;
+	}
+
+	ret = tomofs_dir_iterate(inode->i_sb, t_inode, ctx);
+	trace_tomofs_readdir(inode, pos, ret);
+	tomofs_stats_account(inode->i_sb, TOMOFS_OP_READDIR, start, ret);
+	return ret;
+}
+
+enum {
+	Opt_discard,
+	Opt_nodiscard,
+	Opt_compress,
+	Opt_nocompress,
+	Opt_err,
+};
+
+static const match_table_t tomofs_tokens = {
+	{Opt_discard, "discard"},
+	{Opt_nodiscard, "nodiscard"},
+	{Opt_compress, "compress"},
+	{Opt_nocompress, "nocompress"},
+	{Opt_err, NULL},
+};
+
+static int tomofs_parse_options(struct super_block *sb, char *options)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+
+	if (!options) {
+		return 0;
+	}
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p) {
+			continue;
+		}
+		switch (match_token(p, tomofs_tokens, args)) {
+		case Opt_discard:
+			sbi->mount_opts |= TOMOFS_MOUNT_DISCARD;
+			break;
+		case Opt_nodiscard:
+			sbi->mount_opts &= ~TOMOFS_MOUNT_DISCARD;
+			break;
+		case Opt_compress:
+			sbi->mount_opts |= TOMOFS_MOUNT_COMPRESS;
+			break;
+		case Opt_nocompress:
+			sbi->mount_opts &= ~TOMOFS_MOUNT_COMPRESS;
+			break;
+		default:
+			printk(KERN_ERR "tomofs: unknown mount option \"%s\"\n", p);
+			return -EINVAL;
+		}
+	}
+
+	if ((sbi->mount_opts & TOMOFS_MOUNT_DISCARD) &&
+	    !blk_queue_discard(bdev_get_queue(sb->s_bdev))) {
+		printk(KERN_WARNING "tomofs: %s does not support discard, "
+		    "ignoring -o discard\n", sb->s_id);
+		sbi->mount_opts &= ~TOMOFS_MOUNT_DISCARD;
+	}
+	/* A cluster has to save at least a block to be worth compressing */
+	if ((sbi->mount_opts & TOMOFS_MOUNT_COMPRESS) &&
+	    (PAGE_SIZE > TOMOFS_CLUSTER_SIZE ||
+	    sb->s_blocksize * 2 > TOMOFS_CLUSTER_SIZE)) {
+		printk(KERN_WARNING "tomofs: compression needs blocks and "
+		    "pages of at most %d bytes, ignoring -o compress\n",
+		    TOMOFS_CLUSTER_SIZE / 2);
+		sbi->mount_opts &= ~TOMOFS_MOUNT_COMPRESS;
+	}
+	return 0;
+}
+
+int tomofs_fill_super(struct super_block *sb, void *data, int silent)
+{
+	struct inode *root_inode;
+	struct buffer_head *bh;
+	struct tomofs_sb_info *sbi;
+	struct tomofs_super_block *tsb;
+	int ret = -EPERM;
+
+	/* The super block fits in the smallest block, whatever mkfs chose */
+	if (!sb_min_blocksize(sb, 1 << TOMOFS_MIN_BLK_BITS)) {
+		printk(KERN_ERR "tomofs: unable to set block size\n");
+		return -EINVAL;
+	}
+
+	bh = sb_bread(sb, TOMOFS_SB_BLK_NO);
+	/* PANIC on failure to read super block */
+	BUG_ON(!bh);
+
+	sbi = kzalloc(sizeof(struct tomofs_sb_info), GFP_KERNEL);
+	if (!sbi) {
+		ret = -ENOMEM;
+		goto release;
+	}
+	tsb = &sbi->tsb;
+	memcpy((char *)tsb, bh->b_data, sizeof(struct tomofs_super_block));
+	if (unlikely(tsb->magic != TOMOFS_SB_MAGIC)) {
+		printk(KERN_ERR "tomofs: NOT TOMOFS!\n");
+		kfree(sbi);
+		goto release;
+	}
+	if (tsb->blocksize_bits < TOMOFS_MIN_BLK_BITS ||
+	    tsb->blocksize_bits > TOMOFS_MAX_BLK_BITS) {
+		printk(KERN_ERR "tomofs: bad block size 2^%u\n",
+		    tsb->blocksize_bits);
+		ret = -EINVAL;
+		kfree(sbi);
+		goto release;
+	}
+	/* get_block maps whole filesystem blocks onto the page cache */
+	brelse(bh);
+	bh = NULL;
+	if (!sb_set_blocksize(sb, 1 << tsb->blocksize_bits)) {
+		printk(KERN_ERR "tomofs: block size %u not supported by the device or larger than a page\n",
+		    1 << tsb->blocksize_bits);
+		ret = -EINVAL;
+		kfree(sbi);
+		goto release;
+	}
+
+	sb->s_magic = TOMOFS_SB_MAGIC;
+	sb->s_fs_info = sbi;
+	sbi->sb = sb;
+	ret = tomofs_parse_options(sb, data);
+	if (ret) {
+		sb->s_fs_info = NULL;
+		kfree(sbi);
+		goto release;
+	}
+	ret = tomofs_compress_init(sb);
+	if (ret) {
+		sb->s_fs_info = NULL;
+		kfree(sbi);
+		goto release;
+	}
+	/* Replays anything left by a crash before the metadata is read */
+	ret = tomofs_journal_load(sb);
+	if (ret) {
+		tomofs_compress_destroy(sb);
+		sb->s_fs_info = NULL;
+		kfree(sbi);
+		goto release;
+	}
+	ret = tomofs_load_ags(sb);
+	if (ret) {
+		printk(KERN_ERR "tomofs: unable to load allocation groups\n");
+		tomofs_journal_destroy(sb);
+		tomofs_compress_destroy(sb);
+		sb->s_fs_info = NULL;
+		kfree(sbi);
+		goto release;
+	}
+	ret = tomofs_stats_init(sb);
+	if (ret) {
+		goto out_journal;
+	}
+	ret = -EPERM;
+	/* max file size */
+	sb->s_maxbytes = TOMOFS_MAXBYTES(sb->s_blocksize);
+	sb->s_op = &tomofs_sops;
+	root_inode = tomofs_iget(sb, TOMOFS_ROOTDIR_INODE_NO);
+
+	/* rootdir inode should have been created at mkfs time */
+	if (IS_ERR(root_inode)) {
+		printk(KERN_ERR "tomofs: unable to read root directory\n");
+		ret = PTR_ERR(root_inode);
+		goto out_journal;
+	}
+	/* make dentry for rootdir from inode */
+	sb->s_root = d_make_root(root_inode);
+	if (!sb->s_root) {
+		ret = -ENOMEM;
+		goto out_journal;
+	}
+	ret = 0;
+	goto release;
+
+out_journal:
+	/* put_super only runs once there is a root */
+	tomofs_journal_destroy(sb);
+
+release:
+	brelse(bh);
+	return ret;
+}
+
+static struct dentry *tomofs_mount(struct file_system_type *fs_type,
+    int flags, const char *dev_name, void *data)
+{
+	struct dentry *root_dentry;
+	root_dentry = mount_bdev(fs_type, flags, dev_name, data, tomofs_fill_super);
+	if (unlikely(IS_ERR(root_dentry))) {
+		printk("Error mounting tomofs\n");
+	} else {
+		printk("mounted tomofs\n");
+	}
+
+	return root_dentry;
+}
+
+/*
+ * Runs from kill_block_super() after sync_fs, while the device is still
+ * open. Destroying the journal checkpoints every logged block in place.
+ */
+static void tomofs_put_super(struct super_block *sb)
+{
+	tomofs_journal_destroy(sb);
+	tomofs_sync_sb(sb, 1);
+}
+
+static void tomofs_kill_superblock(struct super_block *sb)
+{
+	struct tomofs_sb_info *sbi = TOMOFS_SB(sb);
+
 	printk(KERN_INFO "Unmounting tomofs\n");
 	kill_block_super(sb);
+	if (sbi) {
+		tomofs_destroy_ags(sb);
+		tomofs_stats_destroy(sb);
+		tomofs_compress_destroy(sb);
+		kfree(sbi);
+	}
 }
 
 module_init(init_tomofs_fs)
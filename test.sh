@@ -1,6 +1,7 @@
 #!/bin/bash
 
 sudo zfs create -V 16G -s tank/test
+sudo modprobe jbd2
 sudo insmod ./tomofs.ko
 sudo ./util/mkfs.tomofs /dev/zvol/tank/test
-sudo mount -t tomofs /dev/zvol/tank/test /mnt/tomofs
+sudo mount -t tomofs -o discard /dev/zvol/tank/test /mnt/tomofs
@@ -0,0 +1,331 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/*
+ * bench.tomofs: metadata microbenchmark, see bench.sh
+ *
+ * Runs one workload on a mounted file system from several threads and
+ * prints its throughput and latency percentiles. Thread T works on names
+ * T, T + threads, ... in its own directory t<T>, so a later workload
+ * finds what an earlier one created:
+ *  mkdir    make directories d<N>
+ *  create   create empty files f<N>
+ *  write    write the io size to f<N>
+ *  stat     stat f<N>
+ *  lookup   stat missing names m<N>, which all fail
+ *  readdir  list t<T>, one op per entry
+ *  read     read the io size from f<N>
+ */
+
+enum workload {
+	W_MKDIR,
+	W_CREATE,
+	W_WRITE,
+	W_STAT,
+	W_LOOKUP,
+	W_READDIR,
+	W_READ,
+};
+
+static const char *workload_names[] = {
+	"mkdir", "create", "write", "stat", "lookup", "readdir", "read",
+};
+
+static enum workload workload;
+static const char *root;
+static uint64_t nr_files = 10000;
+static int nthreads = 1;
+static size_t io_size = 4096;
+
+/*
+ * @lat: latency of each op in ns
+ * @ops: number of ops done
+ */
+struct thread {
+	pthread_t tid;
+	int id;
+	uint64_t *lat;
+	uint64_t ops;
+	uint64_t cap;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void record(struct thread *t, uint64_t start)
+{
+	uint64_t end = now_ns();
+
+	if (t->ops == t->cap) {
+		t->cap = t->cap ? t->cap * 2 : 1024;
+		t->lat = realloc(t->lat, t->cap * sizeof(uint64_t));
+		if (!t->lat) {
+			printf("Out of memory\n");
+			exit(1);
+		}
+	}
+	t->lat[t->ops++] = end - start;
+}
+
+static void fail(const char *what, const char *path)
+{
+	printf("%s %s: %s\n", what, path, strerror(errno));
+	exit(1);
+}
+
+/* Read or write @io_size bytes of @path */
+static void do_io(const char *path, char *buf, int write)
+{
+	size_t done = 0;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, write ? O_WRONLY | O_TRUNC : O_RDONLY);
+	if (fd < 0) {
+		fail("open", path);
+	}
+	while (done < io_size) {
+		ret = write ? pwrite(fd, buf + done, io_size - done, done) :
+		    pread(fd, buf + done, io_size - done, done);
+		if (ret < 0) {
+			fail(write ? "write" : "read", path);
+		}
+		if (!ret) {
+			break;
+		}
+		done += ret;
+	}
+	close(fd);
+}
+
+static void run_readdir(struct thread *t, const char *dir)
+{
+	struct dirent *d;
+	uint64_t start;
+	DIR *dp;
+
+	dp = opendir(dir);
+	if (!dp) {
+		fail("opendir", dir);
+	}
+	for (;;) {
+		start = now_ns();
+		d = readdir(dp);
+		if (!d) {
+			break;
+		}
+		record(t, start);
+	}
+	closedir(dp);
+}
+
+static void *run(void *arg)
+{
+	struct thread *t = arg;
+	char dir[PATH_MAX];
+	char path[PATH_MAX + 32];
+	struct stat st;
+	uint64_t start;
+	uint64_t i;
+	char *buf;
+	int fd;
+
+	buf = malloc(io_size);
+	if (!buf) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+	memset(buf, 0xa5, io_size);
+	snprintf(dir, sizeof(dir), "%s/t%d", root, t->id);
+
+	if (workload == W_READDIR) {
+		run_readdir(t, dir);
+		free(buf);
+		return NULL;
+	}
+
+	for (i = t->id; i < nr_files; i += nthreads) {
+		snprintf(path, sizeof(path), "%s/%c%lu", dir,
+		    workload == W_MKDIR ? 'd' :
+		    workload == W_LOOKUP ? 'm' : 'f', (unsigned long)i);
+		start = now_ns();
+		switch (workload) {
+		case W_MKDIR:
+			if (mkdir(path, 0755)) {
+				fail("mkdir", path);
+			}
+			break;
+		case W_CREATE:
+			fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+			if (fd < 0) {
+				fail("create", path);
+			}
+			close(fd);
+			break;
+		case W_WRITE:
+			do_io(path, buf, 1);
+			break;
+		case W_STAT:
+			if (stat(path, &st)) {
+				fail("stat", path);
+			}
+			break;
+		case W_LOOKUP:
+			if (!stat(path, &st) || errno != ENOENT) {
+				fail("lookup", path);
+			}
+			break;
+		case W_READ:
+			do_io(path, buf, 0);
+			break;
+		default:
+			break;
+		}
+		record(t, start);
+	}
+	free(buf);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Latency at @pct percent of the sorted @lat, in microseconds */
+static double percentile(uint64_t *lat, uint64_t n, double pct)
+{
+	uint64_t i = (uint64_t)(pct / 100 * n);
+
+	if (i >= n) {
+		i = n - 1;
+	}
+	return lat[i] / 1000.0;
+}
+
+static void report(struct thread *threads, uint64_t elapsed)
+{
+	uint64_t *lat;
+	uint64_t n = 0;
+	int i;
+
+	for (i = 0; i < nthreads; i++) {
+		n += threads[i].ops;
+	}
+	if (!n) {
+		printf("%-8s no ops\n", workload_names[workload]);
+		return;
+	}
+	lat = malloc(n * sizeof(uint64_t));
+	if (!lat) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+	n = 0;
+	for (i = 0; i < nthreads; i++) {
+		memcpy(lat + n, threads[i].lat, threads[i].ops *
+		    sizeof(uint64_t));
+		n += threads[i].ops;
+	}
+	qsort(lat, n, sizeof(uint64_t), cmp_u64);
+
+	printf("%-8s %9lu ops %10.0f ops/s  p50 %8.1fus  p90 %8.1fus  "
+	    "p99 %8.1fus  p99.9 %8.1fus  max %8.1fus\n",
+	    workload_names[workload], (unsigned long)n,
+	    n * 1e9 / elapsed, percentile(lat, n, 50), percentile(lat, n, 90),
+	    percentile(lat, n, 99), percentile(lat, n, 99.9),
+	    lat[n - 1] / 1000.0);
+	free(lat);
+}
+
+int main(int argc, char **argv)
+{
+	struct thread *threads;
+	char dir[PATH_MAX];
+	uint64_t start;
+	unsigned int w;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "n:t:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_files = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 's':
+			io_size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 2 || nthreads < 1 || !io_size) {
+		goto usage;
+	}
+	root = argv[optind];
+	for (w = 0; w < sizeof(workload_names) / sizeof(char *); w++) {
+		if (!strcmp(argv[optind + 1], workload_names[w])) {
+			break;
+		}
+	}
+	if (w == sizeof(workload_names) / sizeof(char *)) {
+		goto usage;
+	}
+	workload = w;
+
+	/* Per-thread directories, left behind for the next workload */
+	for (i = 0; i < nthreads; i++) {
+		snprintf(dir, sizeof(dir), "%s/t%d", root, i);
+		if (mkdir(dir, 0755) && errno != EEXIST) {
+			fail("mkdir", dir);
+		}
+	}
+
+	threads = calloc(nthreads, sizeof(struct thread));
+	if (!threads) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+	start = now_ns();
+	for (i = 0; i < nthreads; i++) {
+		threads[i].id = i;
+		if (pthread_create(&threads[i].tid, NULL, run, &threads[i])) {
+			printf("Unable to start thread\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].tid, NULL);
+	}
+	report(threads, now_ns() - start);
+	return 0;
+
+usage:
+	printf("Usage: %s [-n files] [-t threads] [-s io size] dir "
+	    "mkdir|create|write|stat|lookup|readdir|read\n", argv[0]);
+	exit(1);
+}
@@ -0,0 +1,1086 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+#include "tfs.h"
+
+/*
+ * fsck.tomofs: check, dump and repair an unmounted tomofs image
+ *
+ * The check runs in passes, each spread over a pool of threads that pull
+ * work items (allocation groups, then directories) off a shared counter:
+ *  1. inode tables and extent trees, claiming every block they reference
+ *     in an in-memory ownership bitmap. Blocks the refcount maps say are
+ *     shared have their owners counted instead.
+ *  2. directory trees, counting references to every inode
+ *  3. link counts and the owners of shared blocks
+ *  4. the ownership bitmap against the on-disk free space bitmap, and the
+ *     inode and free block counts against the descriptors and super block
+ * Inode chunks, bitmaps and descriptors are read with one large pread()
+ * each. Only the free space bitmap and the counts are ever rewritten,
+ * the rest is reported.
+ */
+
+/* Exit codes, as for e2fsck */
+#define FSCK_OK 0
+#define FSCK_FIXED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+/* jbd2 superblock fields we look at, big-endian on disk */
+struct jbd2_super {
+	uint32_t h_magic;
+	uint32_t h_blocktype;
+	uint32_t h_sequence;
+	uint32_t s_blocksize;
+	uint32_t s_maxlen;
+	uint32_t s_first;
+	uint32_t s_sequence;
+	uint32_t s_start;
+};
+
+#define JBD2_MAGIC_NUMBER 0xc03b3998U
+
+/* Per-inode state gathered in pass 1 */
+#define INO_USED 0x1
+#define INO_DIR 0x2
+#define INO_REG 0x4
+
+/*
+ * In-memory allocation group
+ * @desc: on-disk descriptor
+ * @ibitmap: inode bitmap block
+ * @state: INO_* bits of each inode, NULL until pass 1 reads the table
+ * @refs: directory entries referencing each inode, saturating at 255
+ * @used: inodes pass 1 found in use
+ * @refcount: on-disk refcount map, NULL if the group has none
+ * @owners: extents pass 1 found mapping each shared block
+ */
+struct ag {
+	struct tomofs_ag_desc desc;
+	uint8_t *ibitmap;
+	uint8_t *state;
+	uint8_t *refs;
+	uint64_t used;
+	uint16_t *refcount;
+	uint32_t *owners;
+};
+
+/*
+ * A directory to check in pass 2.
+ * @extents: leaf extents of the directory, sorted by lblk
+ */
+struct dir {
+	uint64_t ino;
+	uint64_t child_count;
+	uint64_t nr_extents;
+	struct tomofs_extent *extents;
+};
+
+static int dev_fd;
+static unsigned long bs;
+static unsigned int bits;
+static struct tomofs_super_block tsb;
+static struct ag *ags;
+static uint64_t ag_blocks;
+static uint64_t ag_inodes;
+/* On-disk free space bitmap and the one rebuilt from the metadata */
+static uint8_t *disk_map;
+static uint8_t *owned_map;
+
+static struct dir *dirs;
+static uint64_t nr_dirs;
+static uint64_t dirs_cap;
+static pthread_mutex_t dirs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t nr_problems;
+static int verbose;
+
+static void report(const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&report_lock);
+	nr_problems++;
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	putchar('\n');
+	pthread_mutex_unlock(&report_lock);
+}
+
+static void *xcalloc(size_t nmemb, size_t size)
+{
+	void *p = calloc(nmemb, size);
+
+	if (!p) {
+		printf("Out of memory\n");
+		exit(FSCK_ERROR);
+	}
+	return p;
+}
+
+/* Read @len bytes at byte @off of the device, or exit */
+static void read_at(void *buf, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(dev_fd, buf, len, off);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR) {
+				continue;
+			}
+			printf("Unable to read 0x%lx: %s\n", (unsigned long)off,
+			    ret ? strerror(errno) : "short read");
+			exit(FSCK_ERROR);
+		}
+		buf = (char *)buf + ret;
+		len -= ret;
+		off += ret;
+	}
+}
+
+static void write_at(const void *buf, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(dev_fd, buf, len, off);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("write");
+			exit(FSCK_ERROR);
+		}
+		buf = (const char *)buf + ret;
+		len -= ret;
+		off += ret;
+	}
+}
+
+static int test_bit(const uint8_t *map, uint64_t nr)
+{
+	return map[nr / 8] & (1 << (nr % 8));
+}
+
+/*
+ * Thread pool
+ * run_parallel() calls @fn on items [0, @count) from up to @nthreads
+ * threads and waits for all of them.
+ */
+static int nthreads;
+
+struct work {
+	void (*fn)(uint64_t item);
+	uint64_t count;
+	uint64_t next;
+};
+
+static void *worker(void *arg)
+{
+	struct work *w = arg;
+	uint64_t item;
+
+	for (;;) {
+		item = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED);
+		if (item >= w->count) {
+			return NULL;
+		}
+		w->fn(item);
+	}
+}
+
+static void run_parallel(void (*fn)(uint64_t item), uint64_t count)
+{
+	struct work w = {
+		.fn = fn,
+		.count = count,
+	};
+	pthread_t *threads;
+	int n = nthreads;
+	int i;
+
+	if ((uint64_t)n > count) {
+		n = count ? count : 1;
+	}
+	threads = xcalloc(n, sizeof(pthread_t));
+	for (i = 1; i < n; i++) {
+		if (pthread_create(&threads[i], NULL, worker, &w)) {
+			printf("Unable to start thread\n");
+			exit(FSCK_ERROR);
+		}
+	}
+	worker(&w);
+	for (i = 1; i < n; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+}
+
+/* Is [@addr, @addr + @count blocks) a valid, aligned range of the device? */
+static int valid_range(uintptr_t addr, uint64_t count)
+{
+	return addr % bs == 0 && count > 0 && addr / bs < tsb.dev.block_cnt &&
+	    count <= tsb.dev.block_cnt - addr / bs;
+}
+
+/*
+ * Record that @what owns @count blocks from ADDRESS @addr. Only file
+ * @data may be on shared blocks, whose owners are counted.
+ * Returns nonzero if any of them was already owned.
+ */
+static int claim_range(uintptr_t addr, uint64_t count, const char *what,
+    uint64_t ino, int data)
+{
+	uint64_t blk = addr / bs;
+	uint64_t i;
+	uint8_t mask;
+	struct ag *ag;
+	int shared = 0;
+	int dup = 0;
+
+	if (!valid_range(addr, count)) {
+		report("%s of inode %lu: bad extent 0x%lx+%lu", what,
+		    (unsigned long)ino, (unsigned long)addr,
+		    (unsigned long)count);
+		return 1;
+	}
+	for (i = blk; i < blk + count; i++) {
+		mask = 1 << (i % 8);
+		ag = &ags[i / ag_blocks];
+		if (ag->refcount && ag->refcount[i % ag_blocks]) {
+			if (!data) {
+				shared++;
+				continue;
+			}
+			__atomic_fetch_add(&ag->owners[i % ag_blocks], 1,
+			    __ATOMIC_RELAXED);
+			__atomic_fetch_or(&owned_map[i / 8], mask,
+			    __ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_fetch_or(&owned_map[i / 8], mask,
+		    __ATOMIC_RELAXED) & mask) {
+			dup++;
+		}
+	}
+	if (dup) {
+		report("%s of inode %lu: %d of blocks 0x%lx+%lu already in use",
+		    what, (unsigned long)ino, dup, (unsigned long)addr,
+		    (unsigned long)count);
+	}
+	if (shared) {
+		report("%s of inode %lu: %d of blocks 0x%lx+%lu are shared",
+		    what, (unsigned long)ino, shared, (unsigned long)addr,
+		    (unsigned long)count);
+	}
+	return dup + shared;
+}
+
+static int claim(uintptr_t addr, uint64_t count, const char *what,
+    uint64_t ino)
+{
+	return claim_range(addr, count, what, ino, 0);
+}
+
+/* Blocks that belong to no inode */
+static void claim_metadata(void)
+{
+	uint64_t table_blocks;
+	uint64_t i;
+
+	table_blocks = (tsb.ag_count + TOMOFS_AG_DESC_PER_BLK(bs) - 1) /
+	    TOMOFS_AG_DESC_PER_BLK(bs);
+	claim(0, 1, "super block", 0);
+	claim(tsb.ag_table, table_blocks, "group descriptors", 0);
+	claim(tsb.dev.block_map, tsb.ag_count, "free space bitmap", 0);
+	claim(tsb.journal.head, tsb.journal.count, "journal", 0);
+	for (i = 0; i < tsb.ag_count; i++) {
+		claim(ags[i].desc.inode_bitmap, 1, "inode bitmap", 0);
+		claim(ags[i].desc.inode_chunks, 1, "inode chunk map", 0);
+		if (ags[i].desc.refcount_map) {
+			claim(ags[i].desc.refcount_map, TOMOFS_REFCOUNT_BLKS,
+			    "refcount map", 0);
+		}
+	}
+}
+
+/* A growable array of extents */
+struct ext_list {
+	struct tomofs_extent *v;
+	uint64_t nr;
+	uint64_t cap;
+};
+
+static void ext_list_add(struct ext_list *l, struct tomofs_extent *ex)
+{
+	if (l->nr == l->cap) {
+		l->cap = l->cap ? l->cap * 2 : 16;
+		l->v = realloc(l->v, l->cap * sizeof(struct tomofs_extent));
+		if (!l->v) {
+			printf("Out of memory\n");
+			exit(FSCK_ERROR);
+		}
+	}
+	l->v[l->nr++] = *ex;
+}
+
+/*
+ * Check extent tree node @hdr of inode @ino covering file blocks
+ * [@lo, @hi), claim the blocks it maps and its children, and add its
+ * leaf extents to @out. Only a @compressed inode may map clusters.
+ */
+static void check_extent_node(uint64_t ino, struct tomofs_extent_header *hdr,
+    unsigned int max, int depth, uint64_t lo, uint64_t hi, int compressed,
+    struct ext_list *out)
+{
+	struct tomofs_extent *ex;
+	struct tomofs_extent_idx *idx;
+	uint64_t next = lo;
+	uint64_t end;
+	char *child;
+	int i;
+
+	if (hdr->magic != TOMOFS_EXTENT_MAGIC) {
+		report("Inode %lu: bad extent node magic 0x%x",
+		    (unsigned long)ino, hdr->magic);
+		return;
+	}
+	if (hdr->max != max || hdr->entries > hdr->max ||
+	    (depth >= 0 && hdr->depth != depth)) {
+		report("Inode %lu: bad extent node, %u of %u entries, depth %u",
+		    (unsigned long)ino, hdr->entries, hdr->max, hdr->depth);
+		return;
+	}
+
+	if (hdr->depth == 0) {
+		ex = (struct tomofs_extent *)(hdr + 1);
+		for (i = 0; i < hdr->entries; i++) {
+			end = ex[i].lblk + tomofs_extent_len(&ex[i], bs);
+			if (ex[i].clen && (!compressed ||
+			    ex[i].lblk % TOMOFS_CLUSTER_BLKS(bs) ||
+			    ex[i].clen > TOMOFS_CLUSTER_SIZE ||
+			    (uint64_t)ex[i].ext.count !=
+			    (ex[i].clen + bs - 1) / bs)) {
+				report("Inode %lu: bad cluster at %lu, %lu "
+				    "bytes in %lu blocks", (unsigned long)ino,
+				    (unsigned long)ex[i].lblk,
+				    (unsigned long)ex[i].clen,
+				    (unsigned long)ex[i].ext.count);
+				continue;
+			}
+			if (ex[i].lblk < next || end > hi ||
+			    end > TOMOFS_MAX_FILE_BLKS) {
+				report("Inode %lu: extent %lu+%lu out of order",
+				    (unsigned long)ino,
+				    (unsigned long)ex[i].lblk,
+				    (unsigned long)ex[i].ext.count);
+				continue;
+			}
+			next = end;
+			if (!claim_range(ex[i].ext.head, ex[i].ext.count,
+			    "data", ino, 1)) {
+				ext_list_add(out, &ex[i]);
+			}
+		}
+		return;
+	}
+
+	idx = (struct tomofs_extent_idx *)(hdr + 1);
+	child = malloc(bs);
+	if (!child) {
+		printf("Out of memory\n");
+		exit(FSCK_ERROR);
+	}
+	for (i = 0; i < hdr->entries; i++) {
+		end = i + 1 < hdr->entries ? idx[i + 1].lblk : hi;
+		if (idx[i].lblk < next || end > hi || end <= idx[i].lblk) {
+			report("Inode %lu: index entry %lu out of order",
+			    (unsigned long)ino, (unsigned long)idx[i].lblk);
+			continue;
+		}
+		next = end;
+		if (claim(idx[i].child, 1, "extent node", ino)) {
+			continue;
+		}
+		read_at(child, bs, idx[i].child);
+		check_extent_node(ino, (struct tomofs_extent_header *)child,
+		    hdr->depth > 1 ? TOMOFS_BLK_EXTENT_IDX(bs) :
+		    TOMOFS_BLK_EXTENTS(bs), hdr->depth - 1, idx[i].lblk, end,
+		    compressed, out);
+	}
+	free(child);
+}
+
+static void queue_dir(struct tomofs_inode *t_inode, struct ext_list *l)
+{
+	pthread_mutex_lock(&dirs_lock);
+	if (nr_dirs == dirs_cap) {
+		dirs_cap = dirs_cap ? dirs_cap * 2 : 64;
+		dirs = realloc(dirs, dirs_cap * sizeof(struct dir));
+		if (!dirs) {
+			printf("Out of memory\n");
+			exit(FSCK_ERROR);
+		}
+	}
+	dirs[nr_dirs].ino = t_inode->i_ino;
+	dirs[nr_dirs].child_count = t_inode->child_count;
+	dirs[nr_dirs].nr_extents = l->nr;
+	dirs[nr_dirs].extents = l->v;
+	nr_dirs++;
+	pthread_mutex_unlock(&dirs_lock);
+}
+
+static void dump_inode(struct tomofs_inode *t_inode)
+{
+	pthread_mutex_lock(&report_lock);
+	printf("inode %lu: mode 0%o flags 0x%x size %lu children %lu",
+	    (unsigned long)t_inode->i_ino, t_inode->mode, t_inode->flags,
+	    (unsigned long)t_inode->file_size,
+	    (unsigned long)t_inode->child_count);
+	if (t_inode->flags & TOMOFS_INODE_INLINE) {
+		printf(" inline\n");
+	} else {
+		printf(" extent depth %u entries %u\n",
+		    t_inode->extents.hdr.depth, t_inode->extents.hdr.entries);
+	}
+	pthread_mutex_unlock(&report_lock);
+}
+
+/* Pass 1 on inode @ino, slot @slot of group @agno */
+static void check_inode(uint64_t agno, uint64_t slot,
+    struct tomofs_inode *t_inode)
+{
+	struct ag *ag = &ags[agno];
+	uint64_t ino = agno * ag_inodes + slot;
+	int in_bitmap = test_bit(ag->ibitmap, slot);
+	struct ext_list l = { 0 };
+
+	if (!(t_inode->flags & TOMOFS_INODE_USED)) {
+		if (in_bitmap) {
+			report("Inode %lu: in use in the bitmap but not in the "
+			    "table", (unsigned long)ino);
+		}
+		return;
+	}
+	if (!in_bitmap) {
+		report("Inode %lu: in use in the table but free in the bitmap",
+		    (unsigned long)ino);
+	}
+	if (t_inode->i_ino != ino) {
+		report("Inode %lu: table entry says it is inode %lu",
+		    (unsigned long)ino, (unsigned long)t_inode->i_ino);
+		return;
+	}
+	if (verbose) {
+		dump_inode(t_inode);
+	}
+	if (S_ISDIR(t_inode->mode)) {
+		ag->state[slot] = INO_USED | INO_DIR;
+	} else if (S_ISREG(t_inode->mode)) {
+		ag->state[slot] = INO_USED | INO_REG;
+	} else {
+		report("Inode %lu: unknown mode 0%o", (unsigned long)ino,
+		    t_inode->mode);
+		return;
+	}
+	__atomic_fetch_add(&ag->used, 1, __ATOMIC_RELAXED);
+
+	if ((t_inode->flags & TOMOFS_INODE_COMPRESSED) &&
+	    (!S_ISREG(t_inode->mode) ||
+	    (t_inode->flags & TOMOFS_INODE_INLINE))) {
+		report("Inode %lu: compressed but not an extent mapped file",
+		    (unsigned long)ino);
+	}
+	if (t_inode->flags & TOMOFS_INODE_INLINE) {
+		if (!S_ISREG(t_inode->mode) ||
+		    t_inode->file_size > TOMOFS_INLINE_DATA) {
+			report("Inode %lu: bad inline data, %lu bytes",
+			    (unsigned long)ino,
+			    (unsigned long)t_inode->file_size);
+		}
+		return;
+	}
+
+	check_extent_node(ino, &t_inode->extents.hdr,
+	    t_inode->extents.hdr.depth ? TOMOFS_INODE_EXTENT_IDX :
+	    TOMOFS_INODE_EXTENTS, -1, 0, TOMOFS_MAX_FILE_BLKS,
+	    t_inode->flags & TOMOFS_INODE_COMPRESSED, &l);
+	if (S_ISDIR(t_inode->mode)) {
+		if (!l.nr || l.v[0].lblk != 0) {
+			report("Directory %lu: no root block",
+			    (unsigned long)ino);
+			free(l.v);
+			return;
+		}
+		queue_dir(t_inode, &l);
+		return;
+	}
+	free(l.v);
+}
+
+/* Pass 1: inode table of group @agno */
+static void check_ag_inodes(uint64_t agno)
+{
+	struct ag *ag = &ags[agno];
+	uint64_t chunk_inodes = TOMOFS_INODE_CHUNK_INODES(bs);
+	uint64_t nr_chunks = (ag_inodes + chunk_inodes - 1) / chunk_inodes;
+	uintptr_t *chunks;
+	char *table;
+	uint64_t c;
+	uint64_t i;
+	uint64_t slot;
+
+	chunks = xcalloc(1, bs);
+	table = xcalloc(TOMOFS_INODE_CHUNK_BLKS, bs);
+	ag->ibitmap = xcalloc(1, bs);
+	ag->state = xcalloc(ag_inodes, 1);
+	ag->refs = xcalloc(ag_inodes, 1);
+	read_at(ag->ibitmap, bs, ag->desc.inode_bitmap);
+	read_at(chunks, bs, ag->desc.inode_chunks);
+
+	if (test_bit(ag->ibitmap, 0) != (agno == 0)) {
+		report("Group %lu: reserved inode 0 is %s",
+		    (unsigned long)agno, agno ? "in use" : "free");
+	}
+	for (c = 0; c < nr_chunks; c++) {
+		if (!chunks[c]) {
+			for (i = 0; i < chunk_inodes; i++) {
+				slot = c * chunk_inodes + i;
+				if (slot < ag_inodes && slot &&
+				    test_bit(ag->ibitmap, slot)) {
+					report("Inode %lu: in use but its "
+					    "chunk is missing", (unsigned long)
+					    (agno * ag_inodes + slot));
+				}
+			}
+			continue;
+		}
+		if (claim(chunks[c], TOMOFS_INODE_CHUNK_BLKS, "inode chunk",
+		    agno * ag_inodes + c * chunk_inodes)) {
+			continue;
+		}
+		read_at(table, TOMOFS_INODE_CHUNK_BLKS * bs, chunks[c]);
+		for (i = 0; i < chunk_inodes; i++) {
+			slot = c * chunk_inodes + i;
+			if (slot == 0 || slot >= ag_inodes) {
+				continue;
+			}
+			check_inode(agno, slot, (struct tomofs_inode *)
+			    (table + i * TOMOFS_INODE_SIZE));
+		}
+	}
+	free(chunks);
+	free(table);
+}
+
+/* Disk ADDRESS of block @lblk of directory @d, or 0 */
+static uintptr_t dir_map(struct dir *d, uint64_t lblk)
+{
+	uint64_t lo = 0;
+	uint64_t hi = d->nr_extents;
+	uint64_t mid;
+	struct tomofs_extent *ex;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		ex = &d->extents[mid];
+		if (lblk < ex->lblk) {
+			hi = mid;
+		} else if (lblk >= ex->lblk + ex->ext.count) {
+			lo = mid + 1;
+		} else {
+			return ex->ext.head + (lblk - ex->lblk) * bs;
+		}
+	}
+	return 0;
+}
+
+/* Account for the entry naming @ino in directory @d */
+static void check_dirent(struct dir *d, struct tomofs_dirent *de)
+{
+	uint64_t ino = de->i_ino;
+	uint64_t agno = ino / ag_inodes;
+	uint64_t slot = ino % ag_inodes;
+	uint8_t state;
+	uint8_t *ref;
+
+	if (agno >= tsb.ag_count || slot == 0) {
+		report("Directory %lu: '%.*s' names bad inode %lu",
+		    (unsigned long)d->ino, de->name_len, de->name,
+		    (unsigned long)ino);
+		return;
+	}
+	state = ags[agno].state[slot];
+	if (!(state & INO_USED)) {
+		report("Directory %lu: '%.*s' names free inode %lu",
+		    (unsigned long)d->ino, de->name_len, de->name,
+		    (unsigned long)ino);
+		return;
+	}
+	if ((state & INO_DIR && de->file_type !=
+	    tomofs_mode_to_dtype(S_IFDIR)) || (state & INO_REG &&
+	    de->file_type != tomofs_mode_to_dtype(S_IFREG))) {
+		report("Directory %lu: '%.*s' has the wrong type %u",
+		    (unsigned long)d->ino, de->name_len, de->name,
+		    de->file_type);
+	}
+	ref = &ags[agno].refs[slot];
+	if (__atomic_load_n(ref, __ATOMIC_RELAXED) < UINT8_MAX) {
+		__atomic_fetch_add(ref, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Check directory block @lblk of @d, a node at @depth whose hashes must
+ * fall in [@lo, @hi]. Returns the number of entries in the subtree.
+ */
+static uint64_t check_dx_node(struct dir *d, uint64_t lblk, int depth,
+    uint64_t lo, uint64_t hi)
+{
+	struct tomofs_dx_header *hdr;
+	struct tomofs_dx_entry *e;
+	struct tomofs_dx_slot *s;
+	struct tomofs_dirent *de;
+	uintptr_t addr = dir_map(d, lblk);
+	uint64_t count = 0;
+	uint64_t end;
+	unsigned int heap;
+	char *buf;
+	int i;
+
+	if (!addr) {
+		report("Directory %lu: block %lu is not mapped",
+		    (unsigned long)d->ino, (unsigned long)lblk);
+		return 0;
+	}
+	buf = xcalloc(1, bs);
+	read_at(buf, bs, addr);
+	hdr = (struct tomofs_dx_header *)buf;
+	if (hdr->magic != TOMOFS_DX_MAGIC ||
+	    (depth >= 0 && hdr->depth != depth)) {
+		report("Directory %lu: block %lu has a bad header",
+		    (unsigned long)d->ino, (unsigned long)lblk);
+		goto out;
+	}
+
+	if (hdr->depth > 0) {
+		e = (struct tomofs_dx_entry *)(hdr + 1);
+		if (hdr->max != TOMOFS_DX_ENTRIES(bs) || !hdr->entries ||
+		    hdr->entries > hdr->max) {
+			report("Directory %lu: index block %lu has %u of %u "
+			    "entries", (unsigned long)d->ino,
+			    (unsigned long)lblk, hdr->entries, hdr->max);
+			goto out;
+		}
+		for (i = 0; i < hdr->entries; i++) {
+			end = i + 1 < hdr->entries ? e[i + 1].hash : hi;
+			if (e[i].hash < lo || e[i].hash > end ||
+			    (i && e[i].hash < e[i - 1].hash)) {
+				report("Directory %lu: index block %lu is out "
+				    "of order", (unsigned long)d->ino,
+				    (unsigned long)lblk);
+				goto out;
+			}
+			count += check_dx_node(d, e[i].lblk, hdr->depth - 1,
+			    i ? e[i].hash : lo, end);
+		}
+		goto out;
+	}
+
+	/* Leaf: slots after the header, records from heap to the end */
+	s = (struct tomofs_dx_slot *)(hdr + 1);
+	heap = hdr->heap ? hdr->heap : bs;
+	if (sizeof(*hdr) + hdr->entries * sizeof(*s) > heap ||
+	    (!hdr->entries && hdr->heap)) {
+		report("Directory %lu: leaf %lu overflows",
+		    (unsigned long)d->ino, (unsigned long)lblk);
+		goto out;
+	}
+	for (i = 0; i < hdr->entries; i++) {
+		if (s[i].hash < lo || s[i].hash > hi ||
+		    (i && s[i].hash < s[i - 1].hash)) {
+			report("Directory %lu: leaf %lu is out of order",
+			    (unsigned long)d->ino, (unsigned long)lblk);
+			goto out;
+		}
+		if (s[i].off < heap || s[i].off % 8 ||
+		    (uint64_t)s[i].off + s[i].len > bs ||
+		    s[i].len < TOMOFS_DIRENT_LEN(1)) {
+			report("Directory %lu: leaf %lu has a bad record at %u",
+			    (unsigned long)d->ino, (unsigned long)lblk,
+			    s[i].off);
+			continue;
+		}
+		de = (struct tomofs_dirent *)(buf + s[i].off);
+		if (!de->name_len || TOMOFS_DIRENT_LEN(de->name_len) !=
+		    s[i].len) {
+			report("Directory %lu: leaf %lu has a bad name length "
+			    "at %u", (unsigned long)d->ino,
+			    (unsigned long)lblk, s[i].off);
+			continue;
+		}
+		if (tomofs_name_hash(de->name, de->name_len) != s[i].hash) {
+			report("Directory %lu: '%.*s' has the wrong hash",
+			    (unsigned long)d->ino, de->name_len, de->name);
+		}
+		check_dirent(d, de);
+		count++;
+	}
+
+out:
+	free(buf);
+	return count;
+}
+
+/* Pass 2: directory @item */
+static void check_dir(uint64_t item)
+{
+	struct dir *d = &dirs[item];
+	uint64_t count;
+
+	count = check_dx_node(d, 0, -1, 0, UINT32_MAX);
+	if (count != d->child_count) {
+		report("Directory %lu: %lu entries but child count %lu",
+		    (unsigned long)d->ino, (unsigned long)count,
+		    (unsigned long)d->child_count);
+	}
+}
+
+/* Pass 3: every inode but the root is named exactly once */
+static void check_links(void)
+{
+	uint64_t agno;
+	uint64_t slot;
+	uint64_t ino;
+	unsigned int want;
+	struct ag *ag;
+
+	for (agno = 0; agno < tsb.ag_count; agno++) {
+		ag = &ags[agno];
+		for (slot = 1; slot < ag_inodes; slot++) {
+			if (!(ag->state[slot] & INO_USED)) {
+				continue;
+			}
+			ino = agno * ag_inodes + slot;
+			want = ino == TOMOFS_ROOTDIR_INODE_NO ? 0 : 1;
+			if (ag->refs[slot] != want) {
+				report("Inode %lu: %u directory entries",
+				    (unsigned long)ino, ag->refs[slot]);
+			}
+		}
+	}
+	if (!(ags[0].state[TOMOFS_ROOTDIR_INODE_NO] & INO_DIR)) {
+		report("Root directory is missing");
+	}
+}
+
+/* Pass 3: every shared block is mapped as often as its count says */
+static void check_refcounts(void)
+{
+	uint64_t agno;
+	uint64_t blk;
+	struct ag *ag;
+
+	for (agno = 0; agno < tsb.ag_count; agno++) {
+		ag = &ags[agno];
+		if (!ag->refcount) {
+			continue;
+		}
+		for (blk = 0; blk < ag_blocks; blk++) {
+			if (ag->refcount[blk] &&
+			    ag->owners[blk] != ag->refcount[blk] + 1u) {
+				report("Block 0x%lx: %u owners but a refcount "
+				    "of %u", (unsigned long)
+				    ((agno * ag_blocks + blk) * bs),
+				    ag->owners[blk], ag->refcount[blk] + 1);
+			}
+		}
+	}
+}
+
+/*
+ * Pass 4: compare the ownership bitmap with the free space bitmap and the
+ * counted inodes with the descriptors. With @repair, write back the
+ * bitmap blocks and descriptors that differ. Returns the number of
+ * differences.
+ */
+static uint64_t check_free_space(int repair)
+{
+	uint64_t diffs = 0;
+	uint64_t agno;
+	uint64_t first;
+	uint64_t end;
+	uint64_t leaked;
+	uint64_t lost;
+	uint64_t blk;
+	uint64_t table_blocks;
+	uint64_t free_blocks = 0;
+	uint64_t inodes = 0;
+	uint8_t *dmap;
+	uint8_t *omap;
+	int dirty_descs = 0;
+
+	for (agno = 0; agno < tsb.ag_count; agno++) {
+		dmap = disk_map + agno * bs;
+		omap = owned_map + agno * bs;
+		/* Header blocks of the other groups are not in the bitmap */
+		first = agno ? TOMOFS_AG_HDR_BLKS : 0;
+		end = tsb.dev.block_cnt - agno * ag_blocks;
+		if (end > ag_blocks) {
+			end = ag_blocks;
+		}
+		leaked = 0;
+		lost = 0;
+		for (blk = first; blk < end; blk++) {
+			if (test_bit(omap, blk) && !test_bit(dmap, blk)) {
+				lost++;
+			} else if (!test_bit(omap, blk) && test_bit(dmap, blk)) {
+				leaked++;
+			} else if (!test_bit(omap, blk)) {
+				free_blocks++;
+			}
+		}
+		if (leaked || lost) {
+			printf("Group %lu: %lu blocks marked used are free, "
+			    "%lu in use are marked free\n",
+			    (unsigned long)agno, (unsigned long)leaked,
+			    (unsigned long)lost);
+			diffs++;
+			free_blocks += leaked;
+			if (repair) {
+				for (blk = 0; blk < first; blk++) {
+					omap[blk / 8] &= ~(1 << (blk % 8));
+				}
+				write_at(omap, bs,
+				    tsb.dev.block_map + agno * bs);
+			}
+		}
+		if (ags[agno].desc.inode_count != ags[agno].used) {
+			printf("Group %lu: inode count %lu, found %lu\n",
+			    (unsigned long)agno,
+			    (unsigned long)ags[agno].desc.inode_count,
+			    (unsigned long)ags[agno].used);
+			ags[agno].desc.inode_count = ags[agno].used;
+			dirty_descs = 1;
+			diffs++;
+		}
+		inodes += ags[agno].used;
+	}
+	printf("%lu of %lu blocks free\n", (unsigned long)free_blocks,
+	    (unsigned long)tsb.dev.block_cnt);
+
+	if (repair && dirty_descs) {
+		struct tomofs_ag_desc *descs;
+
+		table_blocks = (tsb.ag_count + TOMOFS_AG_DESC_PER_BLK(bs) - 1) /
+		    TOMOFS_AG_DESC_PER_BLK(bs);
+		descs = xcalloc(table_blocks, bs);
+		read_at(descs, table_blocks * bs, tsb.ag_table);
+		for (agno = 0; agno < tsb.ag_count; agno++) {
+			descs[agno].inode_count = ags[agno].used;
+		}
+		write_at(descs, table_blocks * bs, tsb.ag_table);
+		free(descs);
+	}
+
+	/* Only updated at sync time, so they may well be stale */
+	if (tsb.inode_count != inodes || tsb.free_blocks != free_blocks) {
+		printf("Super block counts %lu inodes and %lu free blocks, "
+		    "found %lu and %lu\n", (unsigned long)tsb.inode_count,
+		    (unsigned long)tsb.free_blocks, (unsigned long)inodes,
+		    (unsigned long)free_blocks);
+		tsb.inode_count = inodes;
+		tsb.free_blocks = free_blocks;
+		diffs++;
+		if (repair) {
+			write_at(&tsb, sizeof(tsb), 0);
+		}
+	}
+	return diffs;
+}
+
+/* Read and validate the super block, descriptors and free space bitmap */
+static void load_metadata(void)
+{
+	struct tomofs_ag_desc *descs;
+	struct jbd2_super jsb;
+	uint64_t table_blocks;
+	uint64_t i;
+
+	read_at(&tsb, sizeof(tsb), 0);
+	if ((uint32_t)tsb.magic != TOMOFS_SB_MAGIC) {
+		printf("Not a tomofs file system\n");
+		exit(FSCK_ERROR);
+	}
+	bits = tsb.blocksize_bits;
+	if (bits < TOMOFS_MIN_BLK_BITS || bits > TOMOFS_MAX_BLK_BITS) {
+		printf("Bad block size 2^%u\n", bits);
+		exit(FSCK_ERROR);
+	}
+	bs = 1UL << bits;
+	ag_blocks = TOMOFS_AG_BLOCKS(bs);
+	ag_inodes = TOMOFS_AG_INODES(bs);
+	if (tsb.ag_count != (tsb.dev.block_cnt + ag_blocks - 1) / ag_blocks) {
+		printf("Super block has %lu groups for %lu blocks\n",
+		    (unsigned long)tsb.ag_count,
+		    (unsigned long)tsb.dev.block_cnt);
+		exit(FSCK_ERROR);
+	}
+	table_blocks = (tsb.ag_count + TOMOFS_AG_DESC_PER_BLK(bs) - 1) /
+	    TOMOFS_AG_DESC_PER_BLK(bs);
+	if (!valid_range(tsb.ag_table, table_blocks) ||
+	    !valid_range(tsb.dev.block_map, tsb.ag_count) ||
+	    !valid_range(tsb.journal.head, tsb.journal.count)) {
+		printf("Super block metadata is out of range\n");
+		exit(FSCK_ERROR);
+	}
+
+	/* Replaying the journal could change everything below */
+	read_at(&jsb, sizeof(jsb), tsb.journal.head);
+	if (ntohl(jsb.h_magic) != JBD2_MAGIC_NUMBER) {
+		printf("Journal super block is missing\n");
+		exit(FSCK_ERROR);
+	}
+	if (jsb.s_start) {
+		printf("Journal needs recovery, mount the file system once "
+		    "first\n");
+		exit(FSCK_ERROR);
+	}
+
+	printf("%lu blocks of %lu bytes, %lu groups, %lu inodes\n",
+	    (unsigned long)tsb.dev.block_cnt, bs, (unsigned long)tsb.ag_count,
+	    (unsigned long)tsb.inode_count);
+
+	descs = xcalloc(table_blocks, bs);
+	read_at(descs, table_blocks * bs, tsb.ag_table);
+	ags = xcalloc(tsb.ag_count, sizeof(struct ag));
+	for (i = 0; i < tsb.ag_count; i++) {
+		ags[i].desc = descs[i];
+		if (!valid_range(descs[i].inode_bitmap, 1) ||
+		    !valid_range(descs[i].inode_chunks, 1) ||
+		    (descs[i].refcount_map &&
+		    !valid_range(descs[i].refcount_map, TOMOFS_REFCOUNT_BLKS))) {
+			printf("Group %lu: descriptor is out of range\n",
+			    (unsigned long)i);
+			exit(FSCK_ERROR);
+		}
+		if (verbose) {
+			printf("group %lu: inode bitmap 0x%lx, chunk map 0x%lx, "
+			    "%lu inodes\n", (unsigned long)i,
+			    (unsigned long)descs[i].inode_bitmap,
+			    (unsigned long)descs[i].inode_chunks,
+			    (unsigned long)descs[i].inode_count);
+		}
+		if (descs[i].refcount_map) {
+			ags[i].refcount = xcalloc(ag_blocks, sizeof(uint16_t));
+			ags[i].owners = xcalloc(ag_blocks, sizeof(uint32_t));
+			read_at(ags[i].refcount, ag_blocks * sizeof(uint16_t),
+			    descs[i].refcount_map);
+			if (verbose) {
+				printf("group %lu: refcount map 0x%lx\n",
+				    (unsigned long)i,
+				    (unsigned long)descs[i].refcount_map);
+			}
+		}
+	}
+	free(descs);
+
+	disk_map = xcalloc(tsb.ag_count, bs);
+	owned_map = xcalloc(tsb.ag_count, bs);
+	read_at(disk_map, tsb.ag_count * bs, tsb.dev.block_map);
+}
+
+int main(int argc, char **argv)
+{
+	int repair = 0;
+	int opt;
+	uint64_t diffs;
+	uint64_t problems;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "j:rv")) != -1) {
+		switch (opt) {
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'r':
+			repair = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			printf("Usage: %s [-j threads] [-r] [-v] device\n",
+			    argv[0]);
+			exit(FSCK_ERROR);
+		}
+	}
+	if (optind != argc - 1) {
+		printf("You must specify a block device\n");
+		exit(FSCK_ERROR);
+	}
+	if (nthreads < 1) {
+		nthreads = 1;
+	}
+
+	/* Nothing else may have it mounted while we look */
+	dev_fd = open(argv[optind], (repair ? O_RDWR : O_RDONLY) | O_EXCL);
+	if (dev_fd < 0) {
+		perror(argv[optind]);
+		exit(FSCK_ERROR);
+	}
+
+	load_metadata();
+	claim_metadata();
+
+	printf("Pass 1: inodes and extents\n");
+	run_parallel(check_ag_inodes, tsb.ag_count);
+	printf("Pass 2: %lu directories\n", (unsigned long)nr_dirs);
+	run_parallel(check_dir, nr_dirs);
+	printf("Pass 3: links and shared blocks\n");
+	check_links();
+	check_refcounts();
+	problems = nr_problems;
+	/* Blocks of anything we could not make sense of were not claimed */
+	if (problems && repair) {
+		printf("Not rebuilding free space with problems left\n");
+		repair = 0;
+	}
+	printf("Pass 4: free space\n");
+	diffs = check_free_space(repair);
+
+	if (repair && diffs && fsync(dev_fd)) {
+		perror("fsync");
+		exit(FSCK_ERROR);
+	}
+	close(dev_fd);
+
+	if (problems) {
+		printf("%lu problems left, fsck.tomofs only repairs free space "
+		    "and inode counts\n", (unsigned long)problems);
+		return FSCK_UNCORRECTED;
+	}
+	if (diffs) {
+		printf(repair ? "Free space rebuilt\n" :
+		    "Run with -r to rebuild the free space\n");
+		return repair ? FSCK_FIXED : FSCK_UNCORRECTED;
+	}
+	printf("Clean\n");
+	return FSCK_OK;
+}
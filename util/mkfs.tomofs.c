@@ -1,78 +1,930 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <dirent.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#include <arpa/inet.h>
 
 #include "tfs.h"
 
-#define TOMOFS_BLOCK_MAP TOMOFS_BLK_SIZE
-#define TOMOFS_INODES (TOMOFS_BLK_SIZE * 2)
-#define TOMOFS_ROOTDIR_RECORDS (TOMOFS_BLK_SIZE * 3)
+/*
+ * Head of the jbd2 journal superblock, which the kernel reads big-endian.
+ * s_start == 0 tells jbd2 the log is clean and has nothing to replay.
+ */
+struct jbd2_super {
+	uint32_t h_magic;
+	uint32_t h_blocktype;
+	uint32_t h_sequence;
+	uint32_t s_blocksize;
+	uint32_t s_maxlen;
+	uint32_t s_first;
+	uint32_t s_sequence;
+	uint32_t s_start;
+	uint32_t s_errno;
+	uint32_t s_feature_compat;
+	uint32_t s_feature_incompat;
+	uint32_t s_feature_ro_compat;
+	uint8_t s_uuid[16];
+	uint32_t s_nr_users;
+};
+
+#define JBD2_MAGIC_NUMBER 0xc03b3998U
+#define JBD2_SUPERBLOCK_V2 4
+#define JBD2_FEATURE_INCOMPAT_REVOKE 0x1
+
+/* Mark @count blocks from @start used in @bitmap */
+static void mark_used(char *bitmap, uint64_t start, uint64_t count)
+{
+	uint64_t i;
+
+	for (i = start; i < start + count; i++) {
+		bitmap[i / 8] |= 1 << (i % 8);
+	}
+}
+
+/* Write @len bytes of @buf at byte @off of the device, or exit */
+static void write_at(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, buf, len, off);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("write");
+			exit(1);
+		}
+		buf = (const char *)buf + ret;
+		len -= ret;
+		off += ret;
+	}
+}
+
+/*
+ * Zero @len bytes at @off without writing them from here: the device
+ * zeroes the range itself, or an image file gets a hole. Falls back to
+ * writing zeros.
+ */
+static void zero_range(int fd, int is_blkdev, off_t off, uint64_t len)
+{
+	static char zero[TOMOFS_BLK_SIZE];
+	uint64_t range[2] = { off, len };
+	uint64_t n;
+
+	if (!len) {
+		return;
+	}
+	if (is_blkdev && !ioctl(fd, BLKZEROOUT, range)) {
+		return;
+	}
+	if (!is_blkdev && !fallocate(fd, FALLOC_FL_PUNCH_HOLE |
+	    FALLOC_FL_KEEP_SIZE, off, len)) {
+		return;
+	}
+	while (len) {
+		n = len < sizeof(zero) ? len : sizeof(zero);
+		write_at(fd, zero, n, off);
+		off += n;
+		len -= n;
+	}
+}
+
+/* Size of the device or image in bytes */
+static uint64_t device_size(int fd, int *is_blkdev)
+{
+	struct stat st;
+	uint64_t size;
+
+	if (fstat(fd, &st)) {
+		perror("stat");
+		exit(1);
+	}
+	*is_blkdev = S_ISBLK(st.st_mode);
+	if (!*is_blkdev) {
+		return st.st_size;
+	}
+	if (ioctl(fd, BLKGETSIZE64, &size)) {
+		perror("BLKGETSIZE64");
+		exit(1);
+	}
+	return size;
+}
+
+/*
+ * About 1/64 of the device, within what jbd2 allows and leaving at least
+ * half of group 0 to the rest
+ */
+static uint64_t journal_blocks(uint64_t block_cnt, uint64_t meta_blocks,
+    unsigned long bs)
+{
+	uint64_t count = block_cnt / 64;
+
+	if (count > TOMOFS_JOURNAL_MAX_BYTES / bs) {
+		count = TOMOFS_JOURNAL_MAX_BYTES / bs;
+	}
+	if (meta_blocks + count > TOMOFS_AG_BLOCKS(bs) / 2) {
+		count = meta_blocks < TOMOFS_AG_BLOCKS(bs) / 2 ?
+		    TOMOFS_AG_BLOCKS(bs) / 2 - meta_blocks : 0;
+	}
+	if (count < TOMOFS_JOURNAL_BLKS) {
+		count = TOMOFS_JOURNAL_BLKS;
+	}
+	return count;
+}
+
+/*
+ * Image builder for -d
+ * Lays out a directory tree in the new file system in one pass. Blocks
+ * come from a bump pointer that only moves forward through the groups, so
+ * a directory's blocks and a file's data are contiguous unless they cross
+ * into the next group, and the image is written front to back. Inodes
+ * are numbered in the same order and fill one group after the other.
+ */
+#define BUILD_COPY_BYTES (1 << 20)
+
+/* Inode tables of a group, allocated once the group gets an inode */
+struct build_ag {
+	char *ibitmap;
+	uintptr_t *chunks;
+	char **tables;
+};
+
+struct builder {
+	int fd;
+	unsigned long bs;
+	uint64_t block_cnt;
+	uint64_t ag_count;
+	char *bitmap;
+	struct tomofs_ag_desc *descs;
+	struct build_ag *ags;
+	/* Next block to allocate and blocks allocated so far */
+	uint64_t next_blk;
+	uint64_t used_blocks;
+	uint64_t next_ino;
+	uint64_t inode_count;
+	char *buf;
+};
+
+/* A name found in a source directory */
+struct build_entry {
+	char *name;
+	uint8_t name_len;
+	uint32_t hash;
+	uint64_t ino;
+	struct tomofs_inode *t_inode;
+	struct stat st;
+};
+
+static void *xcalloc(size_t nmemb, size_t size)
+{
+	void *p = calloc(nmemb, size);
+
+	if (!p) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+/*
+ * Allocate up to @want blocks at the bump pointer into @e, stopping at the
+ * end of the group. With @contig, skip to the next group rather than
+ * return fewer. Returns the number of blocks allocated.
+ */
+static uint64_t build_alloc(struct builder *b, uint64_t want, int contig,
+    struct block_extent *e)
+{
+	uint64_t ag_blocks = TOMOFS_AG_BLOCKS(b->bs);
+	uint64_t end;
+	uint64_t count;
+
+	for (;;) {
+		/* Groups but the first start with their inode tables */
+		if (b->next_blk >= ag_blocks &&
+		    b->next_blk % ag_blocks < TOMOFS_AG_HDR_BLKS) {
+			b->next_blk += TOMOFS_AG_HDR_BLKS -
+			    b->next_blk % ag_blocks;
+		}
+		end = (b->next_blk / ag_blocks + 1) * ag_blocks;
+		if (end > b->block_cnt) {
+			end = b->block_cnt;
+		}
+		if (b->next_blk < end && (!contig ||
+		    end - b->next_blk >= want)) {
+			break;
+		}
+		if (end == b->block_cnt) {
+			printf("Device is too small for the source directory\n");
+			exit(1);
+		}
+		b->next_blk = end;
+	}
+	count = end - b->next_blk < want ? end - b->next_blk : want;
+	e->head = b->next_blk * b->bs;
+	e->count = count;
+	mark_used(b->bitmap, b->next_blk, count);
+	b->next_blk += count;
+	b->used_blocks += count;
+	return count;
+}
+
+/* Allocate @count blocks as a list of runs, returned in @nr_runs */
+static struct block_extent *build_alloc_runs(struct builder *b,
+    uint64_t count, uint64_t *nr_runs)
+{
+	struct block_extent *runs = NULL;
+	uint64_t n = 0;
+
+	while (count) {
+		runs = realloc(runs, (n + 1) * sizeof(struct block_extent));
+		if (!runs) {
+			printf("Out of memory\n");
+			exit(1);
+		}
+		count -= build_alloc(b, count, 0, &runs[n]);
+		n++;
+	}
+	*nr_runs = n;
+	return runs;
+}
+
+/* Map file blocks from 0 to @runs in @t_inode's extent tree */
+static void build_extents(struct builder *b, struct tomofs_inode *t_inode,
+    struct block_extent *runs, uint64_t nr_runs)
+{
+	struct tomofs_extent_header *hdr = &t_inode->extents.hdr;
+	struct tomofs_extent_header *leaf;
+	struct tomofs_extent *ex;
+	struct block_extent e;
+	uint64_t per_leaf = TOMOFS_BLK_EXTENTS(b->bs);
+	uint64_t nr_leaves;
+	uint64_t lblk = 0;
+	uint64_t i;
+	char *leaves;
+
+	hdr->magic = TOMOFS_EXTENT_MAGIC;
+	if (nr_runs <= TOMOFS_INODE_EXTENTS) {
+		hdr->max = TOMOFS_INODE_EXTENTS;
+		hdr->entries = nr_runs;
+		for (i = 0; i < nr_runs; i++) {
+			t_inode->extents.extents[i].lblk = lblk;
+			t_inode->extents.extents[i].ext = runs[i];
+			lblk += runs[i].count;
+		}
+		return;
+	}
+
+	/* One level of leaf blocks under the root */
+	nr_leaves = (nr_runs + per_leaf - 1) / per_leaf;
+	if (nr_leaves > TOMOFS_INODE_EXTENT_IDX) {
+		printf("Inode %lu is too fragmented\n",
+		    (unsigned long)t_inode->i_ino);
+		exit(1);
+	}
+	leaves = xcalloc(nr_leaves, b->bs);
+	build_alloc(b, nr_leaves, 1, &e);
+	hdr->max = TOMOFS_INODE_EXTENT_IDX;
+	hdr->depth = 1;
+	hdr->entries = nr_leaves;
+	for (i = 0; i < nr_runs; i++) {
+		leaf = (struct tomofs_extent_header *)
+		    (leaves + i / per_leaf * b->bs);
+		if (i % per_leaf == 0) {
+			leaf->magic = TOMOFS_EXTENT_MAGIC;
+			leaf->max = per_leaf;
+			t_inode->extents.idx[i / per_leaf].lblk = lblk;
+			t_inode->extents.idx[i / per_leaf].child = e.head +
+			    i / per_leaf * b->bs;
+		}
+		ex = (struct tomofs_extent *)(leaf + 1) + leaf->entries++;
+		ex->lblk = lblk;
+		ex->ext = runs[i];
+		lblk += runs[i].count;
+	}
+	write_at(b->fd, leaves, nr_leaves * b->bs, e.head);
+	free(leaves);
+}
+
+/* Take the next free inode number for @st */
+static struct tomofs_inode *build_new_inode(struct builder *b,
+    struct stat *st)
+{
+	uint64_t ag_inodes = TOMOFS_AG_INODES(b->bs);
+	uint64_t chunk_inodes = TOMOFS_INODE_CHUNK_INODES(b->bs);
+	struct tomofs_inode *t_inode;
+	struct block_extent e;
+	struct build_ag *ag;
+	uint64_t agno;
+	uint64_t slot;
+	uint64_t c;
+
+	/* Index 0 of every group is reserved */
+	if (b->next_ino % ag_inodes == 0) {
+		b->next_ino++;
+	}
+	agno = b->next_ino / ag_inodes;
+	slot = b->next_ino % ag_inodes;
+	if (agno >= b->ag_count) {
+		printf("Too many files for the device\n");
+		exit(1);
+	}
+	ag = &b->ags[agno];
+	if (!ag->ibitmap) {
+		ag->ibitmap = xcalloc(1, b->bs);
+		ag->chunks = xcalloc(1, b->bs);
+		ag->tables = xcalloc(TOMOFS_INODE_CHUNKS(b->bs), sizeof(char *));
+	}
+	c = slot / chunk_inodes;
+	if (!ag->tables[c]) {
+		ag->tables[c] = xcalloc(TOMOFS_INODE_CHUNK_BLKS, b->bs);
+	}
+	if (!ag->chunks[c]) {
+		build_alloc(b, TOMOFS_INODE_CHUNK_BLKS, 1, &e);
+		ag->chunks[c] = e.head;
+	}
+	mark_used(ag->ibitmap, slot, 1);
+	b->descs[agno].inode_count++;
+	b->inode_count++;
+
+	t_inode = (struct tomofs_inode *)(ag->tables[c] +
+	    (slot % chunk_inodes) * TOMOFS_INODE_SIZE);
+	t_inode->flags = TOMOFS_INODE_USED;
+	t_inode->i_ino = b->next_ino++;
+	t_inode->mode = st->st_mode & (S_IFMT | 07777);
+	t_inode->i_atime = st->st_atim;
+	t_inode->i_mtime = st->st_mtim;
+	t_inode->i_ctime = st->st_ctim;
+	return t_inode;
+}
+
+/* Copy the regular file @name of @dir_fd into @t_inode */
+static void build_file(struct builder *b, int dir_fd, const char *name,
+    struct tomofs_inode *t_inode, uint64_t size)
+{
+	struct block_extent *runs;
+	uint64_t nr_runs;
+	uint64_t left;
+	uint64_t i;
+	size_t len;
+	off_t off;
+	ssize_t ret;
+	int fd;
+
+	fd = openat(dir_fd, name, O_RDONLY);
+	if (fd < 0) {
+		perror(name);
+		exit(1);
+	}
+	t_inode->file_size = size;
+
+	/* Small files stay in the inode like the kernel leaves them */
+	if (size <= TOMOFS_INLINE_DATA) {
+		t_inode->flags |= TOMOFS_INODE_INLINE;
+		if (size && read(fd, t_inode->inline_data, size) < 0) {
+			perror(name);
+			exit(1);
+		}
+		close(fd);
+		return;
+	}
+
+	runs = build_alloc_runs(b, (size + b->bs - 1) / b->bs, &nr_runs);
+	for (i = 0; i < nr_runs; i++) {
+		left = runs[i].count * b->bs;
+		off = runs[i].head;
+		while (left) {
+			len = left < BUILD_COPY_BYTES ? left : BUILD_COPY_BYTES;
+			ret = read(fd, b->buf, len);
+			if (ret < 0) {
+				perror(name);
+				exit(1);
+			}
+			/* Zero the tail of the last block, and whatever shrank */
+			memset(b->buf + ret, 0, len - ret);
+			write_at(b->fd, b->buf, len, off);
+			off += len;
+			left -= len;
+		}
+	}
+	build_extents(b, t_inode, runs, nr_runs);
+	free(runs);
+	close(fd);
+}
+
+static int build_entry_cmp(const void *a, const void *b)
+{
+	const struct build_entry *x = a;
+	const struct build_entry *y = b;
+
+	return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+/*
+ * Lay out the sorted @entries as a directory hash tree in @nr_blocks
+ * blocks: the root at block 0, then the leaves, then any other index
+ * nodes. Leaves are filled up and never split a run of equal hashes.
+ */
+static char *build_dx(struct builder *b, struct build_entry *entries,
+    uint64_t n, uint64_t *nr_blocks)
+{
+	uint64_t per_node = TOMOFS_DX_ENTRIES(b->bs);
+	struct tomofs_dx_header *hdr;
+	struct tomofs_dx_entry *dx;
+	struct tomofs_dx_slot *slot;
+	struct tomofs_dirent *de;
+	uint64_t *first;
+	uint32_t *keys;
+	uint64_t *lblks;
+	uint64_t nr_leaves = 0;
+	uint64_t nodes;
+	uint64_t used = 0;
+	uint64_t run;
+	uint64_t blk;
+	uint64_t i;
+	uint64_t j;
+	uint16_t depth;
+	size_t len;
+	char *blocks;
+
+	/* Pick where each leaf starts */
+	first = xcalloc(n + 1, sizeof(uint64_t));
+	for (i = 0; i < n; i = j) {
+		run = 0;
+		for (j = i; j < n && entries[j].hash == entries[i].hash; j++) {
+			run += sizeof(struct tomofs_dx_slot) +
+			    TOMOFS_DIRENT_LEN(entries[j].name_len);
+		}
+		if (run > b->bs - sizeof(struct tomofs_dx_header)) {
+			printf("Too many names with hash 0x%x\n",
+			    entries[i].hash);
+			exit(1);
+		}
+		if (!nr_leaves || used + run > b->bs) {
+			first[nr_leaves++] = i;
+			used = sizeof(struct tomofs_dx_header);
+		}
+		used += run;
+	}
+	if (!nr_leaves) {
+		nr_leaves = 1;
+	}
+	first[nr_leaves] = n;
+
+	*nr_blocks = nr_leaves;
+	if (nr_leaves > 1) {
+		for (nodes = nr_leaves; nodes > per_node;
+		    nodes = (nodes + per_node - 1) / per_node) {
+			*nr_blocks += (nodes + per_node - 1) / per_node;
+		}
+		(*nr_blocks)++;
+	}
+	blocks = xcalloc(*nr_blocks, b->bs);
+	keys = xcalloc(nr_leaves, sizeof(uint32_t));
+	lblks = xcalloc(nr_leaves, sizeof(uint64_t));
+
+	for (i = 0; i < nr_leaves; i++) {
+		lblks[i] = nr_leaves > 1 ? i + 1 : 0;
+		keys[i] = i ? entries[first[i]].hash : 0;
+		hdr = (struct tomofs_dx_header *)(blocks + lblks[i] * b->bs);
+		hdr->magic = TOMOFS_DX_MAGIC;
+		slot = (struct tomofs_dx_slot *)(hdr + 1);
+		for (j = first[i]; j < first[i + 1]; j++) {
+			len = TOMOFS_DIRENT_LEN(entries[j].name_len);
+			hdr->heap = (hdr->heap ? hdr->heap : b->bs) - len;
+			de = (struct tomofs_dirent *)((char *)hdr + hdr->heap);
+			de->i_ino = entries[j].ino;
+			de->name_len = entries[j].name_len;
+			de->file_type = tomofs_mode_to_dtype(
+			    entries[j].st.st_mode);
+			memcpy(de->name, entries[j].name, de->name_len);
+			slot[hdr->entries].hash = entries[j].hash;
+			slot[hdr->entries].off = hdr->heap;
+			slot[hdr->entries].len = len;
+			hdr->entries++;
+		}
+	}
+
+	/* Index levels from the bottom up, until one node is left */
+	blk = nr_leaves + 1;
+	nodes = nr_leaves;
+	for (depth = 1; nodes > 1; depth++) {
+		for (i = 0; i * per_node < nodes; i++) {
+			hdr = (struct tomofs_dx_header *)(blocks +
+			    (nodes <= per_node ? 0 : blk) * b->bs);
+			hdr->magic = TOMOFS_DX_MAGIC;
+			hdr->max = per_node;
+			hdr->depth = depth;
+			dx = (struct tomofs_dx_entry *)(hdr + 1);
+			for (j = i * per_node; j < nodes &&
+			    j < (i + 1) * per_node; j++) {
+				dx[hdr->entries].hash = keys[j];
+				dx[hdr->entries].lblk = lblks[j];
+				hdr->entries++;
+			}
+			keys[i] = keys[i * per_node];
+			lblks[i] = nodes <= per_node ? 0 : blk++;
+		}
+		nodes = i;
+	}
+
+	free(first);
+	free(keys);
+	free(lblks);
+	return blocks;
+}
+
+/* Fill directory @t_dir from the source directory open at @dir_fd */
+static void build_dir(struct builder *b, int dir_fd,
+    struct tomofs_inode *t_dir)
+{
+	struct build_entry *entries = NULL;
+	struct build_entry *e;
+	struct block_extent *runs;
+	struct dirent *d;
+	uint64_t nr_runs;
+	uint64_t nr_blocks;
+	uint64_t n = 0;
+	uint64_t cap = 0;
+	uint64_t i;
+	uint64_t off;
+	size_t len;
+	char *blocks;
+	DIR *dir;
+	int fd;
+
+	fd = dup(dir_fd);
+	dir = fd < 0 ? NULL : fdopendir(fd);
+	if (!dir) {
+		perror("opendir");
+		exit(1);
+	}
+	/* Number every child first so the directory can be written */
+	while ((d = readdir(dir))) {
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) {
+			continue;
+		}
+		len = strlen(d->d_name);
+		if (n == cap) {
+			cap = cap ? cap * 2 : 64;
+			entries = realloc(entries,
+			    cap * sizeof(struct build_entry));
+			if (!entries) {
+				printf("Out of memory\n");
+				exit(1);
+			}
+		}
+		e = &entries[n];
+		if (fstatat(dir_fd, d->d_name, &e->st, AT_SYMLINK_NOFOLLOW)) {
+			perror(d->d_name);
+			exit(1);
+		}
+		if ((!S_ISREG(e->st.st_mode) && !S_ISDIR(e->st.st_mode)) ||
+		    len > TOMOFS_MAX_FILENAME_LEN) {
+			printf("Skipping %s: only regular files and "
+			    "directories with names up to %d bytes\n",
+			    d->d_name, TOMOFS_MAX_FILENAME_LEN);
+			continue;
+		}
+		e->name = strdup(d->d_name);
+		if (!e->name) {
+			printf("Out of memory\n");
+			exit(1);
+		}
+		e->name_len = len;
+		e->hash = tomofs_name_hash(e->name, len);
+		e->t_inode = build_new_inode(b, &e->st);
+		e->ino = e->t_inode->i_ino;
+		n++;
+	}
+	closedir(dir);
+
+	qsort(entries, n, sizeof(struct build_entry), build_entry_cmp);
+	blocks = build_dx(b, entries, n, &nr_blocks);
+	runs = build_alloc_runs(b, nr_blocks, &nr_runs);
+	off = 0;
+	for (i = 0; i < nr_runs; i++) {
+		write_at(b->fd, blocks + off, runs[i].count * b->bs,
+		    runs[i].head);
+		off += runs[i].count * b->bs;
+	}
+	build_extents(b, t_dir, runs, nr_runs);
+	t_dir->file_size = nr_blocks * b->bs;
+	t_dir->child_count = n;
+	free(runs);
+	free(blocks);
+
+	/* File data right after the directory, then the subdirectories */
+	for (i = 0; i < n; i++) {
+		if (S_ISREG(entries[i].st.st_mode)) {
+			build_file(b, dir_fd, entries[i].name,
+			    entries[i].t_inode, entries[i].st.st_size);
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (S_ISDIR(entries[i].st.st_mode)) {
+			fd = openat(dir_fd, entries[i].name,
+			    O_RDONLY | O_DIRECTORY);
+			if (fd < 0) {
+				perror(entries[i].name);
+				exit(1);
+			}
+			build_dir(b, fd, entries[i].t_inode);
+			close(fd);
+		}
+		free(entries[i].name);
+	}
+	free(entries);
+}
 
 int main(int argc, char **argv)
 {
 	int dev_fd;
-	struct block_dev dev;
-	struct block_extent init_extent;
+	int is_blkdev;
+	int opt;
+	unsigned long bs = TOMOFS_BLK_SIZE;
+	unsigned int bits;
 	struct tomofs_inode t_root;
-	struct tomofs_inode t_zero;
+	struct tomofs_inode *root;
+	struct tomofs_ag_desc *descs;
+	struct builder b = { 0 };
+	struct stat st;
+	const char *srcdir = NULL;
+	int src_fd;
 	char *zero;
+	char *bitmap;
+	char *table;
+	char *ibitmap;
+	uintptr_t *chunks;
+	struct tomofs_dx_header *dx;
+	uint64_t ag_count;
+	uint64_t table_blocks;
+	uint64_t meta_blocks;
+	uint64_t used_blocks;
+	uint64_t bitmap_blocks = 1;
+	uint64_t range[2];
+	uint64_t i;
+	uint64_t c;
+	uintptr_t block_map;
+	uintptr_t inode_table;
+	uintptr_t rootdir_records;
+	struct jbd2_super *jsb;
 
-	if (argc != 2) {
+	while ((opt = getopt(argc, argv, "b:d:")) != -1) {
+		switch (opt) {
+		case 'b':
+			bs = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			srcdir = optarg;
+			break;
+		default:
+			printf("Usage: %s [-b block size] [-d directory] device\n",
+			    argv[0]);
+			exit(1);
+		}
+	}
+	if (optind != argc - 1) {
 		printf("You must specify a block device\n");
 		exit(1);
 	}
+	bits = TOMOFS_MIN_BLK_BITS;
+	while (bits < TOMOFS_MAX_BLK_BITS && (1UL << bits) < bs) {
+		bits++;
+	}
+	if ((1UL << bits) != bs) {
+		printf("Block size must be a power of two from %u to %u\n",
+		    1 << TOMOFS_MIN_BLK_BITS, 1 << TOMOFS_MAX_BLK_BITS);
+		exit(1);
+	}
 	struct tomofs_super_block tsb = {
 		.magic = 0xdeadbeef,
+		.blocksize_bits = bits,
 		.inode_count = 1,
-		.inodes = TOMOFS_INODES,
 	};
 
-	tsb.dev.block_map = TOMOFS_BLOCK_MAP;
-	/* TODO: Calculate this */
-	tsb.dev.block_cnt = 0xfffffff;
+	dev_fd = open(argv[optind], O_RDWR);
+	if (dev_fd < 0) {
+		perror(argv[optind]);
+		exit(1);
+	}
 
-	dev_fd = open(argv[1], O_RDWR);
-	printf("0x0\n");
-	write(dev_fd, &tsb, sizeof(struct tomofs_super_block));
+	tsb.dev.block_cnt = device_size(dev_fd, &is_blkdev) / bs;
+	/*
+	 * Every group but the first needs room for its inode bitmap, chunk
+	 * map and some data
+	 */
+	if (tsb.dev.block_cnt > TOMOFS_AG_BLOCKS(bs) &&
+	    tsb.dev.block_cnt % TOMOFS_AG_BLOCKS(bs) <= TOMOFS_AG_HDR_BLKS) {
+		tsb.dev.block_cnt -= tsb.dev.block_cnt % TOMOFS_AG_BLOCKS(bs);
+	}
+	ag_count = (tsb.dev.block_cnt + TOMOFS_AG_BLOCKS(bs) - 1) /
+	    TOMOFS_AG_BLOCKS(bs);
+	table_blocks = (ag_count + TOMOFS_AG_DESC_PER_BLK(bs) - 1) /
+	    TOMOFS_AG_DESC_PER_BLK(bs);
 
-	/* Write block map */
-	lseek(dev_fd, TOMOFS_BLOCK_MAP, SEEK_SET);
-	printf("0x%x\n", TOMOFS_BLOCK_MAP);
-	init_extent.head = TOMOFS_ROOTDIR_RECORDS + TOMOFS_BLK_SIZE;
-	/* TODO: Calculate this */
-	init_extent.count = 0xffffffff;
-	write(dev_fd, &init_extent, sizeof(struct block_extent));
+	/*
+	 * super block, group descriptors, bitmap (one block per group),
+	 * group 0 inode bitmap, chunk map and first inode chunk,
+	 * rootdir records, journal
+	 */
+	tsb.ag_table = bs;
+	tsb.ag_count = ag_count;
+	block_map = tsb.ag_table + table_blocks * bs;
+	tsb.dev.block_map = block_map;
 
-	/* Write inode table and rootdir */
-	lseek(dev_fd, TOMOFS_INODES, SEEK_SET);
-	printf("0x%x\n", TOMOFS_INODES);
+	descs = (struct tomofs_ag_desc *)xcalloc(table_blocks, bs);
+	/* Only group 0's block is used unless -d fills more */
+	bitmap = (char *)xcalloc(ag_count, bs);
+	descs[0].inode_bitmap = block_map + ag_count * bs;
+	descs[0].inode_chunks = descs[0].inode_bitmap + bs;
+	descs[0].inode_count = 1;
+	inode_table = descs[0].inode_chunks + bs;
+	rootdir_records = inode_table +
+	    TOMOFS_INODE_CHUNK_BLKS * bs;
+	meta_blocks = rootdir_records / bs + 1;
+	tsb.journal.head = rootdir_records + bs;
+	tsb.journal.count = journal_blocks(tsb.dev.block_cnt, meta_blocks, bs);
+	used_blocks = meta_blocks + tsb.journal.count;
+	if (used_blocks >= tsb.dev.block_cnt) {
+		printf("Device is too small for tomofs\n");
+		exit(1);
+	}
+	if (used_blocks >= TOMOFS_AG_BLOCKS(bs)) {
+		printf("Device is too large for tomofs, %lu groups of metadata "
+		    "do not fit in the first one\n", (unsigned long)ag_count);
+		exit(1);
+	}
+	mark_used(bitmap, 0, used_blocks);
+	for (i = 1; i < ag_count; i++) {
+		descs[i].inode_bitmap = i * TOMOFS_AG_BLOCKS(bs) * bs;
+		descs[i].inode_chunks = descs[i].inode_bitmap + bs;
+		used_blocks += TOMOFS_AG_HDR_BLKS;
+	}
+
+	/* Old contents are garbage now, let thin or flash storage know */
+	if (is_blkdev) {
+		range[0] = 0;
+		range[1] = tsb.dev.block_cnt * bs;
+		printf("Discarding device blocks: %s\n",
+		    ioctl(dev_fd, BLKDISCARD, range) ? "not supported" : "done");
+	}
 
-	t_zero.i_ino = 0xdeadbeef;
-	write(dev_fd, &t_zero, sizeof(struct tomofs_inode));
+	/* Group 0 has the root inode in its first chunk */
+	ibitmap = (char *)xcalloc(1, bs);
+	chunks = (uintptr_t *)xcalloc(1, bs);
+	table = (char *)xcalloc(TOMOFS_INODE_CHUNK_BLKS, bs);
+	zero = (char *)xcalloc(1, bs);
+	mark_used(ibitmap, 0, 1);
+	mark_used(ibitmap, TOMOFS_ROOTDIR_INODE_NO, 1);
+	chunks[0] = inode_table;
 
+	memset(&t_root, 0, sizeof(struct tomofs_inode));
 	t_root.mode = S_IFDIR;
-	t_root.flags = 0 | 0x1;
-	t_root.i_ino = 1;
-	t_root.inode_block_ptr = TOMOFS_ROOTDIR_RECORDS;
-	printf("0x%x\n", TOMOFS_ROOTDIR_RECORDS);
+	t_root.flags = TOMOFS_INODE_USED;
+	t_root.i_ino = TOMOFS_ROOTDIR_INODE_NO;
+	t_root.extents.hdr.magic = TOMOFS_EXTENT_MAGIC;
+	t_root.extents.hdr.max = TOMOFS_INODE_EXTENTS;
+	t_root.extents.hdr.entries = 1;
+	t_root.extents.extents[0].lblk = 0;
+	t_root.extents.extents[0].ext.head = rootdir_records;
+	t_root.extents.extents[0].ext.count = 1;
+	t_root.file_size = bs;
 	t_root.child_count = 0;
-	write(dev_fd, &t_root, sizeof(struct tomofs_inode));
+	root = (struct tomofs_inode *)(table +
+	    TOMOFS_ROOTDIR_INODE_NO * sizeof(struct tomofs_inode));
+	memcpy(root, &t_root, sizeof(struct tomofs_inode));
 
-	/* zero fill rootdir records */
-	lseek(dev_fd, TOMOFS_ROOTDIR_RECORDS,
-	    SEEK_SET);
+	b.ags = (struct build_ag *)xcalloc(ag_count, sizeof(struct build_ag));
+	b.ags[0].ibitmap = ibitmap;
+	b.ags[0].chunks = chunks;
+	b.ags[0].tables = (char **)xcalloc(TOMOFS_INODE_CHUNKS(bs),
+	    sizeof(char *));
+	b.ags[0].tables[0] = table;
+	if (srcdir) {
+		printf("Copying %s\n", srcdir);
+		b.fd = dev_fd;
+		b.bs = bs;
+		b.block_cnt = tsb.dev.block_cnt;
+		b.ag_count = ag_count;
+		b.bitmap = bitmap;
+		b.descs = descs;
+		b.next_blk = tsb.journal.head / bs + tsb.journal.count;
+		b.next_ino = TOMOFS_ROOTDIR_INODE_NO + 1;
+		b.inode_count = 1;
+		b.buf = (char *)xcalloc(1, BUILD_COPY_BYTES);
+		src_fd = open(srcdir, O_RDONLY | O_DIRECTORY);
+		if (src_fd < 0 || fstat(src_fd, &st)) {
+			perror(srcdir);
+			exit(1);
+		}
+		/* The root gets blocks like any other directory */
+		bitmap[rootdir_records / bs / 8] &=
+		    ~(1 << (rootdir_records / bs % 8));
+		used_blocks--;
+		memset(&root->extents, 0, sizeof(root->extents));
+		root->mode = S_IFDIR | (st.st_mode & 07777);
+		root->i_atime = st.st_atim;
+		root->i_mtime = st.st_mtim;
+		root->i_ctime = st.st_ctim;
+		build_dir(&b, src_fd, root);
+		close(src_fd);
+		used_blocks += b.used_blocks;
+		tsb.inode_count = b.inode_count;
+		bitmap_blocks = (b.next_blk - 1) / TOMOFS_AG_BLOCKS(bs) + 1;
+		printf("%lu inodes, %lu blocks\n", (unsigned long)b.inode_count,
+		    (unsigned long)b.used_blocks);
+	}
 
-	zero = (char *)malloc(TOMOFS_BLK_SIZE);
-	memset(zero, 0, TOMOFS_BLK_SIZE);
-	write(dev_fd, zero, TOMOFS_BLK_SIZE);
+	tsb.free_blocks = tsb.dev.block_cnt - used_blocks;
+	printf("0x0\n");
+	write_at(dev_fd, &tsb, sizeof(struct tomofs_super_block), 0);
+
+	/* Write group descriptors */
+	printf("0x%lx: %lu allocation groups\n", tsb.ag_table,
+	    (unsigned long)ag_count);
+	write_at(dev_fd, descs, table_blocks * bs, tsb.ag_table);
+
+	/* Write free space bitmap, the groups past what we used are empty */
+	printf("0x%lx\n", block_map);
+	write_at(dev_fd, bitmap, bitmap_blocks * bs, block_map);
+	zero_range(dev_fd, is_blkdev, block_map + bitmap_blocks * bs,
+	    (ag_count - bitmap_blocks) * bs);
+
+	/* Inode bitmaps and chunk maps, index 0 is never allocated */
+	for (i = 1; i < ag_count; i++) {
+		if (!b.ags[i].ibitmap) {
+			zero_range(dev_fd, is_blkdev, descs[i].inode_bitmap,
+			    TOMOFS_AG_HDR_BLKS * bs);
+			continue;
+		}
+		write_at(dev_fd, b.ags[i].ibitmap, bs, descs[i].inode_bitmap);
+		write_at(dev_fd, b.ags[i].chunks, bs, descs[i].inode_chunks);
+	}
+	printf("0x%lx\n", descs[0].inode_bitmap);
+	write_at(dev_fd, ibitmap, bs, descs[0].inode_bitmap);
+	write_at(dev_fd, chunks, bs, descs[0].inode_chunks);
+
+	/* Write inode tables, group 0's first chunk holds the rootdir */
+	printf("0x%lx\n", inode_table);
+	for (i = 0; i < ag_count; i++) {
+		if (!b.ags[i].tables) {
+			continue;
+		}
+		for (c = 0; c < TOMOFS_INODE_CHUNKS(bs); c++) {
+			if (b.ags[i].tables[c]) {
+				write_at(dev_fd, b.ags[i].tables[c],
+				    TOMOFS_INODE_CHUNK_BLKS * bs,
+				    b.ags[i].chunks[c]);
+			}
+		}
+	}
+
+	/* Without a source, rootdir starts out as a single empty leaf */
+	if (!srcdir) {
+		printf("0x%lx\n", rootdir_records);
+		dx = (struct tomofs_dx_header *)zero;
+		dx->magic = TOMOFS_DX_MAGIC;
+		write_at(dev_fd, zero, bs, rootdir_records);
+	}
+
+	/* Journal superblock, then an empty log */
+	printf("0x%lx: journal, %lu blocks\n", tsb.journal.head,
+	    (unsigned long)tsb.journal.count);
+	memset(zero, 0, bs);
+	jsb = (struct jbd2_super *)zero;
+	jsb->h_magic = htonl(JBD2_MAGIC_NUMBER);
+	jsb->h_blocktype = htonl(JBD2_SUPERBLOCK_V2);
+	jsb->s_blocksize = htonl(bs);
+	jsb->s_maxlen = htonl(tsb.journal.count);
+	jsb->s_first = htonl(1);
+	jsb->s_sequence = htonl(1);
+	jsb->s_feature_incompat = htonl(JBD2_FEATURE_INCOMPAT_REVOKE);
+	jsb->s_nr_users = htonl(1);
+	write_at(dev_fd, zero, bs, tsb.journal.head);
+	/* Stale blocks in the log could be mistaken for transactions */
+	zero_range(dev_fd, is_blkdev, tsb.journal.head + bs,
+	    (tsb.journal.count - 1) * bs);
+
+	if (fsync(dev_fd)) {
+		perror("fsync");
+		exit(1);
+	}
 
-	printf("0x%x\n", init_extent.head);
+	printf("%lu of %lu blocks free\n", (unsigned long)tsb.free_blocks,
+	    (unsigned long)tsb.dev.block_cnt);
 
 	close(dev_fd);
 